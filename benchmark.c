@@ -0,0 +1,376 @@
+/**@file benchmark.c
+ * @brief Benchmarks for the 'pickle' interpreter, run with the system
+ * allocator, the pool allocator in 'block.c', its buddy allocator, and with a
+ * pool shared by an interpreter on each of several threads. Results are printed to 'stdout' as
+ * JSON, with the time and number of allocations per operation, so they can
+ * be compared between versions.
+ * @author Richard James Howe
+ * @license BSD */
+
+#ifdef __unix__
+#define _POSIX_C_SOURCE (200112L) /* clock_gettime, pthreads */
+#endif
+
+#include "pickle.h"
+#include "block.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef __unix__
+#include <pthread.h>
+#define USE_THREADS (1)
+#else
+#define USE_THREADS (0)
+#endif
+
+#define UNUSED(X) ((void)(X))
+#define THREADS   (4) /* interpreters run at once on a shared pool */
+#define BUDDY_SZ  (1 << 22) /* bytes given to the buddy allocator */
+
+enum { SYSTEM, POOL, BUDDY, SHARED, ALLOCATORS };
+
+static const char *allocators[] = { "system", "pool", "buddy", "shared" };
+
+typedef struct {
+	pool_t *pool;          /* pool to allocate from, or NULL for the system allocator */
+	pool_cache_t *cache;   /* if not NULL, allocate from the shared pool through this instead */
+	unsigned long allocs;  /* calls to malloc and realloc */
+	unsigned long moves;   /* calls to realloc that moved the memory, so copied it */
+} counter_t;
+
+typedef struct {
+	const char *name;      /* name reported in the results */
+	const char *setup;     /* evaluated once, not timed */
+	const char *script;    /* evaluated 'iterations' times, one evaluation is an operation */
+	unsigned long iterations;
+} benchmark_t;
+
+static void *counted_malloc(void *a, size_t length) {
+	counter_t *c = a;
+	c->allocs++;
+	if (c->cache)
+		return pool_cache_malloc(c->cache, length);
+	return c->pool ? pool_malloc(c->pool, length) : malloc(length);
+}
+
+static void *counted_realloc(void *a, void *v, size_t length) {
+	counter_t *c = a;
+	c->allocs++;
+	void *r = NULL;
+	if (c->cache)
+		r = pool_cache_realloc(c->cache, v, length);
+	else
+		r = c->pool ? pool_realloc(c->pool, v, length) : realloc(v, length);
+	c->moves += v && r && r != v;
+	return r;
+}
+
+static int counted_free(void *a, void *v) {
+	counter_t *c = a;
+	if (c->cache)
+		return pool_cache_free(c->cache, v);
+	if (c->pool)
+		return pool_free(c->pool, v);
+	free(v);
+	return 0;
+}
+
+static double now_ns(void) {
+#ifdef __unix__
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t) == 0)
+		return (t.tv_sec * 1e9) + t.tv_nsec;
+#endif
+	return ((double)clock() / CLOCKS_PER_SEC) * 1e9;
+}
+
+static const benchmark_t benchmarks[] = {
+	{
+		.name = "parse",
+		.setup = "",
+		.script =
+			"set a 1; set b \"x $a [set a] {y}\"\n"
+			"# a comment, which must be skipped\n"
+			"set c {a {b c} d}; set d [string length $c]\n"
+			"if {== $a 1} { set e \"$b $c\" } else { set e {} }\n",
+		.iterations = 20000,
+	},
+	{
+		.name = "loop",
+		.setup = "",
+		.script = "set j 0; while {< $j 100} { incr j }",
+		.iterations = 2000,
+	},
+	{
+		.name = "proc",
+		.setup = "proc add {x y} { + $x $y }",
+		.script = "for {set j 0} {< $j 100} {incr j} { add $j 1 }",
+		.iterations = 1000,
+	},
+	{
+		.name = "recursion",
+		.setup = "proc fib {n} { if {< $n 2} { return $n }; + [fib [- $n 1]] [fib [- $n 2]] }",
+		.script = "fib 12",
+		.iterations = 500,
+	},
+	{
+		.name = "variables",
+		.setup = "proc locals {} { set a 1; set b $a; set c [set b]; incr a; unset c; set a }",
+		.script = "set a 1; set b $a; set c [set b]; incr a; unset c; locals",
+		.iterations = 20000,
+	},
+	{
+		.name = "list",
+		.setup = "",
+		.script =
+			"set l {}\n"
+			"for {set k 0} {< $k 32} {incr k} { lappend l [- 100 $k] }\n"
+			"lindex $l 7; llength $l; lsort -integer $l; lsearch $l 80\n",
+		.iterations = 1000,
+	},
+	{
+		.name = "string",
+		.setup = "set s {The quick brown fox jumps over the lazy dog}",
+		.script =
+			"string length $s; string toupper $s; string first fox $s\n"
+			"string range $s 4 8; string repeat ab 8; join [split $s { }] ,\n",
+		.iterations = 10000,
+	},
+	{
+		.name = "regex",
+		.setup = "set s {The quick brown fox jumps over the lazy dog}",
+		.script =
+			"reg {q.*k} $s; reg {^The.*dog$} $s; reg -nocase {LAZY} $s\n"
+			"string match *fox* $s; string match T?e* $s\n",
+		.iterations = 10000,
+	},
+	{
+		.name = "append",
+		.setup = "",
+		.script =
+			"set s {}; for {set k 0} {< $k 60} {incr k} { append s abcdefgh }\n"
+			"set t {}; for {set k 0} {< $k 64} {incr k} { set t [concat $t $k] }\n",
+		.iterations = 200,
+	},
+	{
+		.name = "allocation",
+		.setup = "",
+		.script =
+			"for {set k 0} {< $k 32} {incr k} { set v$k [string repeat x $k] }\n"
+			"for {set k 0} {< $k 32} {incr k} { unset v$k }\n",
+		.iterations = 1000,
+	},
+};
+
+static pool_t *pool_create(void) {
+	static const pool_specification_t specs[] = { /* as 'pickle -a' */
+		{ 8,   512 },
+		{ 16,  256 },
+		{ 32,  256 },
+		{ 64,  256 },
+		{ 128,  32 },
+		{ 256,  16 },
+		{ 512,   8 },
+	};
+	pool_t *p = pool_new(sizeof(specs) / sizeof(specs[0]), &specs[0]);
+	if (p) {
+		p->grow    = true;
+		p->release = true;
+	}
+	return p;
+}
+
+/* A gate holds the threads of a shared run back until all of them have set
+ * up and warmed up, so that none of that is timed. */
+struct gate;
+
+#if USE_THREADS
+struct gate {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	size_t waiting; /* threads that have reached the gate */
+	int open;
+};
+#endif
+
+static void gate_pass(struct gate *g) {
+#if USE_THREADS
+	if (!g)
+		return;
+	pthread_mutex_lock(&g->lock);
+	g->waiting++;
+	pthread_cond_broadcast(&g->changed);
+	while (!g->open)
+		pthread_cond_wait(&g->changed, &g->lock);
+	pthread_mutex_unlock(&g->lock);
+#else
+	(void)g;
+#endif
+}
+
+typedef struct {
+	const benchmark_t *b;
+	pool_t *pool;          /* NULL for the system allocator */
+	pool_shared_t *shared; /* if not NULL, 'pool' is shared through it */
+	struct gate *gate;     /* if not NULL, wait here before timing */
+	double begin, end, ns; /* results */
+	unsigned long allocs, moves;
+	int r;
+} measure_t;
+
+static int measure(measure_t *m) {
+	assert(m);
+	const benchmark_t *b = m->b;
+	counter_t c = { .pool = m->pool, .cache = NULL, .allocs = 0, .moves = 0 };
+	pickle_allocator_t allocator = {
+		.malloc  = counted_malloc,
+		.realloc = counted_realloc,
+		.free    = counted_free,
+		.arena   = &c,
+	};
+	pickle_t *i = NULL;
+	int r = -1, passed = 0;
+	if (m->shared && !(c.cache = pool_cache_new(m->shared)))
+		goto fail;
+	if (pickle_new(&i, &allocator) != PICKLE_OK)
+		goto fail;
+	if (pickle_eval(i, b->setup) != PICKLE_OK)
+		goto fail;
+	if (pickle_eval(i, b->script) != PICKLE_OK) /* warm up, and check it works */
+		goto fail;
+	gate_pass(m->gate);
+	passed = 1;
+	const unsigned long allocs = c.allocs, moves = c.moves;
+	m->begin = now_ns();
+	for (unsigned long j = 0; j < b->iterations; j++)
+		if (pickle_eval(i, b->script) != PICKLE_OK)
+			goto fail;
+	m->end = now_ns();
+	m->ns = m->end - m->begin;
+	m->allocs = c.allocs - allocs;
+	m->moves = c.moves - moves;
+	r = 0;
+fail:
+	if (!passed) /* the others wait for every thread to reach the gate */
+		gate_pass(m->gate);
+	if (r < 0) {
+		const char *e = "unknown";
+		if (i)
+			(void)pickle_get_result_string(i, &e);
+		fprintf(stderr, "benchmark '%s' (%s) failed: %s\n", b->name, allocators[m->shared ? SHARED : m->pool ? (m->pool->buddy ? BUDDY : POOL) : SYSTEM], e);
+	}
+	if (pickle_delete(i) != PICKLE_OK)
+		r = -1;
+	pool_cache_delete(c.cache);
+	return m->r = r;
+}
+
+#if USE_THREADS
+static void *measure_thread(void *m) {
+	(void)measure(m);
+	return NULL;
+}
+#endif
+
+/* Each of 'THREADS' interpreters runs the benchmark on a thread of its own,
+ * all allocating from the same pool. The threads start timing together once
+ * all are set up; the time reported is from the first start to the last
+ * finish divided by 'THREADS', so it is per operation done. Thread creation,
+ * setup and warm up are not timed. */
+static int measure_shared(measure_t *m) {
+	assert(m);
+	int r = -1;
+#if USE_THREADS
+	pthread_t threads[THREADS];
+	measure_t ms[THREADS];
+	size_t started = 0;
+	struct gate g = { .waiting = 0, .open = 0, };
+	if (pthread_mutex_init(&g.lock, NULL))
+		return -1;
+	if (pthread_cond_init(&g.changed, NULL)) {
+		pthread_mutex_destroy(&g.lock);
+		return -1;
+	}
+	if (!(m->shared = pool_shared_new(m->pool, 16)))
+		goto done;
+	m->gate = &g;
+	for (; started < THREADS; started++) {
+		ms[started] = *m;
+		if (pthread_create(&threads[started], NULL, measure_thread, &ms[started]))
+			break;
+	}
+	pthread_mutex_lock(&g.lock); /* open the gate once all started threads are waiting */
+	while (g.waiting < started)
+		pthread_cond_wait(&g.changed, &g.lock);
+	g.open = 1;
+	pthread_cond_broadcast(&g.changed);
+	pthread_mutex_unlock(&g.lock);
+	r = started == THREADS ? 0 : -1;
+	m->allocs = 0;
+	m->moves = 0;
+	for (size_t j = 0; j < started; j++) {
+		if (pthread_join(threads[j], NULL) || ms[j].r < 0) {
+			r = -1;
+			continue;
+		}
+		m->begin = j && m->begin < ms[j].begin ? m->begin : ms[j].begin;
+		m->end   = j && m->end   > ms[j].end   ? m->end   : ms[j].end;
+		m->allocs += ms[j].allocs / THREADS;
+		m->moves += ms[j].moves / THREADS;
+	}
+	m->ns = r < 0 ? 0 : (m->end - m->begin) / THREADS;
+	m->gate = NULL;
+	pool_shared_delete(m->shared);
+done:
+	pthread_cond_destroy(&g.changed);
+	pthread_mutex_destroy(&g.lock);
+#endif
+	return m->r = r;
+}
+
+static int run(const benchmark_t *b, const int kind, FILE *out, const int first) {
+	assert(b);
+	assert(out);
+	measure_t m = { .b = b, .pool = NULL, .shared = NULL, .gate = NULL, };
+	int r = -1;
+	if (kind != SYSTEM && !(m.pool = kind == BUDDY ? pool_buddy_new(16, BUDDY_SZ) : pool_create()))
+		goto fail;
+	if ((kind == SHARED ? measure_shared(&m) : measure(&m)) < 0)
+		goto fail;
+	const double ops = b->iterations;
+	if (fprintf(out, "%s\t\t{ \"name\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, \"iterations\": %lu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"moves_per_op\": %.2f }",
+			first ? "" : ",\n", b->name, allocators[kind], kind == SHARED ? THREADS : 1, b->iterations, m.ns / ops, m.allocs / ops, m.moves / ops) < 0)
+		goto fail;
+	r = 0;
+fail:
+	pool_delete(m.pool);
+	return r;
+}
+
+int main(int argc, char **argv) {
+	const char *only = argc > 1 ? argv[1] : NULL; /* optionally run only the named benchmark */
+	int r = 0, first = 1;
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [name]\n", argv[0]);
+		return 1;
+	}
+	if (fprintf(stdout, "{\n\t\"version\": \"%lx\",\n\t\"benchmarks\": [\n", pickle_version()) < 0)
+		return 1;
+	for (size_t j = 0; j < sizeof(benchmarks)/sizeof(benchmarks[0]); j++) {
+		if (only && strcmp(only, benchmarks[j].name))
+			continue;
+		for (int kind = SYSTEM; kind < ALLOCATORS; kind++) {
+			if (kind == SHARED && !USE_THREADS)
+				continue;
+			if (run(&benchmarks[j], kind, stdout, first) < 0)
+				r = 1;
+			else
+				first = 0; /* only once a result has been printed, so the list stays valid JSON */
+		}
+	}
+	if (fprintf(stdout, "\n\t]\n}\n") < 0)
+		r = 1;
+	return r;
+}
@@ -7,7 +7,9 @@
  * sections as well as some optional tests. The sections are a bitmap data
  * structure used to store the free list, an allocator that can return fixed
  * size blocks and an allocator that can return blocks from multiple different
- * allocators of varying block widths.
+ * allocators of varying block widths, or from a buddy allocator instead,
+ * which can resize blocks in place. A pool may also be shared between
+ * threads, through a cache of free blocks per thread, where pthreads exist.
  *
  * There are some restrictions on the block sizes, counts and alignment. The
  * block sizes need to be a power of two. All memory used by the block
@@ -22,10 +24,15 @@
  * stack, as you see fit. You do not have to use 'pool_new' to create a new
  * pool. */
 
+#ifdef __unix__
+#define _POSIX_C_SOURCE (200112L) /* pthreads */
+#endif
+
 #include "block.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <limits.h>
@@ -41,6 +48,18 @@
 #define MAX(X, Y)   ((X) > (Y) ? (X) : (Y))
 #define FAIL_PROBABILITY (RAND_MAX/1000)
 #define FAIL_SEED   (1987)
+#define INDEX_MAX   (4096) /* maximum entries in the pointer to arena index of a pool */
+#define SLAB_BYTES  (4096) /* minimum size of the memory of a slab a pool grows by */
+#define MAX_ALIGN   (offsetof(struct max_align, u)) /* C99 has no 'max_align_t' */
+
+struct max_align { char c; union { long double ld; long long ll; void *p; void (*f)(void); } u; };
+
+#if defined(__unix__) && (defined(__GNUC__) || defined(__clang__))
+#include <pthread.h>
+#define THREADS     (1) /* Shared pools, using pthreads and the GCC atomic built-ins */
+#else
+#define THREADS     (0)
+#endif
 
 size_t bitmap_units(size_t bits) {
 	return bits/BITS + !!(bits & MASK);
@@ -90,25 +109,25 @@ bitmap_t *bitmap_copy(const bitmap_t *b) {
 void bitmap_set(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	b->map[bit/BITS] |=  (1u << (bit & MASK));
+	b->map[bit/BITS] |=  ((bitmap_unit_t)1 << (bit & MASK));
 }
 
 void bitmap_clear(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	b->map[bit/BITS] &= ~(1u << (bit & MASK));
+	b->map[bit/BITS] &= ~((bitmap_unit_t)1 << (bit & MASK));
 }
 
 void bitmap_toggle(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	b->map[bit/BITS] ^=  (1u << (bit & MASK));
+	b->map[bit/BITS] ^=  ((bitmap_unit_t)1 << (bit & MASK));
 }
 
 bool bitmap_get(bitmap_t *b, size_t bit) {
 	assert(b);
 	assert(bit < b->bits);
-	return !!(b->map[bit/BITS] & (1u << (bit & MASK)));
+	return !!(b->map[bit/BITS] & ((bitmap_unit_t)1 << (bit & MASK)));
 }
 
 static inline size_t block_count(block_arena_t *a) {
@@ -116,13 +135,74 @@ static inline size_t block_count(block_arena_t *a) {
 	return bitmap_bits(&a->freelist);
 }
 
+/* Index of the lowest set bit of 'x', which must not be zero */
+static inline unsigned bitmap_ctz(bitmap_unit_t x) {
+	assert(x);
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(x);
+#else
+	unsigned r = 0;
+	if (!(x & 0xFFFFFFFFull)) { r += 32; x >>= 32; }
+	if (!(x & 0xFFFFull))     { r += 16; x >>= 16; }
+	if (!(x & 0xFFull))       { r += 8;  x >>= 8;  }
+	if (!(x & 0xFull))        { r += 4;  x >>= 4;  }
+	if (!(x & 0x3ull))        { r += 2;  x >>= 2;  }
+	return r + !(x & 1);
+#endif
+}
+
+/* Smallest 'n' such that '2^n >= x' */
+static inline unsigned ceil_log2(size_t x) {
+	if (x <= 1)
+		return 0;
+	x--;
+#if defined(__GNUC__) || defined(__clang__)
+	return (sizeof(unsigned long long)*CHAR_BIT) - __builtin_clzll(x);
+#else
+	unsigned r = 0;
+	for (; x; x >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+/* Search the bitmap for a free block, a word at a time, starting from the
+ * word the last search ended in. Runs of full words are skipped four at a
+ * time, which compilers can turn into vector instructions, and the first
+ * free bit in a word is found by counting its trailing zeros. Bits past the
+ * end of the last word are clear, so any found there are discarded. */
+static long block_search(block_arena_t *a) {
+	assert(a);
+	bitmap_t *b = &a->freelist;
+	const bitmap_unit_t *u = b->map, full = (bitmap_unit_t)-1;
+	const size_t units = bitmap_units(b->bits);
+	size_t i = bitmap_unit_index(a->lastalloc);
+	for (size_t c = 0; c < units;) {
+		if ((i + 4) <= units && (c + 4) <= units && (u[i] & u[i + 1] & u[i + 2] & u[i + 3]) == full) {
+			c += 4;
+			i = (i + 4) == units ? 0 : i + 4;
+			continue;
+		}
+		if (u[i] != full) {
+			const size_t bit = (i * BITS) + bitmap_ctz(~u[i]);
+			if (bit < b->bits) {
+				a->lastalloc = bit;
+				return bit;
+			}
+		}
+		c++;
+		i = (i + 1) == units ? 0 : i + 1;
+	}
+	return -1;
+}
+
 /* NOTES: Speeding up this function increases the speed of allocation,
  * deallocation is very fast as it is just clearing a bit field, but for
  * allocation it the allocator has to find a free bit which can mean traversing
- * the entire bitfield. Some potential operations include keeping a stack of
- * values just recently freed (like keeping a free list), or micro
- * optimizations such as using a highly optimized version of 'memchr' if your
- * library provides one. */
+ * the entire bitfield. Recently freed blocks are kept in a small ring, and
+ * are handed out again last in first out, before resorting to a search. A
+ * block in the ring may have since been found by a search, so the bitmap
+ * still has the final say. */
 static inline long block_find_free(block_arena_t *a) {
 	assert(a);
 	if (FIND_BY_BIT) { /* much slower, simpler */
@@ -133,26 +213,14 @@ static inline long block_find_free(block_arena_t *a) {
 				return i;
 		return -1;
 	}
-	if (a->lastfree) {
-		const long r = a->lastfree;
-		a->lastfree = 0;
-		bitmap_get(&a->freelist, r);
-		return r;
+	while (a->cached) {
+		a->head = (a->head - 1) & (BLOCK_CACHE - 1);
+		a->cached--;
+		const size_t r = a->cache[a->head];
+		if (!bitmap_get(&a->freelist, r))
+			return r;
 	}
-	bitmap_t *b = &a->freelist;
-	bitmap_unit_t *u = b->map;
-	size_t max = bitmap_unit_index(b->bits), start = bitmap_unit_index(a->lastalloc);
-	for (size_t c = 0, i = start; c <= max; i = (i + 1) % (max ? max : 1) /*& (max - 1)*/, c++)
-		if (u[i] != (bitmap_unit_t)-1uLL) {
-			const size_t index = i * BITS;
-			const size_t end = MIN(b->bits, (index + BITS));
-			for (size_t j = index; j < end; j++)
-				if (!bitmap_get(b, j)) {
-					a->lastalloc = j;
-					return j;
-				}
-		}
-	return -1;
+	return block_search(a);
 }
 
 static inline bool is_aligned(void *v) {
@@ -178,11 +246,9 @@ void *block_malloc(block_arena_t *a, size_t length) {
 	const long f = block_find_free(a);
 	if (f < 0)
 		return NULL;
-	if (STATISTICS) {
-		a->active++;
-		if (a->max < a->active)
-			a->max = a->active;
-	}
+	a->active++; /* always counted, a pool uses it to find full and empty slabs */
+	if (STATISTICS && a->max < a->active)
+		a->max = a->active;
 	bitmap_set(&a->freelist, f);
 	void *r = ((char*)a->memory) + (f * a->blocksz);
 	assert(is_aligned(r));
@@ -201,7 +267,7 @@ void *block_calloc(block_arena_t *a, size_t length) {
 static inline int block_arena_valid_pointer(block_arena_t *a, void *v) {
 	assert(a);
 	const size_t max = block_count(a);
-	if (v < a->memory || (char*)v > ((char*)a->memory + (max * a->blocksz)))
+	if (v < a->memory || (char*)v >= ((char*)a->memory + (max * a->blocksz)))
 		return 0;
 	return 1;
 }
@@ -222,10 +288,11 @@ int block_free(block_arena_t *a, void *v) {
 			abort();
 		return -1;
 	}
-	if (STATISTICS)
-		a->active--;
+	a->active--;
 	bitmap_clear(&a->freelist, bit);
-	a->lastfree = bit;
+	a->cache[a->head] = bit; /* overwriting the oldest entry if full */
+	a->head = (a->head + 1) & (BLOCK_CACHE - 1);
+	a->cached = MIN(a->cached + 1, BLOCK_CACHE);
 	return 0;
 }
 
@@ -250,7 +317,9 @@ void block_delete(block_arena_t *a) {
 	free(a);
 }
 
-block_arena_t *block_new(size_t blocksz, size_t count) {
+/* Make an arena of 'count' blocks, backed by 'memory' if it is not NULL,
+ * which the arena does not own; it must be cleared before 'block_delete' */
+static block_arena_t *block_make(size_t blocksz, size_t count, void *memory) {
 	block_arena_t *a = NULL;
 	if (blocksz < sizeof(intptr_t))
 		goto fail;
@@ -259,17 +328,231 @@ block_arena_t *block_new(size_t blocksz, size_t count) {
 	if (!(a = calloc(sizeof(*a), 1)))
 		goto fail;
 	a->freelist.map = calloc((count / sizeof(bitmap_unit_t)) + sizeof(bitmap_unit_t), 1);
-	a->memory       = calloc(blocksz, count);
+	a->memory       = memory ? memory : calloc(blocksz, count);
 	if (!(a->freelist.map) || !(a->memory))
 		goto fail;
 	a->freelist.bits = count;
 	a->blocksz = blocksz;
 	return a;
 fail:
+	if (a && memory)
+		a->memory = NULL;
 	block_delete(a);
 	return NULL;
 }
 
+block_arena_t *block_new(size_t blocksz, size_t count) {
+	return block_make(blocksz, count, NULL);
+}
+
+/* Each smallest block of a buddy allocator has a tag, which is zero unless a
+ * block starts there, in which case it holds the order of that block (less
+ * the smallest order, plus one) and whether it is free. */
+#define BUDDY_FREE (0x80u)
+
+typedef struct buddy_node {
+	struct buddy_node *next, *prev;
+} buddy_node_t; /* a free block, on the list for its order */
+
+static inline void *buddy_at(block_buddy_t *b, size_t unit) {
+	assert(b);
+	return (char*)b->memory + (unit << b->min);
+}
+
+static inline unsigned char buddy_tag(block_buddy_t *b, unsigned order, bool free) {
+	assert(b);
+	assert(order >= b->min && order <= b->order);
+	return (order - b->min + 1) | (free ? BUDDY_FREE : 0);
+}
+
+static inline bool buddy_is_free(block_buddy_t *b, size_t unit, unsigned order) {
+	assert(b);
+	return b->tags[unit] == buddy_tag(b, order, true);
+}
+
+static inline size_t buddy_bit(block_buddy_t *b, unsigned order) {
+	assert(b);
+	return (size_t)1 << (order - b->min); /* a block of 'order', in smallest blocks */
+}
+
+static void buddy_push(block_buddy_t *b, size_t unit, unsigned order) {
+	assert(b);
+	buddy_node_t *n = buddy_at(b, unit), *head = b->free[order];
+	n->prev = NULL;
+	n->next = head;
+	if (head)
+		head->prev = n;
+	b->free[order] = n;
+	b->tags[unit] = buddy_tag(b, order, true);
+}
+
+static void buddy_remove(block_buddy_t *b, size_t unit, unsigned order) {
+	assert(b);
+	assert(buddy_is_free(b, unit, order));
+	buddy_node_t *n = buddy_at(b, unit);
+	if (n->prev)
+		n->prev->next = n->next;
+	else
+		b->free[order] = n->next;
+	if (n->next)
+		n->next->prev = n->prev;
+	b->tags[unit] = 0;
+}
+
+/* The smallest block 'v' is in, or the number of them if 'v' is not the
+ * start of an allocated block. */
+static size_t buddy_unit(block_buddy_t *b, void *v) {
+	assert(b);
+	const size_t units = buddy_bit(b, b->order);
+	const uintptr_t offset = (uintptr_t)v - (uintptr_t)b->memory;
+	if ((offset >> b->order) || (offset & ((1u << b->min) - 1)))
+		return units;
+	const size_t unit = offset >> b->min;
+	const unsigned char tag = b->tags[unit];
+	return tag && !(tag & BUDDY_FREE) ? unit : units;
+}
+
+static inline unsigned buddy_order(block_buddy_t *b, size_t length) {
+	assert(b);
+	return MAX(ceil_log2(length), b->min);
+}
+
+block_buddy_t *buddy_new(size_t minimum, size_t size) {
+	block_buddy_t *b = calloc(sizeof *b, 1);
+	if (!b)
+		return NULL;
+	b->min   = ceil_log2(MAX(minimum, sizeof(buddy_node_t)));
+	b->order = ceil_log2(size);
+	if (!is_power_of_2(size) || b->min > b->order || b->order >= (sizeof(b->free) / sizeof(b->free[0])))
+		goto fail;
+	if (!(b->memory = calloc(size, 1)) || !(b->tags = calloc(buddy_bit(b, b->order), 1)))
+		goto fail;
+	buddy_push(b, 0, b->order);
+	return b;
+fail:
+	buddy_delete(b);
+	return NULL;
+}
+
+void buddy_delete(block_buddy_t *b) {
+	if (!b)
+		return;
+	free(b->memory);
+	free(b->tags);
+	free(b);
+}
+
+size_t buddy_block_size(block_buddy_t *b, void *v) {
+	assert(b);
+	const size_t unit = buddy_unit(b, v);
+	if (unit == buddy_bit(b, b->order))
+		return 0;
+	return (size_t)1 << (b->tags[unit] - 1 + b->min);
+}
+
+/* Take the smallest free block that fits, splitting it in half until it is
+ * no larger than it needs to be. */
+void *buddy_malloc(block_buddy_t *b, size_t length) {
+	assert(b);
+	const unsigned order = buddy_order(b, length);
+	unsigned o = order;
+	for (; o <= b->order && !b->free[o]; o++)
+		;
+	if (o > b->order)
+		return NULL;
+	const size_t unit = ((uintptr_t)b->free[o] - (uintptr_t)b->memory) >> b->min;
+	buddy_remove(b, unit, o);
+	while (o > order) {
+		o--;
+		buddy_push(b, unit + buddy_bit(b, o), o);
+	}
+	b->tags[unit] = buddy_tag(b, order, false);
+	if (STATISTICS) {
+		b->active += (long)1 << order;
+		if (b->max < b->active)
+			b->max = b->active;
+	}
+	return buddy_at(b, unit);
+}
+
+/* Free a block, merging it with its buddy for as long as that is free */
+int buddy_free(block_buddy_t *b, void *v) {
+	assert(b);
+	if (!v)
+		return 0;
+	size_t unit = buddy_unit(b, v);
+	if (unit == buddy_bit(b, b->order)) { /* not allocated, or a double free */
+		if (USE_ABORT)
+			abort();
+		return -1;
+	}
+	unsigned order = b->tags[unit] - 1 + b->min;
+	if (STATISTICS)
+		b->active -= (long)1 << order;
+	b->tags[unit] = 0;
+	for (; order < b->order; order++) {
+		const size_t buddy = unit ^ buddy_bit(b, order);
+		if (!buddy_is_free(b, buddy, order))
+			break;
+		buddy_remove(b, buddy, order);
+		unit = MIN(unit, buddy);
+	}
+	buddy_push(b, unit, order);
+	return 0;
+}
+
+/* Resize a block without moving it. It shrinks by freeing the upper halves
+ * it does not need, and grows if it is the lower half of every block it
+ * would be merged into and the upper halves are free. */
+bool buddy_resize(block_buddy_t *b, void *v, size_t length) {
+	assert(b);
+	const size_t unit = buddy_unit(b, v);
+	if (unit == buddy_bit(b, b->order))
+		return false;
+	const unsigned old = b->tags[unit] - 1 + b->min, order = buddy_order(b, length);
+	if (order > b->order)
+		return false;
+	if (order > old) {
+		for (unsigned o = old; o < order; o++)
+			if ((unit & buddy_bit(b, o)) || !buddy_is_free(b, unit + buddy_bit(b, o), o))
+				return false;
+		for (unsigned o = old; o < order; o++)
+			buddy_remove(b, unit + buddy_bit(b, o), o);
+	}
+	for (unsigned o = old; o > order;) { /* the upper halves cannot merge, their buddy is in use */
+		o--;
+		buddy_push(b, unit + buddy_bit(b, o), o);
+	}
+	b->tags[unit] = buddy_tag(b, order, false);
+	if (STATISTICS) {
+		b->active += ((long)1 << order) - ((long)1 << old);
+		if (b->max < b->active)
+			b->max = b->active;
+	}
+	return true;
+}
+
+void *buddy_realloc(block_buddy_t *b, void *v, size_t length) {
+	assert(b);
+	if (!length) {
+		(void)buddy_free(b, v);
+		return NULL;
+	}
+	if (!v)
+		return buddy_malloc(b, length);
+	const size_t oldsz = buddy_block_size(b, v);
+	if (!oldsz)
+		return NULL;
+	if (buddy_resize(b, v, length))
+		return v;
+	void *n = buddy_malloc(b, length);
+	if (!n)
+		return NULL;
+	memcpy(n, v, MIN(oldsz, length));
+	(void)buddy_free(b, v);
+	return n;
+}
+
 void pool_delete(pool_t *p) {
 	if (!p)
 		return;
@@ -277,34 +560,201 @@ void pool_delete(pool_t *p) {
 		p->tracer(p->tracer_arg, "{delete %p}", (void*)p);
 	if (p->arenas)
 		for (size_t i = 0; i < p->count; i++)
-			block_delete(p->arenas[i]);
+			if (p->arenas[i]) {
+				p->arenas[i]->memory = NULL; /* part of 'p->memory' */
+				block_delete(p->arenas[i]);
+			}
+	for (size_t i = 0; i < p->slab_count; i++)
+		block_delete(p->slabs[i]);
+	free(p->slabs);
+	free(p->spare);
 	free(p->arenas);
+	free(p->memory);
+	free(p->index);
+	buddy_delete(p->buddy);
 	free(p);
 }
 
+/* The memory of all arenas is allocated in one go, each arena getting a
+ * region of it rounded up to a power of two sized granule. The arena a
+ * pointer belongs to is then found by looking up the granule it is in, and
+ * the granule is made larger until the index has at most INDEX_MAX entries.
+ * Arenas are sorted by block size, so that the first arena to try for an
+ * allocation is looked up from the (rounded up) log2 of its size. */
 pool_t *pool_new(size_t length, const pool_specification_t *specs) {
-	assert(specs);
+	assert(specs || !length);
+	pool_specification_t *sorted = NULL;
 	pool_t *p = calloc(sizeof *p, 1);
 	if (!p)
 		goto fail;
 	p->count = length;
-	p->arenas = calloc(sizeof(p->arenas[0]), p->count);
-	if (!(p->arenas))
+	p->arenas = calloc(sizeof(p->arenas[0]), p->count + !p->count);
+	p->spare  = calloc(sizeof(p->spare[0]), p->count + !p->count);
+	if (!(p->arenas) || !(p->spare) || length > UINT16_MAX)
+		goto fail;
+	if (!(sorted = malloc(sizeof(*sorted) * (length + !length))))
 		goto fail;
+	size_t least = 0; /* smallest non empty region */
 	for (size_t i = 0; i < length; i++) {
-		const pool_specification_t spec = specs[i];
-		p->arenas[i] = block_new(spec.blocksz, spec.count);
+		pool_specification_t spec = specs[i];
+		if (!is_power_of_2(spec.blocksz) || (spec.count && spec.blocksz > (SIZE_MAX / spec.count)))
+			goto fail;
+		const size_t region = spec.blocksz * spec.count;
+		if (region && (!least || region < least))
+			least = region;
+		size_t j = i;
+		for (; j && sorted[j - 1].blocksz > spec.blocksz; j--) /* insertion sort, keeping the order of equal sizes */
+			sorted[j] = sorted[j - 1];
+		sorted[j] = spec;
+	}
+	p->shift = least ? ceil_log2(least + 1) - 1 : 0; /* largest granule no bigger than the smallest region, */
+	p->shift = MAX(p->shift, ceil_log2(MAX_ALIGN));  /* but big enough that every arena is aligned for any type */
+	for (;; p->shift++) {
+		const size_t granule = (size_t)1 << p->shift;
+		p->span = 0;
+		for (size_t i = 0; i < length; i++) {
+			const size_t region = sorted[i].blocksz * sorted[i].count, rounded = (region + granule - 1) & ~(granule - 1);
+			if (rounded < region || (p->span + rounded) < p->span)
+				goto fail;
+			p->span += rounded;
+		}
+		if ((p->span >> p->shift) <= INDEX_MAX)
+			break;
+	}
+	if (!(p->memory = calloc(p->span + !p->span, 1)))
+		goto fail;
+	if (!(p->index = malloc(sizeof(p->index[0]) * ((p->span >> p->shift) + 1))))
+		goto fail;
+	for (size_t i = 0, offset = 0; i < length; i++) {
+		const size_t granule = (size_t)1 << p->shift;
+		const size_t region = sorted[i].blocksz * sorted[i].count, rounded = (region + granule - 1) & ~(granule - 1);
+		p->arenas[i] = block_make(sorted[i].blocksz, sorted[i].count, (char*)p->memory + offset);
 		if (!(p->arenas[i]))
 			goto fail;
+		for (size_t g = offset >> p->shift; g < ((offset + rounded) >> p->shift); g++)
+			p->index[g] = i;
+		offset += rounded;
 	}
+	for (size_t n = 0, i = 0; n < (sizeof(p->classes) / sizeof(p->classes[0])); n++) {
+		for (; n < (sizeof(size_t)*CHAR_BIT) && i < length && p->arenas[i]->blocksz < ((size_t)1 << n); i++)
+			;
+		p->classes[n] = n < (sizeof(size_t)*CHAR_BIT) ? i : length;
+	}
+	free(sorted);
 	if (RANDOM_FAIL)
 		srand(FAIL_SEED);
 	return p;
 fail:
+	free(sorted);
 	pool_delete(p);
 	return NULL;
 }
 
+pool_t *pool_buddy_new(size_t minimum, size_t size) {
+	pool_t *p = pool_new(0, NULL);
+	if (!p)
+		return NULL;
+	if (!(p->buddy = buddy_new(minimum, size))) {
+		pool_delete(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Position of the first slab at an address after 'v' */
+static size_t pool_slab_search(pool_t *p, const void *v) {
+	assert(p);
+	size_t lo = 0, hi = p->slab_count;
+	while (lo < hi) {
+		const size_t mid = lo + ((hi - lo) / 2);
+		if ((uintptr_t)p->slabs[mid]->memory <= (uintptr_t)v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Find the arena 'v' was allocated from, or NULL if it was not. Those made
+ * by 'pool_new' are found from the offset of 'v' into the memory they share,
+ * slabs added since by a binary search. */
+static inline block_arena_t *pool_arena(pool_t *p, void *v) {
+	assert(p);
+	if (!v)
+		return NULL;
+	const uintptr_t offset = (uintptr_t)v - (uintptr_t)p->memory;
+	if (offset < p->span) {
+		block_arena_t *a = p->arenas[p->index[offset >> p->shift]];
+		return block_arena_valid_pointer(a, v) ? a : NULL; /* 'v' may be in the padding after an arena */
+	}
+	const size_t at = pool_slab_search(p, v);
+	block_arena_t *a = at ? p->slabs[at - 1] : NULL;
+	return a && block_arena_valid_pointer(a, v) ? a : NULL;
+}
+
+/* Add a slab to arena 'i', which is full, returning it or NULL on failure */
+static block_arena_t *pool_grow(pool_t *p, size_t i) {
+	assert(p);
+	assert(i < p->count);
+	block_arena_t *first = p->arenas[i];
+	if (p->slab_count == p->slab_capacity) {
+		const size_t capacity = p->slab_capacity ? p->slab_capacity * 2 : 8;
+		block_arena_t **slabs = realloc(p->slabs, sizeof(*slabs) * capacity);
+		if (!slabs)
+			return NULL;
+		p->slabs = slabs;
+		p->slab_capacity = capacity;
+	}
+	const size_t count = MAX(MAX(bitmap_bits(&first->freelist), SLAB_BYTES / first->blocksz), 1);
+	block_arena_t *a = block_new(first->blocksz, count);
+	if (!a)
+		return NULL;
+	const size_t at = pool_slab_search(p, a->memory);
+	memmove(&p->slabs[at + 1], &p->slabs[at], sizeof(p->slabs[0]) * (p->slab_count - at));
+	p->slabs[at] = a;
+	p->slab_count++;
+	a->next = first->next; /* newest first, it has the most room */
+	first->next = a;
+	if (p->tracer)
+		p->tracer(p->tracer_arg, "{grow   %p: %p %6zu}", (void*)p, (void*)a, first->blocksz);
+	return a;
+}
+
+/* Slab 'a' has become empty. Keep it as the spare for its block size, if
+ * there is no other empty one, so that allocating and freeing around the
+ * boundary of a slab does not repeatedly allocate and free it. */
+static void pool_release(pool_t *p, block_arena_t *a) {
+	assert(p);
+	assert(a);
+	assert(!a->active);
+	const size_t i = p->classes[ceil_log2(a->blocksz)]; /* slabs are added to the first arena of a size */
+	assert(i < p->count && p->arenas[i]->blocksz == a->blocksz);
+	block_arena_t *spare = p->spare[i];
+	if (!spare || spare == a || spare->active) {
+		p->spare[i] = a;
+		return;
+	}
+	block_arena_t **link = &p->arenas[i]->next;
+	while (*link != a)
+		link = &(*link)->next;
+	*link = a->next;
+	const size_t at = pool_slab_search(p, a->memory) - 1;
+	assert(p->slabs[at] == a);
+	memmove(&p->slabs[at], &p->slabs[at + 1], sizeof(p->slabs[0]) * (p->slab_count - at - 1));
+	p->slab_count--;
+	if (p->tracer)
+		p->tracer(p->tracer_arg, "{release %p: %p %6zu}", (void*)p, (void*)a, a->blocksz);
+	block_delete(a);
+}
+
+static inline void pool_allocated(pool_t *p, size_t bsz) {
+	assert(p);
+	p->active += bsz;
+	p->blocks += bsz;
+	if (p->max < p->active)
+		p->max = p->active;
+}
+
 void *pool_malloc(pool_t *p, size_t length) {
 	assert(p);
 	void *r = NULL;
@@ -316,17 +766,26 @@ void *pool_malloc(pool_t *p, size_t length) {
 		}
 	if (STATISTICS)
 		p->allocs++, p->total += length;
-	for (size_t i = 0; i < p->count; i++)
-		if ((r = block_malloc(p->arenas[i], length))) {
-			if (STATISTICS) {
-				const size_t bsz = p->arenas[i]->blocksz;
-				p->active += bsz;
-				p->blocks += bsz;
-				if (p->max < p->active)
-					p->max = p->active;
-			}
+	if (p->buddy && (r = buddy_malloc(p->buddy, length))) {
+		if (STATISTICS)
+			pool_allocated(p, buddy_block_size(p->buddy, r));
+		goto end;
+	}
+	for (size_t i = p->classes[ceil_log2(length)]; i < p->count; i++) { /* spilling over into larger classes */
+		block_arena_t *a = p->arenas[i];
+		for (; a; a = a->next)
+			if (a->active < (long)bitmap_bits(&a->freelist) && (r = block_malloc(a, length)))
+				break;
+		if (!r && p->grow && (a = pool_grow(p, i)))
+			r = block_malloc(a, length);
+		if (r) {
+			if (STATISTICS)
+				pool_allocated(p, a->blocksz);
 			goto end;
 		}
+		if (p->grow)
+			break;
+	}
 	if (FALLBACK)
 		r = malloc(length);
 end:
@@ -348,13 +807,23 @@ int pool_free(pool_t *p, void *v) {
 		return 0;
 	if (STATISTICS)
 		p->freed++;
-	for (size_t i = 0; i < p->count; i++) {
-		if (block_arena_valid_pointer(p->arenas[i], v)) {
+	if (p->buddy) {
+		const size_t bsz = buddy_block_size(p->buddy, v);
+		if (bsz) {
 			if (STATISTICS)
-				p->active -= p->arenas[i]->blocksz;
-			return block_free(p->arenas[i], v);
+				p->active -= bsz;
+			return buddy_free(p->buddy, v);
 		}
 	}
+	block_arena_t *a = pool_arena(p, v);
+	if (a) {
+		if (STATISTICS)
+			p->active -= a->blocksz;
+		const int r = block_free(a, v);
+		if (p->release && !a->active && ((uintptr_t)a->memory - (uintptr_t)p->memory) >= p->span)
+			pool_release(p, a);
+		return r;
+	}
 	if (FALLBACK) {
 		free(v);
 		return 0;
@@ -366,9 +835,14 @@ int pool_free(pool_t *p, void *v) {
 
 size_t pool_block_size(pool_t *p, void *v) {
 	assert(p);
-	for (size_t i = 0; i < p->count; i++)
-		if (block_arena_valid_pointer(p->arenas[i], v))
-			return p->arenas[i]->blocksz;
+	if (p->buddy) {
+		const size_t bsz = buddy_block_size(p->buddy, v);
+		if (bsz)
+			return bsz;
+	}
+	block_arena_t *a = pool_arena(p, v);
+	if (a)
+		return a->blocksz;
 	if (USE_ABORT)
 		abort();
 	return 0; /*WARNING: Returns zero! Which is kind-of and invalid value... */
@@ -376,10 +850,7 @@ size_t pool_block_size(pool_t *p, void *v) {
 
 static inline bool pool_valid_pointer(pool_t *p, void *v) {
 	assert(p);
-	for (size_t i = 0; i < p->count; i++)
-		if (block_arena_valid_pointer(p->arenas[i], v))
-			return true;
-	return false;
+	return !!pool_arena(p, v) || (p->buddy && buddy_block_size(p->buddy, v));
 }
 
 void *pool_realloc(pool_t *p, void *v, size_t length) {
@@ -400,6 +871,14 @@ void *pool_realloc(pool_t *p, void *v, size_t length) {
 	assert(oldsz != 0);
 	if (length > (oldsz/2) && length < oldsz)
 		return v;
+	if (p->buddy && buddy_resize(p->buddy, v, length)) { /* grown or shrunk in place, nothing to copy */
+		if (STATISTICS) {
+			p->active += (long)pool_block_size(p, v) - (long)oldsz;
+			if (p->max < p->active)
+				p->max = p->active;
+		}
+		return v;
+	}
 	void *n = pool_malloc(p, length);
 	if (!n)
 		return NULL;
@@ -408,6 +887,234 @@ void *pool_realloc(pool_t *p, void *v, size_t length) {
 	return n;
 }
 
+#if THREADS
+struct pool_shared {
+	pool_t *pool;          /* guarded by 'lock' */
+	pthread_mutex_t lock;
+	size_t depth;          /* most free blocks a cache holds for each arena */
+};
+
+struct pool_cache {
+	pool_shared_t *shared;
+	pthread_t owner;       /* the only thread to use 'counts' and 'blocks' */
+	void *remote;          /* stack of blocks freed by other threads, linked through the blocks */
+	size_t *counts;        /* free blocks held for each arena of the pool */
+	void **blocks;         /* 'depth' slots for each arena */
+};
+
+pool_shared_t *pool_shared_new(pool_t *p, size_t depth) {
+	assert(p);
+	for (size_t i = 0; i < p->count; i++)
+		if (p->arenas[i]->blocksz < sizeof(void*))
+			return NULL;
+	pool_shared_t *s = calloc(sizeof *s, 1);
+	if (!s)
+		return NULL;
+	if (pthread_mutex_init(&s->lock, NULL)) {
+		free(s);
+		return NULL;
+	}
+	s->pool  = p;
+	s->depth = MAX(depth, 2);
+	return s;
+}
+
+void pool_shared_delete(pool_shared_t *s) {
+	if (!s)
+		return;
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+pool_cache_t *pool_cache_new(pool_shared_t *s) {
+	assert(s);
+	const size_t count = s->pool->count;
+	pool_cache_t *c = calloc(sizeof *c, 1);
+	if (!c)
+		return NULL;
+	c->shared = s;
+	c->owner  = pthread_self();
+	c->counts = calloc(sizeof(c->counts[0]), count + !count);
+	c->blocks = malloc(sizeof(c->blocks[0]) * ((count * s->depth) + 1));
+	if (!(c->counts) || !(c->blocks)) {
+		free(c->counts);
+		free(c->blocks);
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* The arena 'v' is in, if it is in the memory made by 'pool_new', or the
+ * number of arenas if not. That memory does not change, so no lock is needed
+ * to look it up, unlike for the slabs a pool grows by. */
+static inline size_t pool_cache_arena(pool_t *p, void *v) {
+	assert(p);
+	const uintptr_t offset = (uintptr_t)v - (uintptr_t)p->memory;
+	if (offset >= p->span)
+		return p->count;
+	const size_t i = p->index[offset >> p->shift];
+	return block_arena_valid_pointer(p->arenas[i], v) ? i : p->count;
+}
+
+/* Take blocks for arena 'i' from the pool, half as many as can be held, in
+ * one go under the lock. */
+static void pool_cache_fill(pool_cache_t *c, size_t i) {
+	assert(c);
+	pool_shared_t *s = c->shared;
+	pool_t *p = s->pool;
+	block_arena_t *a = p->arenas[i];
+	void **blocks = &c->blocks[i * s->depth];
+	size_t n = c->counts[i];
+	pthread_mutex_lock(&s->lock);
+	for (; n < (s->depth / 2); n++)
+		if (!(blocks[n] = block_malloc(a, a->blocksz)))
+			break;
+	if (STATISTICS) {
+		const long taken = n - c->counts[i], bytes = taken * a->blocksz;
+		p->allocs += taken;
+		p->total  += bytes;
+		p->blocks += bytes;
+		p->active += bytes;
+		if (p->max < p->active)
+			p->max = p->active;
+	}
+	pthread_mutex_unlock(&s->lock);
+	c->counts[i] = n;
+}
+
+/* Give blocks held for arena 'i' back to the pool until 'keep' are left */
+static void pool_cache_flush(pool_cache_t *c, size_t i, size_t keep) {
+	assert(c);
+	pool_shared_t *s = c->shared;
+	void **blocks = &c->blocks[i * s->depth];
+	pthread_mutex_lock(&s->lock);
+	while (c->counts[i] > keep)
+		(void)pool_free(s->pool, blocks[--c->counts[i]]);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static int pool_cache_put(pool_cache_t *c, void *v) {
+	assert(c);
+	assert(v);
+	pool_shared_t *s = c->shared;
+	const size_t i = pool_cache_arena(s->pool, v);
+	if (i < s->pool->count) {
+		if (c->counts[i] == s->depth)
+			pool_cache_flush(c, i, s->depth / 2);
+		c->blocks[(i * s->depth) + c->counts[i]++] = v;
+		return 0;
+	}
+	pthread_mutex_lock(&s->lock);
+	const int r = pool_free(s->pool, v);
+	pthread_mutex_unlock(&s->lock);
+	return r;
+}
+
+/* Take every block freed by other threads, they are only ever taken all at
+ * once so the stack does not suffer from the ABA problem. */
+static void pool_cache_collect(pool_cache_t *c) {
+	assert(c);
+	void *v = __atomic_exchange_n(&c->remote, NULL, __ATOMIC_ACQUIRE);
+	while (v) {
+		void *next = NULL;
+		memcpy(&next, v, sizeof next);
+		(void)pool_cache_put(c, v);
+		v = next;
+	}
+}
+
+void pool_cache_delete(pool_cache_t *c) {
+	if (!c)
+		return;
+	pool_cache_collect(c);
+	for (size_t i = 0; i < c->shared->pool->count; i++)
+		pool_cache_flush(c, i, 0);
+	free(c->counts);
+	free(c->blocks);
+	free(c);
+}
+
+void *pool_cache_malloc(void *cache, size_t length) {
+	pool_cache_t *c = cache;
+	assert(c);
+	assert(pthread_equal(c->owner, pthread_self()));
+	pool_shared_t *s = c->shared;
+	pool_t *p = s->pool;
+	const size_t i = p->classes[ceil_log2(length)];
+	if (i < p->count) {
+		if (!c->counts[i] && __atomic_load_n(&c->remote, __ATOMIC_RELAXED))
+			pool_cache_collect(c);
+		if (!c->counts[i])
+			pool_cache_fill(c, i);
+		if (c->counts[i])
+			return c->blocks[(i * s->depth) + --c->counts[i]];
+	}
+	pthread_mutex_lock(&s->lock); /* arena is full, spill over or grow */
+	void *r = pool_malloc(p, length);
+	pthread_mutex_unlock(&s->lock);
+	return r;
+}
+
+int pool_cache_free(void *cache, void *v) {
+	pool_cache_t *c = cache;
+	assert(c);
+	if (!v)
+		return 0;
+	if (pthread_equal(c->owner, pthread_self()))
+		return pool_cache_put(c, v);
+	void *head = __atomic_load_n(&c->remote, __ATOMIC_RELAXED);
+	do
+		memcpy(v, &head, sizeof head);
+	while (!__atomic_compare_exchange_n(&c->remote, &head, v, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return 0;
+}
+
+void *pool_cache_realloc(void *cache, void *v, size_t length) {
+	pool_cache_t *c = cache;
+	assert(c);
+	if (!length) {
+		(void)pool_cache_free(c, v);
+		return NULL;
+	}
+	if (!v)
+		return pool_cache_malloc(c, length);
+	pool_shared_t *s = c->shared;
+	const size_t i = pool_cache_arena(s->pool, v);
+	size_t oldsz = 0;
+	if (i < s->pool->count) {
+		oldsz = s->pool->arenas[i]->blocksz;
+	} else {
+		pthread_mutex_lock(&s->lock);
+		oldsz = pool_block_size(s->pool, v);
+		pthread_mutex_unlock(&s->lock);
+	}
+	if (!oldsz)
+		return NULL;
+	if (length > (oldsz/2) && length <= oldsz)
+		return v;
+	void *n = pool_cache_malloc(c, length);
+	if (!n)
+		return NULL;
+	memcpy(n, v, MIN(oldsz, length));
+	(void)pool_cache_free(c, v);
+	return n;
+}
+#else
+pool_shared_t *pool_shared_new(pool_t *p, size_t depth) {
+	assert(p);
+	(void)depth;
+	return NULL;
+}
+
+void pool_shared_delete(pool_shared_t *s) { assert(!s); (void)s; }
+pool_cache_t *pool_cache_new(pool_shared_t *s) { assert(s); (void)s; return NULL; }
+void pool_cache_delete(pool_cache_t *c) { assert(!c); (void)c; }
+void *pool_cache_malloc(void *c, size_t length) { assert(c); (void)c; (void)length; return NULL; }
+int pool_cache_free(void *c, void *v) { assert(c); (void)c; (void)v; return -1; }
+void *pool_cache_realloc(void *c, void *v, size_t length) { assert(c); (void)c; (void)v; (void)length; return NULL; }
+#endif
+
 #ifdef NDEBUG
 int block_tests(void) { return 0; }
 #else
@@ -424,6 +1131,44 @@ static uintptr_t diff(void *a, void *b) {
 	return a > b ? (char*)a - (char*)b : (char*)b - (char*)a;
 }
 
+#if THREADS
+enum { WORKERS = 4, HANDED = 16 };
+
+typedef struct {
+	pool_shared_t *shared;
+	pool_cache_t *other; /* cache of another thread, the blocks in 'handed' are freed to it */
+	void *handed[HANDED];
+	int r;
+} worker_t;
+
+static void *worker(void *arg) {
+	worker_t *w = arg;
+	void *held[16] = { NULL };
+	pool_cache_t *c = pool_cache_new(w->shared);
+	if (!c) {
+		w->r = -1;
+		return NULL;
+	}
+	for (size_t i = 0; i < 2000; i++) {
+		const size_t slot = i % 16;
+		if (pool_cache_free(c, held[slot]) < 0)
+			w->r = -2;
+		if (!(held[slot] = pool_cache_malloc(c, 1 + (i % 40))))
+			w->r = -3;
+		else
+			memset(held[slot], (int)i, 1 + (i % 40));
+	}
+	for (size_t i = 0; i < 16; i++)
+		if (pool_cache_free(c, held[i]) < 0)
+			w->r = -4;
+	for (size_t i = 0; i < HANDED; i++) /* a remote free */
+		if (pool_cache_free(w->other, w->handed[i]) < 0)
+			w->r = -5;
+	pool_cache_delete(c);
+	return NULL;
+}
+#endif
+
 int block_tests(void) {
 	void *v1, *v2, *v3;
 	if (!(v1 = block_malloc(&block_arena, 12)))
@@ -447,6 +1192,165 @@ int block_tests(void) {
 			break;
 	if (i != BLK_COUNT)
 		return -6;
-	return 0;
+
+	enum { COUNT = 200 }; /* not a multiple of the bitmap word size */
+	block_arena_t *a = block_new(8, COUNT);
+	void *vs[COUNT] = { NULL };
+	if (!a)
+		return -7;
+	int r = 0;
+	for (i = 0; i < COUNT; i++) /* every block is found, once */
+		if (!(vs[i] = block_malloc(a, 8)) || (i && diff(vs[i], vs[i - 1]) != 8))
+			r = r ? r : -8;
+	if (block_malloc(a, 8))
+		r = r ? r : -9;
+	size_t last = 0;
+	for (i = 3; i < COUNT; i += 7)
+		if (block_free(a, vs[last = i]) < 0)
+			r = r ? r : -10;
+	if (block_malloc(a, 8) != vs[last]) /* last freed, first reused */
+		r = r ? r : -11;
+	for (i = 3; i < COUNT; i += 7) /* the rest, from the cache or by searching */
+		if (i != last && !block_malloc(a, 8))
+			r = r ? r : -12;
+	if (block_malloc(a, 8))
+		r = r ? r : -13;
+	block_delete(a);
+	if (r)
+		return r;
+
+	static const pool_specification_t specs[] = { { 64, 4 }, { 8, 2 }, { 16, 200 }, }; /* unsorted */
+	pool_t *p = pool_new(sizeof(specs) / sizeof(specs[0]), &specs[0]);
+	if (!p)
+		return -14;
+	void *s1 = pool_malloc(p, 1), *s2 = pool_malloc(p, 8), *s3 = pool_malloc(p, 8), *m = pool_malloc(p, 9), *l = pool_malloc(p, 33);
+	if (!s1 || !s2 || !s3 || !m || !l)
+		r = r ? r : -15;
+	if (pool_block_size(p, s1) != 8 || pool_block_size(p, s2) != 8 || pool_block_size(p, m) != 16 || pool_block_size(p, l) != 64)
+		r = r ? r : -16;
+	if (pool_block_size(p, s3) != 16) /* spilt over into the next class */
+		r = r ? r : -17;
+	if (pool_malloc(p, 65))
+		r = r ? r : -18;
+	if (pool_free(p, &r) >= 0) /* not from the pool */
+		r = r ? r : -19;
+	if (pool_free(p, s1) < 0 || pool_free(p, s2) < 0 || pool_free(p, s3) < 0 || pool_free(p, m) < 0 || pool_free(p, l) < 0)
+		r = r ? r : -20;
+	if (p->active)
+		r = r ? r : -21;
+	pool_delete(p);
+	if (r)
+		return r;
+
+	static const pool_specification_t growing[] = { { 8, 2 }, { 16, 0 }, };
+	void *vs8[100] = { NULL };
+	if (!(p = pool_new(sizeof(growing) / sizeof(growing[0]), &growing[0])))
+		return -22;
+	p->grow = true;
+	p->release = true;
+	for (i = 0; i < 100; i++)
+		if (!(vs8[i] = pool_malloc(p, 8)) || pool_block_size(p, vs8[i]) != 8)
+			r = r ? r : -23;
+	if (!p->slab_count)
+		r = r ? r : -24;
+	void *g = pool_malloc(p, 16); /* an arena of no blocks grows too */
+	if (!g || pool_block_size(p, g) != 16 || pool_free(p, g) < 0)
+		r = r ? r : -25;
+	for (i = 0; i < 100; i++)
+		if (pool_free(p, vs8[i]) < 0)
+			r = r ? r : -26;
+	if (p->slab_count > 2) /* a spare is kept for each block size */
+		r = r ? r : -27;
+	pool_delete(p);
+	if (r)
+		return r;
+
+	static const pool_specification_t mixed[] = { { 8, 1 }, { 32, 3 }, { 16, 1 }, { 64, 2 }, };
+	static const size_t sizes[] = { 8, 16, 32, 32, 32, 64, 64, };
+	void *vm[7] = { NULL };
+	if (!(p = pool_new(sizeof(mixed) / sizeof(mixed[0]), &mixed[0])))
+		return -47;
+	for (i = 0; i < 7; i++) /* every block is aligned for its size, arenas start aligned for any type */
+		if (!(vm[i] = pool_malloc(p, sizes[i])) || ((uintptr_t)vm[i] & (MIN(pool_block_size(p, vm[i]), MAX_ALIGN) - 1)))
+			r = r ? r : -48;
+	for (i = 0; i < 4; i++)
+		if (((uintptr_t)p->arenas[i]->memory) & (MAX_ALIGN - 1))
+			r = r ? r : -49;
+	for (i = 0; i < 7; i++)
+		if (vm[i] && pool_free(p, vm[i]) < 0)
+			r = r ? r : -50;
+	pool_delete(p);
+	if (r)
+		return r;
+
+	block_buddy_t *b = buddy_new(16, 1024);
+	if (!b)
+		return -35;
+	char *b1 = buddy_malloc(b, 20), *b2 = NULL, *b3 = NULL;
+	if (!b1 || buddy_block_size(b, b1) != 32)
+		r = r ? r : -36;
+	if (!r && (buddy_realloc(b, b1, 500) != b1 || buddy_block_size(b, b1) != 512)) /* merged with its free buddies */
+		r = r ? r : -37;
+	if (!r && (!(b2 = buddy_malloc(b, 16)) || b2 != b1 + 512))
+		r = r ? r : -38;
+	if (!r && (buddy_resize(b, b1, 1000) || buddy_realloc(b, b1, 1000))) /* its buddy is in use */
+		r = r ? r : -39;
+	if (!r && (buddy_realloc(b, b1, 40) != b1 || !(b3 = buddy_malloc(b, 64)) || b3 != b1 + 64)) /* split, reusing the halves */
+		r = r ? r : -40;
+	if (buddy_free(b, b1) < 0 || buddy_free(b, b2) < 0 || buddy_free(b, b3) < 0)
+		r = r ? r : -41;
+	if (buddy_free(b, b1) >= 0 || buddy_free(b, &r) >= 0) /* double free, not from the allocator */
+		r = r ? r : -42;
+	if (b->active || !b->free[b->order]) /* all merged back together */
+		r = r ? r : -43;
+	buddy_delete(b);
+	if (r)
+		return r;
+
+	if (!(p = pool_buddy_new(16, 4096)))
+		return -44;
+	char *s = pool_malloc(p, 10);
+	for (i = 16; s && i <= 2048; i += 16) /* appending, never copied */
+		if (pool_realloc(p, s, i) != s)
+			r = r ? r : -45;
+	if (!s || pool_block_size(p, s) != 2048 || pool_free(p, s) < 0 || p->active)
+		r = r ? r : -46;
+	pool_delete(p);
+#if THREADS
+	if (r)
+		return r;
+	static const pool_specification_t shared[] = { { 8, 256 }, { 16, 256 }, { 64, 256 }, };
+	pthread_t threads[WORKERS];
+	worker_t workers[WORKERS];
+	if (!(p = pool_new(sizeof(shared) / sizeof(shared[0]), &shared[0])))
+		return -28;
+	pool_shared_t *ps = pool_shared_new(p, 8);
+	pool_cache_t *pc = ps ? pool_cache_new(ps) : NULL;
+	if (!pc)
+		r = r ? r : -29;
+	size_t started = 0; /* only these threads may be joined */
+	for (i = 0; !r && i < WORKERS; i++) {
+		workers[i] = (worker_t){ .shared = ps, .other = pc, .r = 0, };
+		for (size_t j = 0; j < HANDED; j++)
+			if (!(workers[i].handed[j] = pool_cache_malloc(pc, 8)))
+				r = r ? r : -30;
+		if (!r && pthread_create(&threads[i], NULL, worker, &workers[i]))
+			r = r ? r : -31;
+		if (!r)
+			started++;
+	}
+	for (size_t j = 0; j < started; j++)
+		if (pthread_join(threads[j], NULL) || workers[j].r)
+			r = r ? r : -32;
+	void *collected = r ? NULL : pool_cache_malloc(pc, 8); /* collects the blocks freed by the workers */
+	if (!r && (!collected || pool_cache_free(pc, collected) < 0))
+		r = -33;
+	pool_cache_delete(pc);
+	pool_shared_delete(ps);
+	if (p->active) /* every block went back to the pool */
+		r = r ? r : -34;
+	pool_delete(p);
+#endif
+	return r;
 }
 #endif
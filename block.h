@@ -35,27 +35,62 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdbool.h>
 
-typedef unsigned bitmap_unit_t;
+#define BLOCK_CACHE (8) /* recently freed blocks remembered by each arena, a power of 2 */
+
+typedef uint64_t bitmap_unit_t;
 typedef struct {
 	size_t bits;
 	bitmap_unit_t *map;
 } bitmap_t;
 
-typedef struct {
+typedef struct block_arena {
 	bitmap_t freelist; /* list of free blocks */
 	size_t blocksz;    /* size of a block: 1, 2, 4, 8, ... */
-	size_t lastalloc, lastfree;   /* last freed block */
+	size_t lastalloc;  /* last block found by searching 'freelist' */
+	size_t cache[BLOCK_CACHE]; /* ring of recently freed blocks, reused last in first out */
+	size_t head, cached; /* next slot in 'cache' to push to, and number of entries */
 	void *memory;      /* memory backing this allocator, should be aligned! */
-	long active, max;  /* current active, maximum on heap at any one time */
+	long active, max;  /* blocks in use, always counted, and the most ever in use, if statistics are collected */
+	struct block_arena *next; /* further slabs with the same block size, added by a pool as it grows */
 } block_arena_t;
 
+/* A buddy allocator; its memory is split in halves, and halves of halves,
+ * until a block is the smallest power of two big enough for an allocation.
+ * A block can grow in place by merging with following buddies that are
+ * free, and shrink in place by freeing the halves it no longer needs. */
+typedef struct {
+	void *memory;      /* 2^'order' bytes */
+	unsigned min, order; /* log2 of the smallest block, and of all of the memory */
+	unsigned char *tags; /* for each smallest block; order of a block starting there, if any, and whether it is free */
+	void *free[sizeof(size_t)*CHAR_BIT]; /* lists of free blocks of each order, linked through the blocks */
+	long active, max;  /* current active, maximum on heap at any one time, in bytes */
+} block_buddy_t;
+
 typedef void (*pool_tracer_func_t)(void *v, const char *fmt, ...);
 
 typedef struct {
 	size_t count;
-	block_arena_t **arenas;
+	block_arena_t **arenas; /* sorted by block size, smallest first */
+
+	/* lookup tables, so the arena for a size or pointer is found in constant time */
+	size_t classes[sizeof(size_t)*CHAR_BIT + 1]; /* first arena with blocks of at least 2^n bytes, or 'count' */
+	void *memory;      /* single allocation holding the memory of every arena */
+	size_t span;       /* bytes in 'memory' */
+	unsigned shift;    /* log2 of the bytes of 'memory' each entry in 'index' covers */
+	uint16_t *index;   /* arena for each part of 'memory' */
+
+	/* growth, by chaining slabs on to the first arena of a block size when it is full */
+	bool grow;         /* if true, add slabs instead of using the next larger block size */
+	bool release;      /* if true, free slabs once they are empty, keeping one spare per block size */
+	block_arena_t **slabs; /* slabs added, sorted by address */
+	block_arena_t **spare; /* for each arena; an empty slab kept back from being freed, or NULL */
+	size_t slab_count, slab_capacity;
+
+	block_buddy_t *buddy; /* if not NULL, allocations are made from this instead of the arenas */
 
 	/* statistics collection */
 	long freed, allocs, relocations; /* non NULL frees, malloc/callocs, reallocs */
@@ -89,13 +124,40 @@ void *block_calloc(block_arena_t *a, size_t length);
 int block_free(block_arena_t *a, void *v);
 void *block_realloc(block_arena_t *a, void *v, size_t length);
 
+block_buddy_t *buddy_new(size_t minimum, size_t size); /* 'size' must be a power of two */
+void buddy_delete(block_buddy_t *b);
+void *buddy_malloc(block_buddy_t *b, size_t length);
+int buddy_free(block_buddy_t *b, void *v);
+void *buddy_realloc(block_buddy_t *b, void *v, size_t length);
+bool buddy_resize(block_buddy_t *b, void *v, size_t length); /* in place, true if it could be */
+size_t buddy_block_size(block_buddy_t *b, void *v); /* zero if 'v' is not an allocated block */
+
 pool_t *pool_new(size_t count, const pool_specification_t *specs);
+pool_t *pool_buddy_new(size_t minimum, size_t size); /* a pool using a buddy allocator, see 'buddy_new' */
 void pool_delete(pool_t *p);
 void *pool_malloc(pool_t *p, size_t length);
 int pool_free(pool_t *p, void *v);
 void *pool_realloc(pool_t *p, void *v, size_t length);
 void *pool_calloc(pool_t *p, size_t length);
 
+/* A pool may be shared between threads, each thread allocating through a
+ * cache of its own that holds a few free blocks of each size, so that most
+ * calls do not take the lock on the pool. Only the thread that made a cache
+ * may allocate from it, but any thread may free to it. The cache functions
+ * have the same signatures as those in a 'pickle_allocator_t', with the
+ * cache as the arena. 'pool_shared_new' returns NULL if threads are not
+ * supported, or if a block size of 'p' is smaller than a pointer. */
+typedef struct pool_shared pool_shared_t;
+typedef struct pool_cache pool_cache_t;
+
+pool_shared_t *pool_shared_new(pool_t *p, size_t depth); /* 'p' is not owned, 'depth' is the blocks a cache holds per size */
+void pool_shared_delete(pool_shared_t *s); /* delete all caches first */
+pool_cache_t *pool_cache_new(pool_shared_t *s); /* for the calling thread */
+void pool_cache_delete(pool_cache_t *c); /* returns all blocks held to the pool */
+void *pool_cache_malloc(void *c, size_t length);
+int pool_cache_free(void *c, void *v);
+void *pool_cache_realloc(void *c, void *v, size_t length);
+
 #define BLOCK_DECLARE(NAME, BLOCK_COUNT, BLOCK_SIZE)\
 	block_arena_t NAME = {\
 		.freelist = {\
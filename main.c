@@ -5,6 +5,10 @@
  * @author Richard James Howe
  * @license BSD */
 
+#ifdef __linux__
+#define _XOPEN_SOURCE (700) /* fileno, mmap, sysconf, setitimer */
+#endif
+
 #include "pickle.h"
 #include "block.h"
 #include <assert.h>
@@ -18,7 +22,23 @@
 #include <ctype.h>
 #include <stdarg.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#define USE_MMAP  (1)
+#define USE_TIMER (1)
+#else
+#define USE_MMAP  (0)
+#define USE_TIMER (0)
+#endif
+
+#define SAMPLE_US (1000)      /* sampling profiler period in microseconds */
+#define BUDDY_SZ  (1 << 20)   /* bytes given to the buddy allocator used by '-b' */
+
 #define LINE_SZ   (1024)      /* super lazy: maximum size of a line */
+#define FILE_SZ   (1 << 16)   /* size of the read buffer given to files opened with 'fopen' */
 #define UNUSED(X) ((void)(X))
 #define NELEM(X)  (sizeof (X) / sizeof ((X)[0]))
 
@@ -40,7 +60,23 @@ typedef struct {
 
 typedef struct { int argc; char **argv; } argument_t;
 
+typedef struct {
+	FILE *file;  /* file handle */
+	char *line;  /* line buffer, kept between reads so reading a line does not allocate */
+	size_t size; /* capacity of 'line' */
+	bool owned;  /* if true, this and 'file' were made by 'fopen', otherwise they are static */
+} pickle_file_t; /* private data of a file handle command */
+
+typedef struct {
+	char *text;    /* NUL terminated contents of a file */
+	size_t length; /* length of 'text', not including the NUL */
+	size_t mapped; /* if non zero 'text' is within a mapping of this many bytes, otherwise it is allocated */
+	void *map;     /* start of mapping */
+} contents_t; /* the rest of a file, read in one go */
+
 static int use_custom_allocator = 0;
+static int profile = 0;
+static FILE *samples = NULL;
 static pickle_t *interp = NULL;
 static int signal_variable = 0;
 
@@ -55,51 +91,121 @@ static pickle_allocator_t block_allocator = {
 	.arena   = NULL
 };
 
-static int get_a_line(FILE *input, char **out) {
-	assert(input);
-	assert(out);
-	char *line = NULL, *p = NULL;
-	size_t linelen = 0;
-	*out = NULL;
-	for (char t[LINE_SZ] = { 0 }; fgets(t, sizeof t, input); memset(t, 0, sizeof t)) {
-		const size_t tlen = strlen(t);
-		linelen += tlen;
-		p = realloc(line, linelen + 1);
-		if (!p) {
-			free(line);
-			return PICKLE_ERROR;
+/* Read a line into the line buffer of 'f', appending it at 'offset' so that
+ * several lines can be kept at once. 'fgets' does the scanning for the
+ * newline within the read buffer of the stream, and stops at the end of a
+ * line so an interactive stream is never waited upon for more than that. The
+ * length of the line, including any newline, is returned in 'length', it is
+ * zero at the end of the file. */
+static int read_line(pickle_file_t *f, const size_t offset, size_t *length) {
+	assert(f);
+	assert(length);
+	size_t n = offset;
+	*length = 0;
+	for (;;) {
+		if ((f->size - n) < 2) {
+			const size_t size = f->size ? f->size * 2 : LINE_SZ;
+			char *p = realloc(f->line, size);
+			if (!p)
+				return PICKLE_ERROR;
+			f->line = p;
+			f->size = size;
 		}
-		if (linelen <= LINE_SZ)
-			memset(p, 0, linelen + 1);
-		line = p;
-		strcat(line, t);
-		if (!(tlen == (sizeof(t) - 1) && t[sizeof(t) - 2] != '\n'))
+		if (!fgets(f->line + n, f->size - n, f->file))
+			break;
+		n += strlen(f->line + n);
+		if (n > offset && f->line[n - 1] == '\n')
 			break;
 	}
-	*out = line;
+	*length = n - offset;
 	return PICKLE_OK;
 }
 
-static int pickleGetLine(pickle_t *i, FILE *f) {
+static int pickleGetLine(pickle_t *i, pickle_file_t *f) {
 	assert(i);
 	assert(f);
-	char *line = NULL;
-	int r = get_a_line(f, &line);
-	if (r < 0) {
-		free(line);
+	size_t length = 0;
+	if (read_line(f, 0, &length) != PICKLE_OK)
 		return pickle_set_result_error(i, "Out Of Memory");
-	}
-	if (line) {
-		r = pickle_set_result_string(i, line);
-	} else {
+	if (!length) {
 		if (pickle_set_result_string(i, "EOF") != PICKLE_OK)
 			return pickle_set_result_error(i, "Out Of Memory");
-		r = PICKLE_BREAK;
+		return PICKLE_BREAK;
+	}
+	return pickle_set_result_string(i, f->line);
+}
+
+/* Read up to 'count' lines, without their newlines, and return them as a
+ * list. The lines are read one after another into the line buffer, and are
+ * quoted and joined in one go. The offsets of the lines are kept in an array
+ * grown as they are read, so a large 'count' costs nothing up front. */
+static int pickleGetLines(pickle_t *i, pickle_file_t *f, const long count) {
+	assert(i);
+	assert(f);
+	assert(count > 0);
+	size_t *offsets = NULL, capacity = 0, n = 0;
+	char **lines = NULL;
+	long j = 0;
+	int r = PICKLE_ERROR;
+	for (j = 0; j < count; j++) {
+		size_t length = 0;
+		if (read_line(f, n, &length) != PICKLE_OK) {
+			r = pickle_set_result_error(i, "Out Of Memory");
+			goto done;
+		}
+		if (!length)
+			break;
+		if ((size_t)j == capacity) {
+			const size_t grown = capacity ? capacity * 2 : 16;
+			size_t *o = grown > (SIZE_MAX / sizeof (*o)) ? NULL : realloc(offsets, grown * sizeof (*o));
+			if (!o) {
+				r = pickle_set_result_error(i, "Out Of Memory");
+				goto done;
+			}
+			offsets = o;
+			capacity = grown;
+		}
+		offsets[j] = n;
+		n += length;
+		if (f->line[n - 1] == '\n')
+			f->line[n - 1] = '\0';
+		else
+			n++; /* last line of a file without a newline, keep its NUL */
 	}
-	free(line);
+	if (!j) {
+		r = pickle_set_result_string(i, "EOF") == PICKLE_OK ? PICKLE_BREAK : PICKLE_ERROR;
+		goto done;
+	}
+	if (!(lines = malloc(j * sizeof (*lines)))) { /* cannot overflow, each line read took at least a byte */
+		r = pickle_set_result_error(i, "Out Of Memory");
+		goto done;
+	}
+	for (long k = 0; k < j; k++)
+		lines[k] = f->line + offsets[k]; /* the line buffer does not move after reading */
+	char *list = NULL;
+	if (pickle_concatenate(i, j, lines, &list) != PICKLE_OK)
+		goto done;
+	r = pickle_set_result_string(i, list);
+	if (pickle_free(i, (void**)&list) != PICKLE_OK)
+		r = PICKLE_ERROR;
+done:
+	free(offsets);
+	free(lines);
 	return r;
 }
 
+/* Convert 'arg' with the number conversion of the interpreter, leaving an
+ * error in the result if it is not a number. */
+static int pickleArgToNumber(pickle_t *i, const char *arg, long *out) {
+	assert(i);
+	assert(arg);
+	assert(out);
+	*out = 0;
+	if (pickle_set_result_string(i, arg) != PICKLE_OK)
+		return PICKLE_ERROR;
+	return pickle_get_result_integer(i, out);
+}
+
 static int pickleCommandSystem(pickle_t *i, const int argc, char **argv, void *pd) {
 	assert(!pd);
 	UNUSED(pd);
@@ -200,6 +306,15 @@ static void memory_tracer(void *file, const char *fmt, ...) {
 	fputc('\n', out);
 }
 
+/* Bytes of block memory in the slabs a pool has grown by */
+static long slab_memory(const pool_t *p) {
+	assert(p);
+	long bytes = 0;
+	for (size_t j = 0; j < p->slab_count; j++)
+		bytes += (long)(p->slabs[j]->freelist.bits * p->slabs[j]->blocksz);
+	return bytes;
+}
+
 static int pickleCommandHeapUsage(pickle_t *i, int argc, char **argv, void *pd) {
 	pool_t *p = pd;
 	long info = PICKLE_ERROR;
@@ -224,6 +339,9 @@ static int pickleCommandHeapUsage(pickle_t *i, int argc, char **argv, void *pd)
 		else if (!strcmp(rq, "total"))    { info = p->total;  }
 		else if (!strcmp(rq, "blocks"))   { info = p->blocks; }
 		else if (!strcmp(rq, "arenas"))   { info = p->count; }
+		else if (!strcmp(rq, "slabs"))    { info = p->slab_count; }
+		else if (!strcmp(rq, "slab-memory")) { info = slab_memory(p); }
+		else if (!strcmp(rq, "buddy"))    { info = p->buddy ? 1l << p->buddy->order : 0; }
 		else if (!strcmp(rq, "tron"))     { p->tracer = memory_tracer; p->tracer_arg = stdout; return PICKLE_OK; }
 		else if (!strcmp(rq, "troff"))    { p->tracer = NULL; p->tracer_arg = NULL; return PICKLE_OK; }
 		else { /* do nothing */ }
@@ -242,37 +360,101 @@ done:
 	return pickle_set_result_integer(i, info);
 }
 
-static char *slurp(FILE *input) {
+/* Map the rest of a regular file read only, instead of copying it. This is
+ * only possible if the file does not end on a page boundary, as the zeros
+ * that fill the last page are used to NUL terminate the text. */
+static int map_contents(FILE *input, contents_t *c) {
 	assert(input);
-	char *r = NULL;
-	long pos = 0;
-	if (fseek(input, 0, SEEK_END) < 0)
-		goto fail;
-	pos = ftell(input);
-	if (pos < 0)
-		goto fail;
-	if (fseek(input, 0, SEEK_SET) < 0)
-		goto fail;
-	if (!(r = malloc(pos + 1)))
-		goto fail;
-	if (pos != (long)fread(r, 1, pos, input))
+	assert(c);
+	if (!USE_MMAP)
+		return PICKLE_ERROR;
+#ifdef __linux__
+	struct stat st;
+	if (fflush(input) < 0) /* writes still buffered would be missing from the mapping */
+		return PICKLE_ERROR;
+	const int fd = fileno(input);
+	const long page = sysconf(_SC_PAGESIZE), pos = ftell(input);
+	if (fd < 0 || page <= 0 || pos < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return PICKLE_ERROR;
+	const size_t size = st.st_size;
+	if (!size || (size % page) == 0 || (size_t)pos > size)
+		return PICKLE_ERROR;
+	void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED)
+		return PICKLE_ERROR;
+	if (fseek(input, 0, SEEK_END) < 0) {
+		(void)munmap(m, size);
+		return PICKLE_ERROR;
+	}
+	c->map    = m;
+	c->mapped = size;
+	c->text   = (char*)m + pos;
+	c->length = size - pos;
+	return PICKLE_OK;
+#else
+	return PICKLE_ERROR;
+#endif
+}
+
+/* Read the rest of 'input', mapping it if possible, otherwise reading it in
+ * to a buffer that doubles in size, which works for pipes as well as files. */
+static int slurp(FILE *input, contents_t *c) {
+	assert(input);
+	assert(c);
+	memset(c, 0, sizeof (*c));
+	if (map_contents(input, c) == PICKLE_OK)
+		return PICKLE_OK;
+	size_t size = LINE_SZ, n = 0;
+	char *r = malloc(size);
+	if (!r)
+		return PICKLE_ERROR;
+	for (;;) {
+		if ((size - n) < 2) {
+			char *p = realloc(r, size * 2);
+			if (!p)
+				goto fail;
+			r = p;
+			size *= 2;
+		}
+		const size_t got = fread(r + n, 1, size - n - 1, input);
+		n += got;
+		if (!got)
+			break;
+	}
+	if (ferror(input))
 		goto fail;
-	r[pos] = '\0'; /* Ensure NUL termination */
-	rewind(input);
-	return r;
+	r[n] = '\0'; /* Ensure NUL termination */
+	c->text   = r;
+	c->length = n;
+	return PICKLE_OK;
 fail:
 	free(r);
-	rewind(input);
-	return NULL;
+	return PICKLE_ERROR;
 }
 
-static char *slurp_by_name(const char *name) {
+static void contents_release(contents_t *c) {
+	assert(c);
+#ifdef __linux__
+	if (c->mapped) {
+		(void)munmap(c->map, c->mapped);
+		memset(c, 0, sizeof (*c));
+		return;
+	}
+#endif
+	free(c->text);
+	memset(c, 0, sizeof (*c));
+}
+
+static int slurp_by_name(const char *name, contents_t *c) {
 	assert(name);
+	assert(c);
 	FILE *input = fopen(name, "rb");
 	if (!input)
-		return NULL;
-	char *r = slurp(input);
-	fclose(input);
+		return PICKLE_ERROR;
+	const int r = slurp(input, c);
+	const int e = errno;
+	fclose(input); /* a mapping stays valid after the file is closed */
+	errno = e;
 	return r;
 }
 
@@ -282,24 +464,24 @@ static int file(pickle_t *i, const char *name, FILE *output, int command) {
 	assert(file);
 	assert(output);
 	errno = 0;
-	char *program = slurp_by_name(name);
-	if (!program) {
+	contents_t program;
+	if (slurp_by_name(name, &program) != PICKLE_OK) {
 		if (command)
 			return pickle_set_result_error(i, "Failed to open file %s (rb): %s\n", name, strerror(errno));
 		fprintf(stderr, "Failed to open file %s (rb): %s\n", name, strerror(errno));
 		return PICKLE_ERROR;
 	}
-	const int retcode = pickle_eval(i, program);
+	const int retcode = pickle_eval(i, program.text);
 	if (retcode != PICKLE_OK)
 		if (!command) {
 			const char *s = NULL;
 			if (pickle_get_result_string(i, &s) != PICKLE_OK) {
-				free(program);
+				contents_release(&program);
 				return PICKLE_ERROR;
 			}
 			fprintf(output, "%s\n", s);
 		}
-	free(program);
+	contents_release(&program);
 	return retcode;
 }
 
@@ -316,7 +498,8 @@ static int pickleCommandSource(pickle_t *i, const int argc, char **argv, void *p
 
 static int pickleCommandFile(pickle_t *i, const int argc, char **argv, void *pd) {
 	assert(pd);
-	FILE *f = (FILE*)pd;
+	pickle_file_t *h = pd;
+	FILE *f = h->file;
 	if (argc == 1)
 		return pickle_set_result_integer(i, ftell(f));
 	const char *name = argv[0];
@@ -330,12 +513,25 @@ static int pickleCommandFile(pickle_t *i, const int argc, char **argv, void *pd)
 		if (!strcmp("-close", argv[1])) {
 			if (pickle_rename_command(i, name, "") != PICKLE_OK)
 				return pickle_set_result_error(i, "unable to remove command: %s", name);
+			free(h->line);
+			h->line = NULL;
+			h->size = 0;
+			if (h->owned)
+				free(h);
 			return pickle_set_result_integer(i, fclose(f));
 		}
 		if (!strcmp("-getc", argv[1]))
 			return pickle_set_result_integer(i, fgetc(f));
 		if (!strcmp("-gets", argv[1]))
-			return pickleGetLine(i, f);
+			return pickleGetLine(i, h);
+		if (!strcmp("-readall", argv[1])) {
+			contents_t c;
+			if (slurp(f, &c) != PICKLE_OK)
+				return pickle_set_result_error(i, "read failed: %s", strerror(errno));
+			const int r = pickle_set_result_string(i, c.text);
+			contents_release(&c);
+			return r;
+		}
 		if (!strcmp("-rewind", argv[1]))
 			return pickle_set_result_integer(i, fseek(f, 0, SEEK_SET));
 		if (!strcmp("-error", argv[1]))
@@ -344,6 +540,14 @@ static int pickleCommandFile(pickle_t *i, const int argc, char **argv, void *pd)
 			return pickle_set_result_integer(i, feof(f));
 	}
 	if (argc == 3) {
+		if (!strcmp("-lines", argv[1])) {
+			long count = 0;
+			if (pickleArgToNumber(i, argv[2], &count) != PICKLE_OK)
+				return PICKLE_ERROR;
+			if (count <= 0)
+				return pickle_set_result_error(i, "invalid line count %s", argv[2]);
+			return pickleGetLines(i, h, count);
+		}
 		if (!strcmp("-putc", argv[1]))
 			return pickle_set_result_integer(i, fputc(argv[2][0], f));
 		if (!strcmp("-puts", argv[1]))
@@ -375,16 +579,24 @@ static int pickleCommandFOpen(pickle_t *i, const int argc, char **argv, void *pd
 		return pickle_set_result_error_arity(i, 3, argc, argv);
 	errno = 0;
 	char buf[LINE_SZ] = { 0 };
+	pickle_file_t *h = calloc(1, sizeof (*h));
+	if (!h)
+		return pickle_set_result_error(i, "open failed");
 	FILE *handle = fopen(argv[1], argv[2]);
-	if (!handle)
+	if (!handle) {
+		free(h);
 		return pickle_set_result_error(i, "unable to open %s (mode = %s): %s", argv[1], argv[2], strerror(errno));
+	}
+	(void)setvbuf(handle, NULL, _IOFBF, FILE_SZ);
+	h->file = handle;
+	h->owned = true;
 	snprintf(buf, sizeof buf, "%p", (void*)handle);
-	if (pickle_register_command(i, buf, pickleCommandFile, handle) != PICKLE_OK)
+	if (pickle_register_command(i, buf, pickleCommandFile, h) != PICKLE_OK)
 		goto fail;
 	return pickle_set_result_string(i, buf);
 fail:
-	if (handle)
-		fclose(handle);
+	fclose(handle);
+	free(h);
 	return pickle_set_result_error(i, "open failed");
 }
 
@@ -432,6 +644,10 @@ static int pickleCommandFRename(pickle_t *i, const int argc, char **argv, void *
 
 static int register_custom_commands(pickle_t *i, pool_t *p, int prompt) {
 	assert(i);
+	static pickle_file_t std[] = { { .file = NULL }, { .file = NULL }, { .file = NULL }, };
+	std[0].file = stdin;
+	std[1].file = stdout;
+	std[2].file = stderr;
 	const pickle_register_command_t commands[] = {
 		{ "system",   pickleCommandSystem,    NULL },
 		{ "exit",     pickleCommandExit,      NULL },
@@ -446,9 +662,9 @@ static int register_custom_commands(pickle_t *i, pool_t *p, int prompt) {
 		{ "heap",     pickleCommandHeapUsage, p },
 		{ "fopen",    pickleCommandFOpen,     NULL },
 		{ "frename",  pickleCommandFRename,   NULL },
-		{ "stdin",    pickleCommandFile,      stdin },
-		{ "stdout",   pickleCommandFile,      stdout },
-		{ "stderr",   pickleCommandFile,      stderr },
+		{ "stdin",    pickleCommandFile,      &std[0] },
+		{ "stdout",   pickleCommandFile,      &std[1] },
+		{ "stderr",   pickleCommandFile,      &std[2] },
 		{ "errno",    pickleCommandErrno,     NULL },
 	};
 	if (pickle_set_var_string(i, "prompt", prompt ? "pickle> " : "") != PICKLE_OK)
@@ -607,7 +823,10 @@ Options:\n\
 \t-t,\trun built in self tests and exit (return code 0 is success)\n\
 \t-a,\tuse custom block allocator, for testing purposes\n\
 \t-A,\tenable debugging of the custom allocator, implies '-a'\n\
+\t-b,\tuse a buddy allocator for the custom allocator, implies '-a'\n\
 \t-s,\tsuppress prompt printing\n\
+\t-P,\tprofile commands, printing the results to stderr on exit\n\
+\t-F file,\tsample the stack, writing folded stacks for flame graphs to file\n\
 \n\
 If no arguments are given then input is taken from stdin. Otherwise\n\
 they are treated as scripts to execute. Maximum length of an input \n\
@@ -617,11 +836,69 @@ failure.\n";
 	fprintf(output, msg, arg0, x, y, z, q, LINE_SZ);
 }
 
+static int profile_print(void *file, const char *name, unsigned long calls, unsigned long long inclusive, unsigned long long exclusive, unsigned long allocs) {
+	assert(file);
+	assert(name);
+	return fprintf(file, "%-16s %10lu %14llu %14llu %10lu\n", name, calls, inclusive, exclusive, allocs) < 0 ? PICKLE_ERROR : PICKLE_OK;
+}
+
+static int sample_print(void *file, const char *stack, unsigned long count) {
+	assert(file);
+	assert(stack);
+	return fprintf(file, "%s %lu\n", stack, count) < 0 ? PICKLE_ERROR : PICKLE_OK;
+}
+
+static void sample_handler(int sig) {
+	UNUSED(sig);
+	pickle_sample(interp);
+}
+
+/* Sample the stack of the interpreter every 'period' microseconds of CPU
+ * time, the samples are written out as folded stacks on exit */
+static int sample_start(pickle_t *i, const long period) {
+	assert(i);
+	if (!USE_TIMER)
+		return PICKLE_ERROR;
+#ifdef __linux__
+	if (pickle_sampling(i, 1) != PICKLE_OK)
+		return PICKLE_ERROR;
+	/* 'sigaction' and not 'signal', the latter resets the handler after
+	 * each signal with the SysV semantics glibc uses for strict X/Open */
+	struct sigaction sa = { .sa_handler = sample_handler, .sa_flags = SA_RESTART, };
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) < 0)
+		return PICKLE_ERROR;
+	struct itimerval t = { .it_interval = { .tv_sec = 0, .tv_usec = period }, .it_value = { .tv_sec = 0, .tv_usec = period }, };
+	return setitimer(ITIMER_PROF, &t, NULL) < 0 ? PICKLE_ERROR : PICKLE_OK;
+#else
+	return PICKLE_ERROR;
+#endif
+}
+
+static void sample_stop(void) {
+#ifdef __linux__
+	struct itimerval t = { .it_interval = { .tv_sec = 0, .tv_usec = 0 }, .it_value = { .tv_sec = 0, .tv_usec = 0 }, };
+	(void)setitimer(ITIMER_PROF, &t, NULL);
+	(void)signal(SIGPROF, SIG_IGN);
+#endif
+}
+
 static void cleanup(void) {
 	static int cleaned = 0;
 	if (cleaned)
 		return;
 	cleaned = 1;
+	if (profile && interp) {
+		fprintf(stderr, "%-16s %10s %14s %14s %10s\n", "command", "calls", "inclusive-ns", "exclusive-ns", "allocs");
+		(void)pickle_profile_dump(interp, profile_print, stderr);
+	}
+	if (samples) {
+		sample_stop();
+		if (interp)
+			(void)pickle_sample_dump(interp, sample_print, samples);
+		fclose(samples);
+		samples = NULL;
+	}
 	pickle_delete(interp);
 	if (use_custom_allocator) {
 		use_custom_allocator = 0;
@@ -631,28 +908,38 @@ static void cleanup(void) {
 
 int main(int argc, char **argv) {
 	pickle_getopt_t opt = { .init = 0 };
-	int r = 0, prompt_on = 1, memory_debug = 0, ch;
+	int r = 0, prompt_on = 1, memory_debug = 0, buddy = 0, ch;
 
 	static const pool_specification_t specs[] = {
 		{ 8,   512 }, /* most allocations are quite small */
 		{ 16,  256 },
-		{ 32,  128 },
-		{ 64,   64 },
+		{ 32,  256 },
+		{ 64,  256 }, /* commands are 40 bytes on 64-bit machines */
 		{ 128,  32 },
 		{ 256,  16 },
 		{ 512,   8 }, /* maximum string length is bounded by this */
 	};
 
+	(void)setvbuf(stdin, NULL, _IOFBF, FILE_SZ); /* before any input, so lines are read from a larger buffer */
+
 	if (atexit(cleanup)) {
 		fprintf(stderr, "atexit failed\n");
 		return -1;
 	}
 
-	while ((ch = pickle_getopt(&opt, argc, argv, "hatsA")) != PICKLE_RETURN) {
+	while ((ch = pickle_getopt(&opt, argc, argv, "hatsAbPF:")) != PICKLE_RETURN) {
 		switch (ch) {
 		case 'A': memory_debug = 1; /* fall through */
 		case 'a': use_custom_allocator = 1; break;
+		case 'b': use_custom_allocator = 1; buddy = 1; break;
 		case 's': prompt_on = 0; break;
+		case 'P': profile = 1; break;
+		case 'F':
+			if (!(samples = fopen(opt.arg, "wb"))) {
+				fprintf(stderr, "unable to open %s: %s\n", opt.arg, strerror(errno));
+				return -1;
+			}
+			break;
 		case 'h': help(stdout, argv[0]); return 0;
 		case 't': return tests();
 		default: help(stderr, argv[0]); return -1;
@@ -660,11 +947,15 @@ int main(int argc, char **argv) {
 	}
 
 	if (use_custom_allocator) {
-		pool_t *p = pool_new(sizeof(specs) / sizeof(specs[0]), &specs[0]);
+		pool_t *p = buddy ?
+			pool_buddy_new(16, BUDDY_SZ) :
+			pool_new(sizeof(specs) / sizeof(specs[0]), &specs[0]);
 		if (!(block_allocator.arena = p)) {
 			fputs("memory pool allocation failure\n", stderr);
 			return EXIT_FAILURE;
 		} else {
+			p->grow    = true; /* add slabs to full arenas, and free them once empty */
+			p->release = true;
 			if (memory_debug) {
 				p->tracer     = memory_tracer;
 				p->tracer_arg = stdout;
@@ -676,6 +967,14 @@ int main(int argc, char **argv) {
 		goto end;
 	if ((r = register_custom_commands(interp, block_allocator.arena, prompt_on)) < 0)
 		goto end;
+	if (profile && (r = pickle_profile(interp, 1)) < 0) {
+		fputs("profiling is not available\n", stderr);
+		goto end;
+	}
+	if (samples && (r = sample_start(interp, SAMPLE_US)) < 0) {
+		fputs("sampling is not available\n", stderr);
+		goto end;
+	}
 
 	static const char *ns[] = {
 		"proc puts {x} { stdout -puts $x; stdout -puts \"\n\" }",
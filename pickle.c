@@ -41,17 +41,41 @@
  *
  * NOTE: The string escaping could be improved upon. */
 
+#if !defined(DEFINE_PROFILER) && defined(__unix__)
+#define DEFINE_PROFILER   (1)
+#endif
+
+#ifndef DEFINE_PROFILER
+#define DEFINE_PROFILER   (0)
+#endif
+
+#if DEFINE_PROFILER && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE (199309L) /* clock_gettime */
+#endif
+
 #include "pickle.h"
 #include <assert.h>  /* !defined(NDEBUG): assert */
 #include <ctype.h>   /* toupper, tolower, isalnum, isalpha, ... */
-#include <stdint.h>  /* intptr_t */
-#include <limits.h>  /* CHAR_BIT, LONG_MAX, LONG_MIN */
+#include <stdint.h>  /* intptr_t, uint64_t */
+#include <limits.h>  /* CHAR_BIT, INT_MAX, LONG_MAX, LONG_MIN */
+#include <signal.h>  /* sig_atomic_t */
 #include <stdarg.h>  /* va_list, va_start, va_end */
-#include <stdio.h>   /* vsnprintf */
+#include <stddef.h>  /* offsetof */
+#include <stdio.h>   /* vsnprintf, snprintf */
 #include <stdlib.h>  /* !defined(DEFAULT_ALLOCATOR): free, malloc, realloc */
 #include <string.h>  /* memset, memchr, strstr, strcmp, strncmp, strcpy, strlen, strchr */
+#if DEFINE_PROFILER
+#include <time.h>    /* DEFINE_PROFILER: clock_gettime */
+#endif
 
 #define PICKLE_MAX_RECURSION      (128) /* Recursion limit */
+#define PICKLE_MAX_CACHE          (8)   /* Number of compiled scripts to cache, 0 disables the cache */
+#define PICKLE_MAX_REGEX          (8)   /* Number of compiled regular expressions to cache, at least one */
+#define PICKLE_FRAME_VARS         (4)   /* Initial size of variable hash table in a call frame, a power of two */
+#define PICKLE_SAMPLE_BUCKETS     (64)  /* Buckets in the hash table of sampled stacks, a power of two */
+#define PICKLE_SORT_SMALL         (64)  /* Lists this long are sorted without allocating keys and scratch space */
+#define PICKLE_LIST_WINDOW        (32)  /* Elements recorded at a time by a list too long to record them all */
+#define PICKLE_SCRATCH_SZ         (512) /* Size of each chunk of the scratch arena arguments are built in */
 
 #define SMALL_RESULT_BUF_SZ       (96)
 #define PRINT_NUMBER_BUF_SZ       (64 /* base 2 */ + 1 /* '-'/'+' */ + 1 /* NUL */)
@@ -119,6 +143,11 @@
 #define PICKLE_VERSION (0x000000ul) /* all zeros = built incorrectly */
 #endif
 
+typedef long number_t;
+typedef unsigned long unumber_t;
+#define NUMBER_MIN (LONG_MIN)
+#define NUMBER_MAX (LONG_MAX)
+
 enum { PT_ESC, PT_STR, PT_CMD, PT_VAR, PT_SEP, PT_EOL, PT_EOF };
 
 typedef struct {
@@ -149,8 +178,38 @@ typedef PREPACK struct {
 
 enum { PV_STRING, PV_SMALL_STRING, PV_LINK };
 
+typedef PREPACK struct {
+	int offset, length; /**< position of element within the string the list was made from */
+} POSTPACK pickle_span_t;
+
+PREPACK struct pickle_list { /**< A list, as the positions of its elements within a string */
+	int length, capacity;
+	int first;          /**< element recorded in 'span[0]', only not zero if 'window' is set */
+	unsigned window :1; /**< 'span' holds only some elements, use 'picolListSpan' to get one */
+	pickle_span_t span[];
+} POSTPACK;
+
+PREPACK struct pickle_string { /**< A reference counted string, see 'picolStringNew' */
+	int refs;                 /**< number of references, it is freed when this reaches zero */
+	int length;               /**< length of 'data', not including the NUL terminator */
+	int capacity;             /**< bytes allocated for 'data', not including the NUL terminator */
+	unsigned scratch :1;      /**< allocated from the scratch arena, it is never shared */
+	char data[];              /**< NUL terminated contents, which must not change whilst shared */
+} POSTPACK;
+
+PREPACK struct pickle_scratch { /**< A chunk of the scratch arena, see 'picolScratchAllocate' */
+	struct pickle_scratch *next; /**< next chunk, kept for reuse when the arena is released */
+	size_t used;                 /**< bytes of 'data' handed out */
+	uint64_t data[];             /**< memory handed out, aligned for strings and argument arrays */
+} POSTPACK;
+
+typedef struct {
+	struct pickle_scratch *chunk; /**< chunk being allocated from, NULL if none */
+	size_t used;                  /**< bytes of it used */
+} pickle_scratch_mark_t; /**< A point the scratch arena can be released back to */
+
 typedef union {
-	char *ptr,  /**< pointer to string that has spilled over 'small' in size */
+	char *ptr,  /**< pointer to string that has spilled over 'small' in size, reference counted */
 	     small[sizeof(char*)]; /**< string small enough to be stored in a pointer (including NUL terminator)*/
 } compact_string_t; /**< either a pointer to a string, or a string stored in a pointer */
 
@@ -160,22 +219,118 @@ PREPACK struct pickle_var { /* strings are stored as either pointers, or as 'sma
 		compact_string_t val;    /**< value */
 		struct pickle_var *link; /**< link to another variable */
 	} data;
-	struct pickle_var *next; /**< next variable in list of variables */
+	unsigned long hash;      /**< hash of name */
+	number_t number;         /**< cached numeric value of string, valid if 'numeric' is set */
+	struct pickle_list *list; /**< cached list representation of value, NULL if there is none */
+	struct pickle_var *next; /**< next variable in the same bucket of the hash table of its call frame */
 
-	unsigned type      : 2; /* type of data; string (pointer/small), or link (NB. Could add number type) */
+	unsigned type      : 2; /* type of data; string (pointer/small), or link */
 	unsigned smallname : 1; /* if true, name is stored as small string */
+	unsigned localname : 1; /* if true, name is borrowed from the locals of the program of the call frame */
+	unsigned numeric   : 1; /* if true, 'number' holds the value, the string is its canonical form */
+} POSTPACK;
+
+PREPACK struct pickle_profile { /**< Profiling statistics for a command */
+	unsigned long calls;         /**< number of calls */
+	unsigned long allocs;        /**< allocations made by the command, not the commands it calls */
+	uint64_t inclusive;          /**< nanoseconds spent in the command, and the commands it calls */
+	uint64_t exclusive;          /**< nanoseconds spent in the command, not the commands it calls */
+	struct pickle_profile *next; /**< next in list of all statistics, owned by the interpreter */
+} POSTPACK;
+
+PREPACK struct pickle_sample { /**< A stack seen by the sampling profiler */
+	char *stack;                /**< procedures called, outermost first, separated by ';' */
+	unsigned long hash;         /**< hash of 'stack' */
+	unsigned long count;        /**< times it has been seen */
+	struct pickle_sample *next; /**< next in hash table bucket */
 } POSTPACK;
 
 PREPACK struct pickle_command {
 	char *name;                  /**< name of function */
 	pickle_command_func_t func;  /**< pointer to function that implements this command */
 	struct pickle_command *next; /**< next command in list (chained hash table) */
+	unsigned long hash;          /**< hash of 'name', compared before the name when searching a chain */
 	void *privdata;              /**< (optional) private data for function */
+	struct pickle_profile *profile; /**< statistics, allocated when first called whilst profiling, may be NULL */
+	unsigned foreign :1;         /**< registered with 'pickle_register_command', it may write to its arguments */
+} POSTPACK;
+
+enum { OP_COMMAND, OP_LITERAL, OP_VARIABLE, OP_SUBSTITUTE, OP_ERROR };
+enum { ERROR_PARSE, ERROR_ESCAPE };
+
+typedef PREPACK struct {
+	unsigned op      :3, /**< instruction; OP_... */
+		 append  :1, /**< if true, append to the previous argument instead of starting a new one */
+		 numeric :1, /**< OP_LITERAL: literal is a number in canonical form */
+		 literal :1; /**< OP_COMMAND: command name is a single literal, so the command can be cached */
+	int length;          /**< OP_COMMAND: argument count, OP_LITERAL: string length, OP_VARIABLE: slot or -1, OP_ERROR: ERROR_... */
+	number_t number;     /**< OP_LITERAL: numeric value, valid if 'numeric' is set */
+	struct pickle_command *command; /**< OP_COMMAND: command last called, valid if 'epoch' is current */
+	unsigned long epoch;            /**< OP_COMMAND: value of the interpreters 'command_epoch' when 'command' was set */
+	union {
+		int count;                      /**< OP_COMMAND: instructions making up the arguments that follow */
+		const char *string;             /**< OP_LITERAL: text, OP_VARIABLE: name, OP_ERROR: offending token */
+		struct pickle_program *program; /**< OP_SUBSTITUTE: compiled command substitution */
+		size_t offset;                  /**< offset into string pool, only used whilst compiling */
+	} u;
+} POSTPACK pickle_instruction_t; /**< A single instruction, a script compiles to a list of these */
+
+typedef PREPACK struct {
+	char *name;                 /**< name of variable */
+	unsigned long hash;         /**< hash of 'name' */
+} POSTPACK pickle_local_t; /**< A variable of a procedure, given a slot in each of its call frames */
+
+PREPACK struct pickle_program {     /**< A compiled script */
+	pickle_instruction_t *code; /**< instructions, executed in order */
+	char *strings;              /**< pool of NUL terminated strings referenced by the instructions */
+	struct pickle_program *root;/**< outermost program, itself unless this is a command substitution */
+	pickle_local_t *locals;     /**< root only: variables resolved to slots, arguments first */
+	int length;                 /**< number of instructions */
+	int nlocals, arity;         /**< root only: number of 'locals', and how many of them are arguments */
+	long refs;                  /**< reference count, program is freed when this reaches zero */
+	unsigned slots  :1;         /**< root only: program is a procedure body, variables are resolved to slots */
+	unsigned params :1;         /**< root only: arguments can be bound to slots, there are no repeated names */
+} POSTPACK;
+
+typedef PREPACK struct {
+	char *args;                       /**< argument list */
+	char *body;                       /**< procedure body */
+	struct pickle_program *program;   /**< compiled body, NULL if not compiled yet */
+	unsigned nocompile :1;            /**< evaluate the body as text, do not compile it */
+} POSTPACK pickle_proc_t; /**< A procedure defined with 'proc' or 'variadic' */
+
+typedef PREPACK struct {
+	number_t number;                  /**< numeric value of argument, valid if 'numeric' is set */
+	struct pickle_var *var;           /**< variable argument was copied from, valid if 'epoch' is current */
+	unsigned long epoch;              /**< value of the interpreters 'epoch' when 'var' was read */
+	unsigned numeric :1;              /**< argument is a number in canonical form */
+} POSTPACK pickle_arg_t; /**< Information about an argument, kept alongside 'argv' by 'picolEvalProgram' */
+
+typedef PREPACK struct {
+	unsigned long hash;               /**< hash of script text */
+	size_t length;                    /**< length of script text */
+	char *text;                       /**< copy of script text, to verify a hit */
+	struct pickle_program *program;   /**< compiled script, NULL if entry is empty */
+	unsigned used :1;                 /**< clock eviction reference bit */
+} POSTPACK pickle_cache_entry_t;
+
+PREPACK struct pickle_cache { /**< Cache of compiled scripts, for those evaluated repeatedly */
+	pickle_cache_entry_t entry[PICKLE_MAX_CACHE + !PICKLE_MAX_CACHE];
+	unsigned long seen[PICKLE_MAX_CACHE + !PICKLE_MAX_CACHE]; /**< hashes of scripts seen only once, low bit set as zero is empty */
+	unsigned long failed[PICKLE_MAX_CACHE + !PICKLE_MAX_CACHE]; /**< likewise, of scripts that could not be compiled */
+	unsigned hand, next, nextfailed;  /**< clock hand for 'entry', next slot in 'seen' and in 'failed' */
+	unsigned long hits, misses;       /**< statistics */
 } POSTPACK;
 
 PREPACK struct pickle_call_frame {        /**< A call frame, organized as a linked list */
-	struct pickle_var *vars;          /**< first variable in linked list of variables */
+	struct pickle_var **vars;         /**< hash table of variables, chained through 'next', either 'local' or allocated */
+	struct pickle_var *local[PICKLE_FRAME_VARS]; /**< initial table, so frames with few variables do not allocate one */
 	struct pickle_call_frame *parent; /**< parent is NULL at top level */
+	const char *name;                 /**< name the procedure run in this frame was called by, NULL at top level */
+	struct pickle_program *program;   /**< procedure body run in this frame, owns a reference, may be NULL */
+	int count, capacity;              /**< number of variables in 'vars', and its buckets */
+	int slots;                        /**< number of entries in 'slot', the locals of 'program' */
+	struct pickle_var *slot[];        /**< variables of this frame in the locals of 'program', or NULL */
 } POSTPACK;
 
 PREPACK struct pickle_interpreter { /**< The Pickle Interpreter! */
@@ -185,33 +340,86 @@ PREPACK struct pickle_interpreter { /**< The Pickle Interpreter! */
 	const char *ch;                      /**< the current text position; set if line != 0 */
 	struct pickle_call_frame *callframe; /**< call stack */
 	struct pickle_command **table;       /**< hash table */
-	long length;                         /**< buckets in hash table */
+	struct pickle_cache *cache;          /**< compiled script cache, allocated on first use */
+	struct pickle_regex_cache *regexes;  /**< compiled regular expression cache, allocated on first use */
+	struct pickle_scratch *scratch_chunks; /**< scratch arena: all chunks allocated, in order of use */
+	struct pickle_scratch *scratch;      /**< scratch arena: chunk being allocated from, NULL if none */
+	pickle_arg_t *args;                  /**< numbers for the arguments of the executing command, may be NULL */
+	char **argv;                         /**< arguments of the executing command, all reference counted strings */
+	number_t result_number;              /**< cached numeric value of result, valid if 'result_numeric' is set */
+	unsigned long epoch;                 /**< incremented whenever a variable is changed or deleted */
+	unsigned long command_epoch;         /**< incremented whenever a command is added or removed */
+	unsigned long allocs;                /**< count of allocations, used by the profiler */
+	struct pickle_profile *profiles;     /**< profiling: statistics of all commands profiled, including deleted ones */
+	struct pickle_sample **samples;      /**< sampling: hash table of stacks seen, allocated on first use */
+	volatile sig_atomic_t sample;        /**< sampling: set, by a signal handler, to record the stack at the next command */
+	uint64_t nested;                     /**< profiling: nanoseconds spent in commands called by the current one */
+	unsigned long nested_allocs;         /**< profiling: allocations made by commands called by the current one */
+	long length;                         /**< buckets in hash table, a power of two */
+	long commands;                       /**< number of commands in hash table */
 	int level;                           /**< level of nesting */
 	int line;                            /**< current line number */
 	unsigned initialized   :1;           /**< if true, interpreter is initialized and ready to use */
 	unsigned static_result :1;           /**< internal use only: if true, result should not be freed */
 	unsigned insideuplevel :1;           /**< true if executing inside an uplevel command */
 	unsigned insideunknown :1;           /**< true if executing inside the 'unknown' proc */
+	unsigned result_numeric :1;          /**< true if 'result_number' is valid, 'result' is its canonical form */
+	unsigned result_shared  :1;          /**< true if 'result' is a reference counted string */
+	unsigned profiling      :1;          /**< true if command calls are being timed and counted */
+	unsigned sampling       :1;          /**< true if the stack is recorded at the next command after 'sample' is set */
 } POSTPACK;
 
 typedef PREPACK struct {
-	const char *start,  /**< start of match, NULL if no match */
-	      *end;         /**< end of match, NULL if no match */
-	int max;            /**< */
-	unsigned type   :2, /**< select regex type; lazy, greedy or possessive */
-		 nocase :1; /**< ignore case when matching */
-} POSTPACK pickle_regex_t; /**< */
+	unsigned op :3;     /**< instruction; RX_... */
+	int c;              /**< RX_CHAR, RX_POSSESS, RX_ONCE: character or class to match */
+	int x, y;           /**< branch targets, 'y' is only used by RX_SPLIT */
+} POSTPACK pickle_regex_op_t; /**< A single instruction of a compiled regular expression */
+
+typedef PREPACK struct {
+	int pc;             /**< instruction this thread is waiting on */
+	size_t start;       /**< offset into text where the match this thread is following started */
+} POSTPACK pickle_regex_thread_t; /**< A thread of the matcher, there is at most one per instruction */
+
+typedef PREPACK struct {
+	pickle_regex_op_t *code;       /**< instructions, starting at zero */
+	int length;                    /**< number of instructions */
+	unsigned type     :2,          /**< select regex type; lazy, greedy or possessive */
+		 nocase   :1,          /**< ignore case when matching */
+		 anchored :1,          /**< pattern started with '^', only match at the start of text */
+		 glob     :1;          /**< pattern is a glob, as used by 'string match', not a regex */
+} POSTPACK pickle_regex_t; /**< A compiled regular expression, allocated as a single block */
+
+typedef PREPACK struct {
+	unsigned long hash;               /**< hash of pattern */
+	size_t length;                    /**< length of pattern */
+	char *text;                       /**< copy of pattern, to verify a hit */
+	pickle_regex_t *regex;            /**< compiled pattern, along with the options it was compiled with, NULL if empty */
+	unsigned used :1;                 /**< clock eviction reference bit */
+} POSTPACK pickle_regex_entry_t;
+
+PREPACK struct pickle_regex_cache {   /**< Cache of compiled regular expressions */
+	pickle_regex_entry_t entry[PICKLE_MAX_REGEX];
+	unsigned hand;                    /**< clock hand for 'entry' */
+	unsigned long hits, misses;       /**< statistics */
+	pickle_regex_thread_t *run[2];    /**< matcher work space, shared by all entries: current and next thread lists */
+	int *stack;                       /**< matcher work space: instructions still to be followed */
+	size_t *mark;                     /**< matcher work space: step each instruction was last added on */
+	int capacity;                     /**< instructions the work space has room for; the longest pattern compiled */
+} POSTPACK;
 
 typedef struct PREPACK { int argc; char **argv; } POSTPACK args_t;
 
 typedef struct pickle_var pickle_var_t;
 typedef struct pickle_call_frame pickle_call_frame_t;
 typedef struct pickle_command pickle_command_t;
-
-typedef long number_t;
-typedef unsigned long unumber_t;
-#define NUMBER_MIN (LONG_MIN)
-#define NUMBER_MAX (LONG_MAX)
+typedef struct pickle_profile pickle_profile_t;
+typedef struct pickle_sample pickle_sample_t;
+typedef struct pickle_program pickle_program_t;
+typedef struct pickle_cache pickle_cache_t;
+typedef struct pickle_regex_cache pickle_regex_cache_t;
+typedef struct pickle_list pickle_list_t;
+typedef struct pickle_string pickle_string_t;
+typedef struct pickle_scratch pickle_scratch_t;
 
 static const char  string_empty[]     = "";              /* Space saving measure */
 static const char  string_oom[]       = "Out Of Memory"; /* Cannot allocate this, obviously */
@@ -223,6 +431,7 @@ static inline void static_assertions(void) { /* A neat place to put these */
 	BUILD_BUG_ON(sizeof (struct pickle_interpreter) > PICKLE_MAX_STRING);
 	BUILD_BUG_ON(sizeof (string_oom) > SMALL_RESULT_BUF_SZ);
 	BUILD_BUG_ON(PICKLE_MAX_RECURSION < 8);
+	BUILD_BUG_ON(PICKLE_MAX_REGEX < 1);
 	BUILD_BUG_ON(PICKLE_OK    !=  0);
 	BUILD_BUG_ON(PICKLE_ERROR != -1);
 }
@@ -282,23 +491,53 @@ static inline void *locateByte(const void *m, int c, size_t n) {
 }
 
 static int picolForceResult(pickle_t *i, const char *result, const int is_static);
+static int picolFlushCache(pickle_t *i);
 
 static inline void *picolMalloc(pickle_t *i, size_t size) {
 	assert(i);
 	assert(size > 0); /* we should not allocate any zero length objects here */
 	if (USE_MAX_STRING && size > PICKLE_MAX_STRING)
 		return NULL;
+	i->allocs++;
 	void *r = i->allocator.malloc(i->allocator.arena, size);
+	if (!r && picolFlushCache(i)) /* the script cache can be rebuilt, give its memory back and try again */
+		r = i->allocator.malloc(i->allocator.arena, size);
 	if (!r && size)
 		(void)picolForceResult(i, string_oom, 1); /* does not allocate, may free */
 	return r;
 }
 
+/* For memory that is wanted but not needed, such as when growing a buffer or
+ * a table beyond what is strictly required; the allocation is counted as
+ * any other, but on failure the result is left alone and the script cache is
+ * not flushed, as the caller carries on without it. Flushing here would
+ * empty the cache every time a bounded allocator, such as the one used by
+ * 'pickle -a', refuses a larger block. */
+static inline void *picolTryRealloc(pickle_t *i, void *p, size_t size) {
+	assert(i);
+	if (USE_MAX_STRING && size > PICKLE_MAX_STRING)
+		return NULL;
+	i->allocs++;
+	return i->allocator.realloc(i->allocator.arena, p, size);
+}
+
+static inline void *picolTryMalloc(pickle_t *i, size_t size) {
+	assert(i);
+	assert(size > 0);
+	if (USE_MAX_STRING && size > PICKLE_MAX_STRING)
+		return NULL;
+	i->allocs++;
+	return i->allocator.malloc(i->allocator.arena, size);
+}
+
 static inline void *picolRealloc(pickle_t *i, void *p, size_t size) {
 	assert(i);
 	if (USE_MAX_STRING && size > PICKLE_MAX_STRING)
 		return NULL;
+	i->allocs++;
 	void *r = i->allocator.realloc(i->allocator.arena, p, size);
+	if (!r && size && picolFlushCache(i))
+		r = i->allocator.realloc(i->allocator.arena, p, size);
 	if (!r && size)
 		(void)picolForceResult(i, string_oom, 1); /* does not allocate, may free */
 	return r;
@@ -366,6 +605,47 @@ static int picolStringToNumber(pickle_t *i, const char *s, number_t *out) {
 	return picolConvertBaseNNumber(i, s, out, 10);
 }
 
+static int picolNumberToString(char buf[/*static*/ 64/*base 2*/ + 1/*'+'/'-'*/ + 1/*NUL*/], number_t in, int base);
+
+/* Cached numbers are only kept for strings in canonical form (no leading
+ * zeros or '+', no "-0", etc.) so that the string and the number are
+ * interchangeable, for example "0" is false but "00" is not. This has no side
+ * effects on the interpreter result, unlike 'picolStringToNumber'. */
+static int picolIsCanonicalNumber(const char *s, number_t *out) {
+	assert(s);
+	assert(out);
+	char buf[PRINT_NUMBER_BUF_SZ] = { 0 };
+	number_t n = 0;
+	const int negate = s[0] == '-';
+	size_t j = negate;
+	if (!s[j])
+		return 0;
+	for (; s[j]; j++) {
+		if (j >= (sizeof (buf) - 1) || s[j] < '0' || s[j] > '9')
+			return 0;
+		n = (n * 10) + (s[j] - '0');
+	}
+	n = negate ? -n : n;
+	if (picolNumberToString(buf, n, 10) != PICKLE_OK || compare(buf, s))
+		return 0; /* leading zeros, "-0", overflow, ... */
+	*out = n;
+	return 1;
+}
+
+/* 'argv[j]' as a number, if 'argv' is the argument list being used by
+ * 'picolEvalProgram' to execute the current command then any number it
+ * has already worked out is used instead of converting the string. */
+static inline int picolArgToNumber(pickle_t *i, char **argv, const int j, number_t *out) {
+	assert(i);
+	assert(argv);
+	assert(out);
+	if (i->argv == argv && i->args && i->args[j].numeric) {
+		*out = i->args[j].number;
+		return PICKLE_OK;
+	}
+	return picolStringToNumber(i, argv[j], out);
+}
+
 static inline int picolCompareCaseInsensitive(const char *a, const char *b) {
 	assert(a);
 	assert(b);
@@ -471,28 +751,260 @@ static char *picolStrdup(pickle_t *i, const char *s) {
 	return r ? move(r, s, l + 1) : r;
 }
 
-static inline unsigned long picolHashString(const char *s) { /* DJB2 Hash, <http://www.cse.yorku.ca/~oz/hash.html> */
+/* Commands are built up in a scratch arena; the array of arguments and the
+ * strings made for them, such as literals and interpolations. It is a list
+ * of fixed size chunks memory is bumped off of. Evaluation marks the arena
+ * before a command and releases it back to that mark once the command has
+ * been called, which is last in first out as evaluation nests. Chunks are
+ * kept for reuse, so once warmed up building and calling a command does not
+ * use the allocator. Requests too large for a chunk return NULL, callers
+ * then use the allocator instead. */
+static inline pickle_scratch_mark_t picolScratchMark(pickle_t *i) {
+	assert(i);
+	return (pickle_scratch_mark_t){ .chunk = i->scratch, .used = i->scratch ? i->scratch->used : 0 };
+}
+
+static inline void picolScratchRelease(pickle_t *i, const pickle_scratch_mark_t m) {
+	assert(i);
+	if ((i->scratch = m.chunk))
+		m.chunk->used = m.used;
+}
+
+static inline size_t picolScratchAlign(const size_t size) {
+	return (size + sizeof (uint64_t) - 1) & ~(sizeof (uint64_t) - 1);
+}
+
+static void *picolScratchAllocate(pickle_t *i, size_t size) {
+	assert(i);
+	const size_t available = PICKLE_SCRATCH_SZ - sizeof (pickle_scratch_t);
+	if ((size = picolScratchAlign(size)) > available)
+		return NULL;
+	pickle_scratch_t *c = i->scratch;
+	if (!c || (c->used + size) > available) {
+		pickle_scratch_t *n = c ? c->next : i->scratch_chunks;
+		if (!n) {
+			if (!(n = picolMalloc(i, PICKLE_SCRATCH_SZ)))
+				return NULL;
+			n->next = NULL;
+			if (c)
+				c->next = n;
+			else
+				i->scratch_chunks = n;
+		}
+		n->used = 0;
+		i->scratch = c = n;
+	}
+	void *r = (char*)c->data + c->used;
+	c->used += size;
+	return r;
+}
+
+/* Grow 'p', of 'size' bytes, to 'needed' bytes if it was the last thing
+ * allocated and there is room for it, returning non-zero if it was grown */
+static int picolScratchExtend(pickle_t *i, const void *p, size_t size, size_t needed) {
+	assert(i);
+	assert(p);
+	pickle_scratch_t *c = i->scratch;
+	size = picolScratchAlign(size);
+	needed = picolScratchAlign(needed);
+	if (!c || (const char*)p + size != (char*)c->data + c->used)
+		return 0;
+	if ((c->used - size + needed) > (PICKLE_SCRATCH_SZ - sizeof (pickle_scratch_t)))
+		return 0;
+	c->used = c->used - size + needed;
+	return 1;
+}
+
+static int picolFreeScratch(pickle_t *i) {
+	assert(i);
+	int r = PICKLE_OK;
+	for (pickle_scratch_t *c = i->scratch_chunks, *n = NULL; c; c = n) {
+		n = c->next;
+		if (picolFree(i, c) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	}
+	i->scratch_chunks = NULL;
+	i->scratch = NULL;
+	return r;
+}
+
+/* Values of variables, arguments of commands being evaluated and (some)
+ * results are reference counted strings, so they can be passed from one to
+ * another without copying them. A reference counted string is a pointer to
+ * the 'data' of a 'pickle_string_t'. It must not be changed if it is shared,
+ * 'picolStringAppend' copies it first if needed. Strings that are appended to
+ * grow geometrically, so building one up piece by piece takes linear time.
+ * Arguments are made with 'picolStringScratch', in the scratch arena, and
+ * must not outlive the command they are for; they are copied instead of
+ * shared by 'picolSetVarShared' and 'picolSetResultShared'. */
+static inline pickle_string_t *picolStringHeader(const char *s) {
+	assert(s);
+	return (pickle_string_t*)(s - offsetof(pickle_string_t, data));
+}
+
+static char *picolStringNew(pickle_t *i, const char *s, const size_t length) {
+	assert(i);
+	assert(s);
+	if ((USE_MAX_STRING && length >= PICKLE_MAX_STRING) || length > INT_MAX)
+		return NULL;
+	pickle_string_t *r = picolMalloc(i, sizeof (*r) + length + 1);
+	if (!r)
+		return NULL;
+	r->refs     = 1;
+	r->length   = length;
+	r->capacity = length;
+	r->scratch  = 0;
+	move(r->data, s, length);
+	r->data[length] = '\0';
+	return r->data;
+}
+
+/* As 'picolStringNew', but allocated from the scratch arena if possible */
+static char *picolStringScratch(pickle_t *i, const char *s, const size_t length) {
+	assert(i);
+	assert(s);
+	if ((USE_MAX_STRING && length >= PICKLE_MAX_STRING) || length > INT_MAX)
+		return NULL;
+	pickle_string_t *r = picolScratchAllocate(i, sizeof (*r) + length + 1);
+	if (!r)
+		return picolStringNew(i, s, length);
+	r->refs     = 1;
+	r->length   = length;
+	r->capacity = length;
+	r->scratch  = 1;
+	move(r->data, s, length);
+	r->data[length] = '\0';
+	return r->data;
+}
+
+static inline char *picolStringRef(const char *s) {
+	assert(s);
+	pickle_string_t *h = picolStringHeader(s);
+	assert(h->refs > 0);
+	assert(!h->scratch);
+	h->refs++;
+	return h->data;
+}
+
+static int picolStringUnref(pickle_t *i, const char *s) {
+	assert(i);
+	if (!s)
+		return PICKLE_OK;
+	pickle_string_t *h = picolStringHeader(s);
+	assert(h->refs > 0);
+	if (--h->refs || h->scratch) /* the scratch arena is released all at once */
+		return PICKLE_OK;
+	return picolFree(i, h);
+}
+
+/* Append 'length' bytes of 'a' to '*s', in place if no one else refers to
+ * it. On failure '*s' is left as it is. */
+static int picolStringAppend(pickle_t *i, char **s, const char *a, const size_t length) {
+	assert(i);
+	assert(s && *s);
+	assert(a);
+	pickle_string_t *h = picolStringHeader(*s);
+	const size_t l = h->length, needed = l + length;
+	if ((USE_MAX_STRING && needed >= PICKLE_MAX_STRING) || needed > INT_MAX)
+		return PICKLE_ERROR;
+	if (h->scratch && needed > (size_t)h->capacity && picolScratchExtend(i, h, sizeof (*h) + h->capacity + 1, sizeof (*h) + needed + 1))
+		h->capacity = needed;
+	if (h->refs == 1 && (!h->scratch || needed <= (size_t)h->capacity)) {
+		if (needed > (size_t)h->capacity) { /* try doubling it, but settle for what is needed */
+			const size_t limit = USE_MAX_STRING ? PICKLE_MAX_STRING - sizeof (*h) - 1 : INT_MAX;
+			size_t capacity = MAX(needed, MIN((size_t)h->capacity * 2, limit));
+			pickle_string_t *n = capacity > needed ? picolTryRealloc(i, h, sizeof (*h) + capacity + 1) : NULL;
+			if (!n && !(n = picolRealloc(i, h, sizeof (*h) + (capacity = needed) + 1)))
+				return PICKLE_ERROR;
+			h = n;
+			h->capacity = capacity;
+		}
+	} else { /* shared, or in the scratch arena without room to grow, a copy stays there if it can */
+		pickle_string_t *n = h->scratch ? picolScratchAllocate(i, sizeof (*n) + needed + 1) : NULL;
+		const int scratch = !!n;
+		if (!n && !(n = picolMalloc(i, sizeof (*n) + needed + 1)))
+			return PICKLE_ERROR;
+		n->refs     = 1;
+		n->capacity = needed;
+		n->scratch  = scratch;
+		move(n->data, h->data, l);
+		h->refs--;
+		h = n;
+	}
+	move(h->data + l, a, length);
+	h->data[needed] = '\0';
+	h->length = needed;
+	*s = h->data;
+	return PICKLE_OK;
+}
+
+/* Hash 'length' bytes of 's' eight at a time, the bytes left over are
+ * gathered into one last word. The final mix (from MurmurHash3) spreads
+ * every input bit across the low bits, which are used to select a bucket or
+ * slot in the hash tables. */
+static inline unsigned long picolHash(const char *s, size_t length) {
 	assert(s);
-	unsigned long h = 5381, ch = 0;
-	for (size_t i = 0; (ch = s[i]); i++) {
-		implies(USE_MAX_STRING, i < PICKLE_MAX_STRING);
-		h = ((h << 5) + h) + ch;
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ length, w = 0;
+	for (; length >= sizeof (w); s += sizeof (w), length -= sizeof (w)) {
+		const unsigned char *u = (const unsigned char *)s; /* little endian, as the tail is, whatever the host; compilers turn this into one load */
+		w = (uint64_t)u[0]       | (uint64_t)u[1] <<  8 | (uint64_t)u[2] << 16 | (uint64_t)u[3] << 24
+		  | (uint64_t)u[4] << 32 | (uint64_t)u[5] << 40 | (uint64_t)u[6] << 48 | (uint64_t)u[7] << 56;
+		h = (h ^ w) * 0xff51afd7ed558ccdull;
+		h ^= h >> 29;
 	}
-	return h;
+	w = 0;
+	for (size_t j = 0; j < length; j++) /* a 'memcpy' of a variable length is not inlined */
+		w |= (uint64_t)(unsigned char)s[j] << (j * CHAR_BIT);
+	h = (h ^ w) * 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return (unsigned long)h;
+}
+
+static inline unsigned long picolHashString(const char *s) {
+	assert(s);
+	return picolHash(s, picolStrlen(s));
 }
 
 static inline pickle_command_t *picolGetCommand(pickle_t *i, const char *s) {
 	assert(s);
 	assert(i);
+	const unsigned long hash = picolHashString(s);
 	pickle_command_t *np = NULL;
-	for (np = i->table[picolHashString(s) % i->length]; np != NULL; np = np->next)
-		if (!compare(s, np->name))
+	for (np = i->table[hash & (i->length - 1)]; np != NULL; np = np->next)
+		if (np->hash == hash && !compare(s, np->name))
 			return np; /* found */
 	return NULL; /* not found */
 }
 
+/* The command table is doubled in size when it has more commands than
+ * buckets. If that fails the old table is kept, it still works but the
+ * chains get longer, so this is not an error and 'picolTryMalloc' is used
+ * to leave the result (and script cache) alone. */
+static void picolGrowCommands(pickle_t *i) {
+	assert(i);
+	const long length = i->length * 2;
+	const size_t bytes = length * sizeof (*i->table);
+	pickle_command_t **table = picolTryMalloc(i, bytes);
+	if (!table)
+		return;
+	zero(table, bytes);
+	for (long j = 0; j < i->length; j++)
+		for (pickle_command_t *c = i->table[j], *n = NULL; c; c = n) {
+			n = c->next;
+			c->next = table[c->hash & (length - 1)];
+			table[c->hash & (length - 1)] = c;
+		}
+	(void)picolFree(i, i->table);
+	i->table  = table;
+	i->length = length;
+}
+
 static int picolFreeResult(pickle_t *i) {
 	assert(i);
+	if (i->result_shared)
+		return picolStringUnref(i, i->result);
 	return i->static_result ? PICKLE_OK : picolFree(i, (char*)i->result);
 }
 
@@ -500,14 +1012,41 @@ static int picolForceResult(pickle_t *i, const char *result, const int is_static
 	assert(i);
 	assert(result);
 	int r = picolFreeResult(i);
-	i->static_result = is_static;
+	i->static_result  = is_static;
+	i->result_numeric = 0;
+	i->result_shared  = 0;
 	i->result = result;
 	return r;
 }
 
+/* Set the result to a new reference to the reference counted string 's' */
+static int picolSetResultShared(pickle_t *i, const char *s) {
+	assert(i);
+	assert(s);
+	if (picolStringHeader(s)->scratch)
+		return pickle_set_result_string(i, s);
+	char *r = picolStringRef(s);
+	const int fr = picolFreeResult(i);
+	i->static_result  = 0;
+	i->result_numeric = 0;
+	i->result_shared  = 1;
+	i->result = r;
+	return fr;
+}
+
+/* Return a reference counted string with the contents of the result */
+static char *picolResultToString(pickle_t *i) {
+	assert(i);
+	if (i->result_shared)
+		return picolStringRef(i->result);
+	return picolStringNew(i, i->result, picolStrlen(i->result));
+}
+
 static int picolCommandCallProc(pickle_t *i, const int argc, char **argv, void *pd);
 static int picolCommandCallVariadic(pickle_t *i, const int argc, char **argv, void *pd);
 
+static int picolFreeProc(pickle_t *i, pickle_proc_t *proc);
+
 static int picolIsDefinedProc(pickle_command_func_t func) {
 	return func == picolCommandCallProc || func == picolCommandCallVariadic;
 }
@@ -519,22 +1058,24 @@ static int picolRegisterCommand(pickle_t *i, const char *name, pickle_command_fu
 	assert(func);
 	pickle_command_t *np = picolGetCommand(i, name);
 	if (np) {
-		if (picolIsDefinedProc(func)) {
-			char **procdata = privdata;
-			(void)picolFree(i, procdata[0]);
-			(void)picolFree(i, procdata[1]);
-			(void)picolFree(i, procdata);
-		}
+		if (picolIsDefinedProc(func))
+			(void)picolFreeProc(i, privdata);
 		return pickle_set_result_error(i, "Invalid redefinition %s", name);
 	}
 	np = picolMalloc(i, sizeof(*np));
+	if (np)
+		zero(np, sizeof (*np));
 	if (np == NULL || (np->name = picolStrdup(i, name)) == NULL) {
 		(void)picolFree(i, np);
 		return PICKLE_ERROR;
 	}
-	const unsigned long hashval = picolHashString(name) % i->length;
-	np->next = i->table[hashval];
-	i->table[hashval] = np;
+	if (i->commands >= i->length)
+		picolGrowCommands(i);
+	np->hash = picolHashString(name);
+	np->next = i->table[np->hash & (i->length - 1)];
+	i->table[np->hash & (i->length - 1)] = np;
+	i->commands++;
+	i->command_epoch++;
 	np->func = func;
 	np->privdata = privdata;
 	return PICKLE_OK;
@@ -545,11 +1086,14 @@ static int picolFreeCmd(pickle_t *i, pickle_command_t *p);
 static int picolUnsetCommand(pickle_t *i, const char *name) {
 	assert(i);
 	assert(name);
-	pickle_command_t **p = &i->table[picolHashString(name) % i->length];
+	const unsigned long hash = picolHashString(name);
+	pickle_command_t **p = &i->table[hash & (i->length - 1)];
 	pickle_command_t *c = *p;
 	for (; c; c = c->next) {
-		if (!compare(c->name, name)) {
+		if (c->hash == hash && !compare(c->name, name)) {
 			*p = c->next;
+			i->commands--;
+			i->command_epoch++;
 			return picolFreeCmd(i, c);
 		}
 		p = &c->next;
@@ -802,41 +1346,153 @@ static int picolGetToken(pickle_parser_t *p) {
 	return PICKLE_OK;
 }
 
-static pickle_var_t *picolGetVar(pickle_t *i, const char *name, int link) {
-	assert(i);
+static inline const char *picolVarName(const pickle_var_t *v) {
+	assert(v);
+	return v->smallname ? &v->name.small[0] : v->name.ptr;
+}
+
+/* The variables of a call frame are kept in a hash table with chaining,
+ * which starts off in the frame itself and is doubled in size whenever there
+ * are more variables than buckets. This returns the link to the variable
+ * called 'name', or the link at the end of its chain if there is none. */
+static inline pickle_var_t **picolVarSlot(pickle_call_frame_t *cf, const char *name, const unsigned long hash) {
+	assert(cf);
 	assert(name);
-	pickle_var_t *v = i->callframe->vars;
-	while (v) {
-		const char *n = v->smallname ? &v->name.small[0] : v->name.ptr;
-		assert(n);
-		if (!compare(n, name)) {
-			if (link)
-				while (v->type == PV_LINK) { /* NB. Could resolve link at creation? */
-					assert(v != v->data.link); /* Cycle? */
-					v = v->data.link;
-				}
-			implies(v->type == PV_STRING, v->data.val.ptr);
-			return v;
+	pickle_var_t **link = &cf->vars[hash & (cf->capacity - 1)];
+	for (; *link; link = &(*link)->next)
+		if ((*link)->hash == hash && !compare(picolVarName(*link), name))
+			break;
+	return link;
+}
+
+/* A frame running a compiled procedure body also has a slot for each of the
+ * variables the body refers to, so '$x' does not need to look 'x' up by name.
+ * A slot is filled in when the variable is added and cleared when it is
+ * removed, so it is always in step with the hash table. */
+static pickle_call_frame_t *picolNewCallFrame(pickle_t *i, pickle_call_frame_t *parent, pickle_program_t *program) {
+	assert(i);
+	BUILD_BUG_ON(PICKLE_FRAME_VARS < 2 || (PICKLE_FRAME_VARS & (PICKLE_FRAME_VARS - 1)));
+	const int slots = program ? program->nlocals : 0;
+	pickle_call_frame_t *cf = picolMalloc(i, sizeof (*cf) + (slots * sizeof (cf->slot[0])));
+	if (!cf)
+		return NULL;
+	zero(cf, sizeof (*cf) + (slots * sizeof (cf->slot[0])));
+	cf->vars     = cf->local;
+	cf->capacity = PICKLE_FRAME_VARS;
+	cf->parent   = parent;
+	cf->program  = program;
+	cf->slots    = slots;
+	if (program)
+		program->refs++;
+	return cf;
+}
+
+/* As with the command table, if the variable table cannot be doubled in
+ * size the old one is kept, it still works but the chains get longer, so
+ * 'picolTryMalloc' is used to leave the result alone. */
+static void picolGrowVars(pickle_t *i, pickle_call_frame_t *cf) {
+	assert(i);
+	assert(cf);
+	const int capacity = cf->capacity * 2;
+	const size_t bytes = capacity * sizeof (*cf->vars);
+	pickle_var_t **vars = picolTryMalloc(i, bytes);
+	if (!vars)
+		return;
+	zero(vars, bytes);
+	for (int j = 0; j < cf->capacity; j++) {
+		for (pickle_var_t *v = cf->vars[j], *next = NULL; v; v = next) {
+			next = v->next;
+			pickle_var_t **link = &vars[v->hash & (capacity - 1)];
+			v->next = *link;
+			*link = v;
 		}
-		/* See <https://en.wikipedia.org/wiki/Cycle_detection>,
-		 * <https://stackoverflow.com/questions/2663115>, or "Floyd's
-		 * cycle-finding algorithm" for proper loop detection */
-		assert(v != v->next); /* Cycle? */
-		v = v->next;
 	}
-	return NULL;
+	if (cf->vars != cf->local)
+		(void)picolFree(i, cf->vars);
+	cf->vars = vars;
+	cf->capacity = capacity;
+}
+
+/* 'slot' is the slot of 'v' if the caller knows it, or -1 to search for it */
+static int picolAddVar(pickle_t *i, pickle_call_frame_t *cf, pickle_var_t *v, int slot) {
+	assert(i);
+	assert(cf);
+	assert(v);
+	assert(slot < cf->slots);
+	if (cf->count >= cf->capacity)
+		picolGrowVars(i, cf);
+	const char *name = picolVarName(v);
+	pickle_var_t **link = picolVarSlot(cf, name, v->hash);
+	assert(!*link);
+	*link = v;
+	v->next = NULL;
+	cf->count++;
+	for (int k = 0; slot < 0 && k < cf->slots; k++) {
+		const pickle_local_t *l = &cf->program->locals[k];
+		if (l->hash == v->hash && !compare(l->name, name))
+			slot = k;
+	}
+	if (slot >= 0) {
+		assert(!cf->slot[slot]);
+		cf->slot[slot] = v;
+	}
+	return PICKLE_OK;
+}
+
+static void picolRemoveVar(pickle_call_frame_t *cf, pickle_var_t **link) {
+	assert(cf);
+	assert(link);
+	pickle_var_t *v = *link;
+	assert(v);
+	for (int k = 0; k < cf->slots; k++)
+		if (cf->slot[k] == v) {
+			cf->slot[k] = NULL;
+			break;
+		}
+	*link = v->next;
+	v->next = NULL;
+	cf->count--;
+}
+
+/* follow 'v' through any links to the variable holding the value */
+static inline pickle_var_t *picolVarLink(pickle_var_t *v) {
+	if (!v)
+		return NULL;
+	while (v->type == PV_LINK) { /* NB. Could resolve link at creation? */
+		assert(v != v->data.link); /* Cycle? */
+		v = v->data.link;
+	}
+	implies(v->type == PV_STRING, v->data.val.ptr);
+	return v;
+}
+
+static pickle_var_t *picolGetVar(pickle_t *i, const char *name, int link) {
+	assert(i);
+	assert(name);
+	pickle_call_frame_t *cf = i->callframe;
+	pickle_var_t *v = *picolVarSlot(cf, name, picolHashString(name));
+	return link ? picolVarLink(v) : v;
 }
 
 static int picolFreeVarName(pickle_t *i, pickle_var_t *v) {
 	assert(i);
 	assert(v);
-	return v->smallname ? PICKLE_OK : picolFree(i, v->name.ptr);
+	return v->smallname || v->localname ? PICKLE_OK : picolFree(i, v->name.ptr);
 }
 
 static int picolFreeVarVal(pickle_t *i, pickle_var_t *v) {
 	assert(i);
 	assert(v);
-	return v->type == PV_STRING ? picolFree(i, v->data.val.ptr) : PICKLE_OK;
+	i->epoch++;
+	int r = picolFree(i, v->list);
+	v->list = NULL;
+	if (v->type != PV_STRING)
+		return r;
+	if (picolStringUnref(i, v->data.val.ptr) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	v->type = PV_SMALL_STRING; /* the value is gone, do not release it twice */
+	v->data.val.small[0] = '\0';
+	return r;
 }
 
 /* return: non-zero if and only if val fits in a small string */
@@ -849,13 +1505,28 @@ static int picolSetVarString(pickle_t *i, pickle_var_t *v, const char *val) {
 	assert(i);
 	assert(v);
 	assert(val);
+	v->numeric = 0;
 	if (picolIsSmallString(val)) {
 		v->type = PV_SMALL_STRING;
 		copy(v->data.val.small, val);
 		return PICKLE_OK;
 	}
 	v->type = PV_STRING;
-	return (v->data.val.ptr = picolStrdup(i, val)) ? PICKLE_OK : PICKLE_ERROR;
+	return (v->data.val.ptr = picolStringNew(i, val, picolStrlen(val))) ? PICKLE_OK : PICKLE_ERROR;
+}
+
+/* As 'picolSetVarString', but 'val' is a reference counted string which is
+ * shared with the variable instead of being copied */
+static int picolSetVarShared(pickle_t *i, pickle_var_t *v, const char *val) {
+	assert(i);
+	assert(v);
+	assert(val);
+	if (picolIsSmallString(val) || picolStringHeader(val)->scratch)
+		return picolSetVarString(i, v, val);
+	v->numeric = 0;
+	v->type = PV_STRING;
+	v->data.val.ptr = picolStringRef(val);
+	return PICKLE_OK;
 }
 
 static inline int picolSetVarName(pickle_t *i, pickle_var_t *v, const char *name) {
@@ -881,6 +1552,22 @@ static const char *picolGetVarVal(pickle_var_t *v) {
 	return NULL;
 }
 
+static int picolVarToNumber(pickle_t *i, pickle_var_t *v, number_t *out) {
+	assert(i);
+	assert(v);
+	assert(out);
+	assert(v->type != PV_LINK);
+	if (v->numeric) {
+		*out = v->number;
+		return PICKLE_OK;
+	}
+	const char *s = picolGetVarVal(v);
+	if (picolStringToNumber(i, s, out) != PICKLE_OK)
+		return PICKLE_ERROR;
+	v->numeric = picolIsCanonicalNumber(s, &v->number);
+	return PICKLE_OK;
+}
+
 static inline void picolSwapString(char **a, char **b) {
 	assert(a);
 	assert(b);
@@ -978,41 +1665,151 @@ static int picolSetResultNumber(pickle_t *i, const number_t result) {
 	char buffy/*<3*/[PRINT_NUMBER_BUF_SZ] = { 0 };
 	if (picolNumberToString(buffy, result, 10) != PICKLE_OK)
 		return pickle_set_result_error(i, "Invalid conversion");
-	return pickle_set_result_string(i, buffy);
+	if (pickle_set_result_string(i, buffy) != PICKLE_OK)
+		return PICKLE_ERROR;
+	i->result_number  = result;
+	i->result_numeric = 1;
+	return PICKLE_OK;
 }
 
-static int picolSetVarInteger(pickle_t *i, const char *name, const number_t r) {
+/* Set the result to 'argv[j]', along with its number if known */
+static int picolSetResultArg(pickle_t *i, char **argv, const int j) {
 	assert(i);
-	assert(name);
+	assert(argv);
+	if (i->argv == argv) {
+		if (picolSetResultShared(i, argv[j]) != PICKLE_OK)
+			return PICKLE_ERROR;
+	} else if (pickle_set_result_string(i, argv[j]) != PICKLE_OK) {
+		return PICKLE_ERROR;
+	}
+	if (i->argv == argv && i->args && i->args[j].numeric) {
+		i->result_number  = i->args[j].number;
+		i->result_numeric = 1;
+	}
+	return PICKLE_OK;
+}
+
+static int picolSetVarValNumber(pickle_t *i, pickle_var_t *v, const number_t r) {
+	assert(i);
+	assert(v);
 	char buffy[PRINT_NUMBER_BUF_SZ] = { 0 };
 	if (picolNumberToString(buffy, r, 10) != PICKLE_OK)
 		return pickle_set_result_error(i, "Invalid conversion");
-	return pickle_set_var_string(i, name, buffy);
+	if (picolFreeVarVal(i, v) != PICKLE_OK)
+		return PICKLE_ERROR;
+	if (picolSetVarString(i, v, buffy) != PICKLE_OK)
+		return PICKLE_ERROR;
+	v->number  = r;
+	v->numeric = 1;
+	return PICKLE_OK;
 }
 
-static inline void picolAssertCommandPreConditions(pickle_t *i, const int argc, char **argv, void *pd) {
-	/* UNUSED is used to suppress warnings if NDEBUG is defined */
-	UNUSED(i);    assert(i);
-	UNUSED(argc); assert(argc >= 1);
-	UNUSED(argv); assert(argv);
-	UNUSED(pd);   /* pd may be NULL*/
-	if (DEBUGGING)
-		for (int j = 0; j < argc; j++)
-			assert(argv[j]);
-}
+static int picolSetVar(pickle_t *i, const char *name, const char *val, const int shared, const pickle_arg_t *number);
+static int picolSetVarArg(pickle_t *i, const char *name, char **argv, const int j);
 
-static inline void picolAssertCommandPostConditions(pickle_t *i, const int retcode) {
-	UNUSED(i);  assert(i);
-	assert(i->initialized);
-	assert(i->result);
-	assert(i->level >= 0);
-	UNUSED(retcode); /* arbitrary returns codes allowed, otherwise assert((retcode >= 0) && (retcode < PICKLE_LAST_ENUM)); */
+/* Get the variable 'name', following links, creating it with an empty
+ * value if it does not exist yet */
+static pickle_var_t *picolGetOrMakeVar(pickle_t *i, const char *name) {
+	assert(i);
+	assert(name);
+	pickle_var_t *v = picolGetVar(i, name, 1);
+	if (v)
+		return v;
+	if (picolSetVar(i, name, "", 0, NULL) != PICKLE_OK)
+		return NULL;
+	return picolGetVar(i, name, 1);
 }
 
-static int picolFreeArgList(pickle_t *i, const int argc, char **argv) {
+/* Append 'length' bytes of 'a' to the value of 'v', in place if the value is
+ * not shared. The buffer grows geometrically, so appending to a variable in
+ * a loop ('append', 'lappend') does not copy the whole value each time. */
+static int picolVarAppend(pickle_t *i, pickle_var_t *v, const char *a, const size_t length) {
 	assert(i);
-	assert(argc >= 0);
-	implies(argc != 0, argv);
+	assert(v);
+	assert(a);
+	assert(v->type == PV_SMALL_STRING || v->type == PV_STRING);
+	i->epoch++;
+	const int r = picolFree(i, v->list);
+	v->list    = NULL;
+	v->numeric = 0;
+	if (v->type == PV_SMALL_STRING) {
+		const size_t l = picolStrlen(v->data.val.small);
+		if ((l + length) < sizeof (v->data.val.small)) {
+			move(v->data.val.small + l, a, length);
+			v->data.val.small[l + length] = '\0';
+			return r;
+		}
+		char *s = picolStringNew(i, v->data.val.small, l);
+		if (!s)
+			return PICKLE_ERROR;
+		v->type = PV_STRING;
+		v->data.val.ptr = s;
+	}
+	if (picolStringAppend(i, &v->data.val.ptr, a, length) != PICKLE_OK)
+		return PICKLE_ERROR;
+	return r;
+}
+
+/* Cut the value of 'v' back to its first 'length' bytes, undoing part of a
+ * command that appended to it and then failed. After 'picolVarAppend' the
+ * value is not shared, so it can be changed in place. */
+static void picolVarTruncate(pickle_t *i, pickle_var_t *v, const size_t length) {
+	assert(i);
+	assert(v);
+	assert(v->type == PV_SMALL_STRING || v->type == PV_STRING);
+	i->epoch++;
+	if (v->type == PV_SMALL_STRING) {
+		assert(length < sizeof (v->data.val.small));
+		v->data.val.small[length] = '\0';
+		return;
+	}
+	pickle_string_t *h = picolStringHeader(v->data.val.ptr);
+	assert(h->refs == 1 && (size_t)h->length >= length);
+	h->data[length] = '\0';
+	h->length = length;
+}
+
+/* Set the result to the value of 'v', sharing it if possible */
+static int picolSetResultVar(pickle_t *i, pickle_var_t *v) {
+	assert(i);
+	assert(v);
+	if (v->type == PV_STRING)
+		return picolSetResultShared(i, v->data.val.ptr);
+	return pickle_set_result_string(i, picolGetVarVal(v));
+}
+
+static int picolSetVarInteger(pickle_t *i, const char *name, const number_t r) {
+	assert(i);
+	assert(name);
+	char buffy[PRINT_NUMBER_BUF_SZ] = { 0 };
+	if (picolNumberToString(buffy, r, 10) != PICKLE_OK)
+		return pickle_set_result_error(i, "Invalid conversion");
+	return picolSetVar(i, name, buffy, 0, &(pickle_arg_t){ .number = r, .numeric = 1 });
+}
+
+static inline void picolAssertCommandPreConditions(pickle_t *i, const int argc, char **argv, void *pd) {
+	/* UNUSED is used to suppress warnings if NDEBUG is defined */
+	UNUSED(i);    assert(i);
+	UNUSED(argc); assert(argc >= 1);
+	UNUSED(argv); assert(argv);
+	UNUSED(pd);   /* pd may be NULL*/
+	if (DEBUGGING)
+		for (int j = 0; j < argc; j++)
+			assert(argv[j]);
+}
+
+static inline void picolAssertCommandPostConditions(pickle_t *i, const int retcode) {
+	UNUSED(i);  assert(i);
+	assert(i->initialized);
+	assert(i->result);
+	assert(i->level >= 0);
+	UNUSED(retcode); /* arbitrary returns codes allowed, otherwise assert((retcode >= 0) && (retcode < PICKLE_LAST_ENUM)); */
+}
+
+static int picolFreeArgList(pickle_t *i, const int argc, char **argv) {
+	assert(i);
+	assert(argc >= 0);
+	implies(argc != 0, argv);
 	int r = 0;
 	for (int j = 0; j < argc; j++)
 		if (picolFree(i, argv[j]) != PICKLE_OK)
@@ -1022,6 +1819,49 @@ static int picolFreeArgList(pickle_t *i, const int argc, char **argv) {
 	return r;
 }
 
+/* As 'picolFreeArgList', for arguments that are reference counted strings */
+/* Release the arguments of a command, 'scratch' is set if 'argv' itself is
+ * in the scratch arena */
+static int picolFreeArgs(pickle_t *i, const int argc, char **argv, const int scratch) {
+	assert(i);
+	assert(argc >= 0);
+	implies(argc != 0, argv);
+	int r = PICKLE_OK;
+	for (int j = 0; j < argc; j++)
+		if (picolStringUnref(i, argv[j]) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	if (!scratch && picolFree(i, argv) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	return r;
+}
+
+/* Make room for at least one more argument in '*argv', of '*capacity'
+ * elements, which is in the scratch arena if '*scratch' is set */
+static int picolGrowArgs(pickle_t *i, char ***argv, const int argc, int *capacity, int *scratch) {
+	assert(i);
+	assert(argv);
+	assert(capacity);
+	assert(scratch);
+	if (argc < *capacity)
+		return PICKLE_OK;
+	const int n = *capacity ? *capacity * 2 : 8;
+	if (*scratch && picolScratchExtend(i, *argv, sizeof (**argv) * *capacity, sizeof (**argv) * n)) {
+		*capacity = n;
+		return PICKLE_OK;
+	}
+	char **g = picolScratchAllocate(i, sizeof (*g) * n);
+	const int s = !!g;
+	if (!g && !(g = *scratch ? picolMalloc(i, sizeof (*g) * n) : picolRealloc(i, *argv, sizeof (*g) * n)))
+		return PICKLE_ERROR;
+	if ((s || *scratch) && argc) /* otherwise 'picolRealloc' moved them */
+		move(g, *argv, sizeof (*g) * argc);
+	const int r = s && !*scratch ? picolFree(i, *argv) : PICKLE_OK;
+	*argv = g;
+	*capacity = n;
+	*scratch = s;
+	return r;
+}
+
 static int hexCharToNibble(int c) {
 	c = tolower(c);
 	if ('a' <= c && c <= 'f')
@@ -1095,18 +1935,18 @@ static char *picolEscape(pickle_t *i, const char *s, size_t length) {
 	return m;
 }
 
-static int picolStringNeedsEscaping(const char *s) {
+static int picolStringNeedsEscapingN(const char *s, const size_t length) {
 	assert(s);
 	long braces = 0;
-	char start = s[0], end = 0, ch = 0, sp = 0;
-	for (size_t i = 0; (ch = s[i]); s++) {
+	char start = length ? s[0] : 0, end = 0, ch = 0, sp = 0;
+	for (size_t i = 0, j = 0; (i + j) < length && (ch = s[i + j]); j++) {
 		end = ch;
 		if (locateChar(string_white_space, ch))
 			sp = 1;
 		if (ch == '{') braces++;
 		if (ch == '}') braces--;
 		if (ch == '\\') {
-			ch = s[++i];
+			ch = (++i + j) < length ? s[i + j] : 0;
 			if (!ch)
 				return 1;
 		}
@@ -1116,6 +1956,11 @@ static int picolStringNeedsEscaping(const char *s) {
 	return 0;
 }
 
+static int picolStringNeedsEscaping(const char *s) {
+	assert(s);
+	return picolStringNeedsEscapingN(s, picolStrlen(s));
+}
+
 static const char *trimleft(const char *class, const char *s) { /* Returns pointer to s */
 	assert(class);
 	assert(s);
@@ -1178,11 +2023,11 @@ static char *concatenate(pickle_t *i, const char *join, const int argc, char **a
 		if (doEscape)
 			esc[j] = picolStringNeedsEscaping(argv[j]);
 		ls[j] = sz;
-		l += sz + jl;
+		l += sz + jl + (2 * esc[j]);
 	}
 	if (USE_MAX_STRING && ((l + 1) >= PICKLE_MAX_STRING))
 		goto end;
-	if (picolStackOrHeapAlloc(i, &h, l) != PICKLE_OK)
+	if (picolStackOrHeapAlloc(i, &h, l + 1) != PICKLE_OK)
 		goto end;
 	l = 0;
 	for (int j = 0, k = 0; j < argc; j++) {
@@ -1215,9 +2060,12 @@ static char *concatenate(pickle_t *i, const char *join, const int argc, char **a
 			goto end;
 	}
 	h.p[l] = '\0';
-	if (picolOnHeap(i, &h))
-		return h.p;
-	str = picolStrdup(i, h.p);
+	if (picolOnHeap(i, &h)) {
+		str = h.p;
+		h.p = h.buf; /* the caller owns it now */
+	} else {
+		str = picolStrdup(i, h.p);
+	}
 end:
 	(void)picolFree(i, ls);
 	(void)picolFree(i, esc);
@@ -1262,29 +2110,404 @@ err:
 	return (args_t){ 0, NULL };
 }
 
-static char **picolArgsGrow(pickle_t *i, int *argc, char **argv) {
+/* Lists are strings, but splitting one up with 'picolArgs' allocates a copy
+ * of each element. Instead, a 'pickle_list_t' records where each element is
+ * within the string it was parsed from, which takes a single allocation. A
+ * variable caches the list made from its value until the value changes, and
+ * 'picolEvalProgram' records which variable an argument came from, so
+ * indexing a list held in a variable does not have to parse it again.
+ *
+ * If a list is too long for that allocation to succeed, as it can be with
+ * an allocator that has a small maximum block size, only a window of
+ * 'PICKLE_LIST_WINDOW' elements is recorded at a time. 'picolListSpan'
+ * moves the window by parsing the string again, which is slower, but means
+ * the list can still be used. */
+
+static void picolListWindow(const char *s, pickle_list_t *l, const int first) {
+	assert(s);
+	assert(l);
+	assert(l->window);
+	assert(first >= 0 && first < l->length);
+	pickle_parser_t p = { .p = NULL };
+	picolParserInitialize(&p, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, s, NULL, NULL);
+	l->first = first;
+	for (int j = 0; j < (first + l->capacity) && j < l->length;) {
+		if (picolGetToken(&p) != PICKLE_OK || p.type == PT_EOF)
+			break; /* it has been parsed successfully before */
+		if (p.type != PT_STR && p.type != PT_VAR && p.type != PT_CMD && p.type != PT_ESC)
+			continue;
+		if (j >= first) {
+			const int length = (p.end - p.start) + 1;
+			l->span[j - first] = (pickle_span_t){ .offset = p.start - s, .length = MAX(length, 0) };
+		}
+		j++;
+	}
+}
+
+/* Element 'j' of list 'l' made from 's'; valid until the next call */
+static inline const pickle_span_t *picolListSpan(const char *s, pickle_list_t *l, const int j) {
+	assert(s);
+	assert(l);
+	assert(j >= 0 && j < l->length);
+	if (l->window && (j < l->first || j >= (l->first + l->capacity))) /* forwards, or backwards, from 'j' */
+		picolListWindow(s, l, j < l->first ? MAX(0, j - l->capacity + 1) : j);
+	return &l->span[j - l->first];
+}
+
+/* Parse 's' as a list, only recording a window of its elements if there
+ * is not the memory to record all of them. */
+static pickle_list_t *picolListParse(pickle_t *i, const char *s) {
+	assert(i);
+	assert(s);
+	pickle_parser_t p = { .p = NULL };
+	pickle_list_t *l = NULL;
+	int count = 0, window = 0;
+	picolParserInitialize(&p, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, s, NULL, NULL);
+	for (int capacity = 0;;) {
+		if (picolGetToken(&p) != PICKLE_OK)
+			goto err;
+		if (p.type == PT_EOF)
+			break;
+		if (p.type != PT_STR && p.type != PT_VAR && p.type != PT_CMD && p.type != PT_ESC)
+			continue;
+		count++;
+		if (window)
+			continue; /* only counting */
+		if (!l || l->length >= capacity) {
+			capacity = capacity ? capacity * 2 : 4;
+			pickle_list_t *n = picolRealloc(i, l, sizeof (*l) + (capacity * sizeof (l->span[0])));
+			if (!n) {
+				(void)picolFree(i, l);
+				l = NULL;
+				window = 1;
+				continue;
+			}
+			if (!l)
+				n->length = 0;
+			l = n;
+			l->capacity = capacity;
+			l->first    = 0;
+			l->window   = 0;
+		}
+		const int length = (p.end - p.start) + 1;
+		l->span[l->length++] = (pickle_span_t){ .offset = p.start - s, .length = MAX(length, 0) };
+	}
+	if (window) {
+		const int capacity = MIN(count, PICKLE_LIST_WINDOW);
+		if (!(l = picolMalloc(i, sizeof (*l) + (capacity * sizeof (l->span[0])))))
+			return NULL;
+		l->length   = count;
+		l->capacity = capacity;
+		l->window   = 1;
+		picolListWindow(s, l, 0);
+		return l;
+	}
+	if (!l) {
+		if (!(l = picolMalloc(i, sizeof (*l))))
+			return NULL;
+		l->length = l->capacity = l->first = 0;
+		l->window = 0;
+	}
+	return l;
+err:
+	(void)picolFree(i, l);
+	return NULL;
+}
+
+/* Return the list in 'argv[j]', using the one cached in the variable it was
+ * read from if possible. If '*owned' is set the caller must free it. */
+static pickle_list_t *picolArgToList(pickle_t *i, char **argv, const int j, int *owned) {
 	assert(i);
-	assert(argc);
 	assert(argv);
-	const int n = *argc + 1;
-	assert(n > 0);
-	char **old = argv;
-	if (!(argv = picolRealloc(i, argv, sizeof(char*) * n))) {
-		(void)picolFreeArgList(i, *argc, old);
+	assert(owned);
+	*owned = 0;
+	if (i->argv == argv && i->args && i->args[j].var && i->args[j].epoch == i->epoch) {
+		pickle_var_t *v = i->args[j].var;
+		if (!v->list)
+			v->list = picolListParse(i, argv[j]); /* same contents as the variable */
+		return v->list;
+	}
+	*owned = 1;
+	return picolListParse(i, argv[j]);
+}
+
+static inline int picolListRelease(pickle_t *i, pickle_list_t *l, const int owned) {
+	assert(i);
+	return owned ? picolFree(i, l) : PICKLE_OK;
+}
+
+static pickle_list_t *picolVarToList(pickle_t *i, pickle_var_t *v) {
+	assert(i);
+	assert(v);
+	assert(v->type != PV_LINK);
+	if (!v->list)
+		v->list = picolListParse(i, picolGetVarVal(v));
+	return v->list;
+}
+
+/* Copy element 'j' of list 'l' made from 's' into 'h', NUL terminating it */
+static char *picolListElement(pickle_t *i, const char *s, pickle_list_t *l, const int j, pickle_stack_or_heap_t *h) {
+	assert(i);
+	assert(s);
+	assert(l);
+	assert(h);
+	assert(j >= 0 && j < l->length);
+	const pickle_span_t *e = picolListSpan(s, l, j);
+	if (picolStackOrHeapAlloc(i, h, e->length + 1) != PICKLE_OK)
 		return NULL;
+	move(h->p, s + e->offset, e->length);
+	h->p[e->length] = '\0';
+	return h->p;
+}
+
+typedef PREPACK struct {
+	const char *s;      /**< text of piece */
+	int length;         /**< length of 's' */
+	unsigned escape :1; /**< escape the piece, if needed, as a list element */
+	unsigned raw    :1; /**< piece is not a single list element */
+} POSTPACK pickle_piece_t;
+
+typedef PREPACK struct {
+	const char *s;           /**< string list was made from */
+	pickle_list_t *l;        /**< list to take elements from */
+	int from, to;            /**< range of elements to use, 'to' is exclusive */
+	int at, remove;          /**< remove this many elements at 'at' (relative to 'from') */
+	pickle_piece_t insert;   /**< and put this there, if 'insert.s' is not NULL */
+	unsigned reverse :1;     /**< reverse the order of the elements */
+} POSTPACK pickle_list_edit_t; /**< describes a new list made from an existing one */
+
+static inline int picolListEditLength(const pickle_list_edit_t *e) {
+	assert(e);
+	return (e->to - e->from) - e->remove + !!(e->insert.s);
+}
+
+static inline pickle_piece_t picolListEditPiece(const pickle_list_edit_t *e, int j) {
+	assert(e);
+	assert(j >= 0 && j < picolListEditLength(e));
+	if (e->reverse)
+		j = picolListEditLength(e) - j - 1;
+	if (e->insert.s) {
+		if (j == e->at)
+			return e->insert;
+		if (j > e->at)
+			j--;
 	}
-	*argc = n;
-	argv[n - 1] = NULL;
-	return argv;
+	if (j >= e->at)
+		j += e->remove;
+	const pickle_span_t *span = picolListSpan(e->s, e->l, e->from + j);
+	return (pickle_piece_t){ .s = e->s + span->offset, .length = span->length, .escape = 1 };
 }
 
-static inline int picolDoCommand(pickle_t *i, int argc, char *argv[]) {
+/* An element can only have its position recorded in a joined list if
+ * parsing the result is guaranteed to give back the same element. */
+static inline int picolIsPlainElement(const pickle_piece_t *p, const int escaped) {
+	assert(p);
+	if (p->raw || (!escaped && !p->length))
+		return 0;
+	for (int j = 0; j < p->length; j++) {
+		const int ch = p->s[j];
+		if (locateChar("{}[]\"\\$;#", ch) || (!escaped && locateChar(string_white_space, ch)))
+			return 0;
+	}
+	return 1;
+}
+
+/* Join the elements described by 'e' with spaces into a new string,
+ * escaping them if needed. If 'list' is not NULL it is set to the list of
+ * the result, or NULL if that cannot be worked out without parsing it. */
+static char *picolListJoin(pickle_t *i, const pickle_list_edit_t *e, pickle_list_t **list) {
+	assert(i);
+	assert(e);
+	const int count = picolListEditLength(e);
+	size_t length = 0;
+	int plain = !!list;
+	pickle_list_t *l = NULL;
+	if (list)
+		*list = NULL;
+	for (int j = 0; j < count; j++) {
+		const pickle_piece_t p = picolListEditPiece(e, j);
+		const int escaped = p.escape && picolStringNeedsEscapingN(p.s, p.length);
+		length += p.length + (2 * escaped) + (j < (count - 1));
+		plain = plain && picolIsPlainElement(&p, escaped);
+	}
+	if (USE_MAX_STRING && ((length + 1) >= PICKLE_MAX_STRING))
+		return NULL;
+	char *r = picolMalloc(i, length + 1);
+	if (!r)
+		return NULL;
+	if (plain && (l = picolMalloc(i, sizeof (*l) + (count * sizeof (l->span[0]))))) {
+		l->length   = count;
+		l->capacity = count;
+		l->first    = 0;
+		l->window   = 0;
+	}
+	size_t k = 0;
+	for (int j = 0; j < count; j++) {
+		const pickle_piece_t p = picolListEditPiece(e, j);
+		const int escaped = p.escape && picolStringNeedsEscapingN(p.s, p.length);
+		if (escaped)
+			r[k++] = '{';
+		if (l)
+			l->span[j] = (pickle_span_t){ .offset = k, .length = p.length };
+		move(r + k, p.s, p.length);
+		k += p.length;
+		if (escaped)
+			r[k++] = '}';
+		if (j < (count - 1))
+			r[k++] = ' ';
+	}
+	assert(k == length);
+	r[k] = '\0';
+	if (list)
+		*list = l;
+	return r;
+}
+
+static uint64_t picolClock(void) { /* nanoseconds, from an arbitrary point */
+#if DEFINE_PROFILER
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t) < 0)
+		return 0;
+	return ((uint64_t)t.tv_sec * 1000000000ull) + (uint64_t)t.tv_nsec;
+#else
+	return 0;
+#endif
+}
+
+/* Record the stack of procedures, and the command about to be called, in
+ * the form flame graph tools take; "outer;inner;command", with a count of
+ * how often each was seen. Called for the first command after a signal
+ * handler calls 'pickle_sample', so recording happens outside of it. */
+static int picolSampleStack(pickle_t *i, const char *command) {
+	assert(i);
+	assert(command);
+	i->sample = 0;
+	if (!i->samples) {
+		if (!(i->samples = picolMalloc(i, PICKLE_SAMPLE_BUCKETS * sizeof (i->samples[0]))))
+			return PICKLE_ERROR;
+		zero(i->samples, PICKLE_SAMPLE_BUCKETS * sizeof (i->samples[0]));
+	}
+	size_t length = picolStrlen(command);
+	for (pickle_call_frame_t *cf = i->callframe; cf; cf = cf->parent)
+		if (cf->name)
+			length += picolStrlen(cf->name) + 1;
+	pickle_stack_or_heap_t h = { .p = NULL };
+	if (picolStackOrHeapAlloc(i, &h, length + 1) != PICKLE_OK)
+		return PICKLE_ERROR;
+	size_t k = length, l = picolStrlen(command); /* filled in from the innermost outwards */
+	h.p[k] = '\0';
+	move(h.p + (k -= l), command, l);
+	for (pickle_call_frame_t *cf = i->callframe; cf; cf = cf->parent) {
+		if (!cf->name)
+			continue;
+		h.p[--k] = ';';
+		l = picolStrlen(cf->name);
+		move(h.p + (k -= l), cf->name, l);
+	}
+	assert(k == 0);
+	int r = PICKLE_OK;
+	const unsigned long hash = picolHash(h.p, length);
+	pickle_sample_t **b = &i->samples[hash & (PICKLE_SAMPLE_BUCKETS - 1)], *s = *b;
+	for (; s; s = s->next)
+		if (s->hash == hash && !compare(s->stack, h.p))
+			break;
+	if (s) {
+		s->count++;
+	} else if ((s = picolMalloc(i, sizeof (*s)))) {
+		if ((s->stack = picolStrdup(i, h.p))) {
+			s->hash  = hash;
+			s->count = 1;
+			s->next  = *b;
+			*b = s;
+		} else {
+			(void)picolFree(i, s);
+			r = PICKLE_ERROR;
+		}
+	} else {
+		r = PICKLE_ERROR;
+	}
+	return picolStackOrHeapFree(i, &h) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+/* Time a call to 'c', and count its allocations. The time and allocations
+ * of the commands it calls are accumulated in 'nested' as they return, so
+ * they can be subtracted to give what was spent in the command itself. A
+ * recursive command counts the time of its inner calls more than once in
+ * its inclusive time, but not in its exclusive time. */
+static int picolProfileCommand(pickle_t *i, pickle_command_t *c, int argc, char *argv[]) {
+	assert(i);
+	assert(c);
+	if (i->sampling && i->sample)
+		if (picolSampleStack(i, argv[0]) != PICKLE_OK)
+			return PICKLE_ERROR;
+	if (!i->profiling)
+		return c->func(i, argc, argv, c->privdata);
+	pickle_profile_t *p = c->profile; /* 'c' may be deleted by the call, 'p' is not */
+	if (!p) {
+		if (!(p = picolMalloc(i, sizeof (*p))))
+			return PICKLE_ERROR;
+		zero(p, sizeof (*p));
+		p->next = i->profiles;
+		i->profiles = p;
+		c->profile = p;
+	}
+	const uint64_t outer = i->nested, start = picolClock();
+	const unsigned long outer_allocs = i->nested_allocs, allocs = i->allocs;
+	i->nested = 0;
+	i->nested_allocs = 0;
+	const int r = c->func(i, argc, argv, c->privdata);
+	const uint64_t elapsed = picolClock() - start;
+	const unsigned long allocated = i->allocs - allocs;
+	p->calls++;
+	p->inclusive += elapsed;
+	p->exclusive += elapsed - MIN(elapsed, i->nested);
+	p->allocs    += allocated - MIN(allocated, i->nested_allocs);
+	i->nested = outer + elapsed;
+	i->nested_allocs = outer_allocs + allocated;
+	return r;
+}
+
+static inline int picolInvoke(pickle_t *i, pickle_command_t *c, int argc, char *argv[]) {
+	assert(i);
+	assert(c);
+	picolAssertCommandPreConditions(i, argc, argv, c->privdata);
+	const int r = (i->profiling | i->sampling) ?
+		picolProfileCommand(i, c, argc, argv) :
+		c->func(i, argc, argv, c->privdata);
+	picolAssertCommandPostConditions(i, r);
+	return r;
+}
+
+/* The core commands only read their arguments, but a command registered
+ * with 'pickle_register_command' may write to them, so any argument shared
+ * with a variable or a result is replaced by a copy of its own first */
+static int picolUnshareArgs(pickle_t *i, const int argc, char **argv) {
+	assert(i);
+	assert(argv);
+	for (int j = 0; j < argc; j++) {
+		const pickle_string_t *h = picolStringHeader(argv[j]);
+		if (h->refs == 1)
+			continue;
+		char *copy = picolStringNew(i, h->data, h->length);
+		if (!copy)
+			return PICKLE_ERROR;
+		if (picolStringUnref(i, argv[j]) != PICKLE_OK) {
+			(void)picolStringUnref(i, copy);
+			return PICKLE_ERROR;
+		}
+		argv[j] = copy;
+	}
+	return PICKLE_OK;
+}
+
+/* Call command 'c', which has been looked up from 'argv[0]' and is NULL if
+ * there is no such command */
+static inline int picolCallCommand(pickle_t *i, pickle_command_t *c, int argc, char *argv[]) {
 	assert(i);
 	assert(argc >= 1);
 	assert(argv);
 	if (pickle_set_result_empty(i) != PICKLE_OK)
 		return PICKLE_ERROR;
-	pickle_command_t *c = picolGetCommand(i, argv[0]);
 	if (c == NULL) {
 		if (i->insideunknown || ((c = picolGetCommand(i, "unknown")) == NULL))
 			return pickle_set_result_error(i, "Invalid command %s", argv[0]);
@@ -1293,87 +2516,110 @@ static inline int picolDoCommand(pickle_t *i, int argc, char *argv[]) {
 			return PICKLE_ERROR;
 		char *nargv[] = { "unknown", arg2 };
 		i->insideunknown = 1;
-		picolAssertCommandPreConditions(i, 2, nargv, c->privdata);
-		const int r = c->func(i, 2, nargv, c->privdata);
-		picolAssertCommandPostConditions(i, r);
+		const int r = picolInvoke(i, c, 2, nargv);
 		i->insideunknown = 0;
 		if (picolFree(i, arg2) != PICKLE_OK)
 			return PICKLE_ERROR;
 		return r;
 	}
-	picolAssertCommandPreConditions(i, argc, argv, c->privdata);
-	const int r = c->func(i, argc, argv, c->privdata);
-	picolAssertCommandPostConditions(i, r);
-	return r;
+	if (c->foreign && picolUnshareArgs(i, argc, argv) != PICKLE_OK)
+		return PICKLE_ERROR;
+	return picolInvoke(i, c, argc, argv);
+}
+
+static inline int picolDoCommand(pickle_t *i, int argc, char *argv[]) {
+	assert(i);
+	assert(argc >= 1);
+	assert(argv);
+	return picolCallCommand(i, picolGetCommand(i, argv[0]), argc, argv);
 }
 
+static pickle_program_t *picolCacheLookup(pickle_t *i, const char *text);
+static int picolEvalProgram(pickle_t *i, pickle_program_t *p);
+
+/* NB. If 'o' is NULL the script may be compiled and cached, a script is
+ * evaluated as text (and line numbers tracked) when options are given. */
 static int picolEvalAndSubst(pickle_t *i, pickle_parser_opts_t *o, const char *eval) {
 	assert(i);
 	assert(i->initialized);
 	/* NB: assert(o || !o); */
 	assert(eval);
 	pickle_parser_t p = { .p = NULL };
-	int retcode = PICKLE_OK, argc = 0;
+	int retcode = PICKLE_OK, argc = 0, capacity = 0, scratch = 0;
 	char **argv = NULL;
+	if (!o && PICKLE_MAX_CACHE) {
+		pickle_program_t *program = picolCacheLookup(i, eval);
+		if (program)
+			return picolEvalProgram(i, program);
+	}
 	if (pickle_set_result_empty(i) != PICKLE_OK)
 		return PICKLE_ERROR;
+	const pickle_scratch_mark_t mark = picolScratchMark(i);
 	picolParserInitialize(&p, o, eval, &i->line, &i->ch);
 	int prevtype = p.type;
 	for (;;) {
-		if (picolGetToken(&p) != PICKLE_OK)
-			return pickle_set_result_error(i, "Invalid parse");
+		if (picolGetToken(&p) != PICKLE_OK) {
+			retcode = pickle_set_result_error(i, "Invalid parse");
+			goto err;
+		}
 		if (p.type == PT_EOF)
 			break;
 		int tlen = p.end - p.start + 1;
 		if (tlen < 0)
 			tlen = 0;
-		char *t = picolMalloc(i, tlen + 1);
-		if (!t) {
-			retcode = PICKLE_ERROR;
-			goto err;
-		}
-		move(t, p.start, tlen);
-		t[tlen] = '\0';
-		if (p.type == PT_VAR) {
-			pickle_var_t * const v = picolGetVar(i, t, 1);
+		char *t = NULL;
+		if (p.type == PT_VAR) { /* look the name up without allocating, and share the value */
+			pickle_stack_or_heap_t h = { .p = NULL };
+			if (picolStackOrHeapAlloc(i, &h, tlen + 1) != PICKLE_OK) {
+				retcode = PICKLE_ERROR;
+				goto err;
+			}
+			move(h.p, p.start, tlen);
+			h.p[tlen] = '\0';
+			pickle_var_t * const v = picolGetVar(i, h.p, 1);
 			if (!v) {
-				retcode = pickle_set_result_error(i, "Invalid variable %s", t);
-				(void)picolFree(i, t);
+				retcode = pickle_set_result_error(i, "Invalid variable %s", h.p);
+				(void)picolStackOrHeapFree(i, &h);
 				goto err;
 			}
-			if (picolFree(i, t) != PICKLE_OK)
+			if (picolStackOrHeapFree(i, &h) != PICKLE_OK) {
+				retcode = PICKLE_ERROR;
 				goto err;
-			if (!(t = picolStrdup(i, picolGetVarVal(v)))) {
+			}
+			const char *val = picolGetVarVal(v);
+			if (!(t = v->type == PV_STRING ? picolStringRef(val) : picolStringScratch(i, val, picolStrlen(val)))) {
 				retcode = PICKLE_ERROR;
 				goto err;
 			}
-		} else if (p.type == PT_CMD) {
+		} else if (p.type != PT_SEP && p.type != PT_EOL) {
+			if (!(t = picolStringScratch(i, p.start, tlen))) {
+				retcode = PICKLE_ERROR;
+				goto err;
+			}
+		}
+		if (p.type == PT_CMD) {
 			retcode = picolEvalAndSubst(i, NULL, t); // NB!
-			if (picolFree(i, t) != PICKLE_OK)
+			if (picolStringUnref(i, t) != PICKLE_OK)
 				goto err;
 			if (retcode != PICKLE_OK)
 				goto err;
-			if (!(t = picolStrdup(i, i->result))) {
+			if (!(t = picolResultToString(i))) {
 				retcode = PICKLE_ERROR;
 				goto err;
 			}
 		} else if (p.type == PT_ESC) {
 			if (picolUnEscape(t, tlen + 1/*NUL terminator*/) < 0) {
 				retcode = pickle_set_result_error(i, "Invalid escape sequence %s", t); /* BUG: %s is probably mangled by now */
-				(void)picolFree(i, t);
+				(void)picolStringUnref(i, t);
 				goto err;
 			}
+			picolStringHeader(t)->length = picolStrlen(t); /* unescaped in place, it can only get shorter */
 		} else if (p.type == PT_SEP) {
 			prevtype = p.type;
-			if (picolFree(i, t) != PICKLE_OK)
-				goto err;
 			continue;
 		}
 
 		if (p.type == PT_EOL) { /* We have a complete command + args. Call it! */
-			if (picolFree(i, t) != PICKLE_OK)
-				goto err;
-			t = NULL;
 			prevtype = p.type;
 			if (p.o.noeval) {
 				char *result = concatenate(i, " ", argc, argv, 0, 0);
@@ -1385,45 +2631,50 @@ static int picolEvalAndSubst(pickle_t *i, pickle_parser_opts_t *o, const char *e
 					goto err;
 			} else {
 				if (argc) {
-					if ((retcode = picolDoCommand(i, argc, argv)) != PICKLE_OK)
+					pickle_arg_t *oargs = i->args;
+					char **oargv = i->argv;
+					i->args = NULL;
+					i->argv = argv;
+					retcode = picolDoCommand(i, argc, argv);
+					i->args = oargs;
+					i->argv = oargv;
+					if (retcode != PICKLE_OK)
 						goto err;
 				}
 			}
 			/* Prepare for the next command */
-			picolFreeArgList(i, argc, argv);
+			picolFreeArgs(i, argc, argv, scratch);
+			picolScratchRelease(i, mark);
 			argv = NULL;
 			argc = 0;
+			capacity = 0;
+			scratch = 0;
 			continue;
 		}
 	
 		if (prevtype == PT_SEP || prevtype == PT_EOL) { /* New token, append to the previous or as new arg? */
-			char **old = argv;
-			if (!(argv = picolRealloc(i, argv, sizeof(char*)*(argc + 1)))) {
-				argv = old;
+			if (picolGrowArgs(i, &argv, argc, &capacity, &scratch) != PICKLE_OK) {
 				retcode = PICKLE_ERROR;
+				(void)picolStringUnref(i, t);
 				goto err;
 			}
 			argv[argc] = t;
 			t = NULL;
 			argc++;
 		} else { /* Interpolation */
-			const int oldlen = picolStrlen(argv[argc - 1]), ilen = picolStrlen(t);
-			char *arg = picolRealloc(i, argv[argc - 1], oldlen + ilen + 1);
-			if (!arg) {
+			if (picolStringAppend(i, &argv[argc - 1], t, picolStrlen(t)) != PICKLE_OK) {
 				retcode = PICKLE_ERROR;
-				(void)picolFree(i, t);
+				(void)picolStringUnref(i, t);
 				goto err;
 			}
-			argv[argc - 1] = arg;
-			move(argv[argc - 1] + oldlen, t, ilen);
-			argv[argc - 1][oldlen + ilen] = '\0';
 		}
-		if (picolFree(i, t) != PICKLE_OK)
+		if (picolStringUnref(i, t) != PICKLE_OK)
 			goto err;
 		prevtype = p.type;
 	}
 err:
-	picolFreeArgList(i, argc, argv);
+	picolFreeArgs(i, argc, argv, scratch);
+	picolScratchRelease(i, mark);
 	return retcode;
 }
 
@@ -1433,37 +2684,515 @@ static int picolEval(pickle_t *i, const char *t) {
 	return picolEvalAndSubst(i, NULL, t);
 }
 
-/*Based on: <http://c-faq.com/lib/regex.html>, also see:
- <https://www.cs.princeton.edu/courses/archive/spr09/cos333/beautiful.html> */
-static inline int match(const char *pat, const char *str, size_t depth) {
-	assert(pat);
-	assert(str);
-	if (!depth) return -1; /* error: depth exceeded */
- again:
-        switch (*pat) {
-	case '\0': return !*str;
-	case '*': { /* match any number of characters: normally '.*' */
-		const int r = match(pat + 1, str, depth - 1);
-		if (r)         return r;
-		if (!*(str++)) return 0;
-		goto again;
+/* Scripts, such as procedure bodies, that are evaluated more than once can
+ * be compiled into a list of instructions with 'picolCompile' and then run
+ * with 'picolEvalProgram'. The compiler uses the same tokenizer as
+ * 'picolEvalAndSubst' and mirrors how it builds up arguments, so the two must
+ * be kept in sync. Errors found whilst compiling (such as an unterminated
+ * command substitution) are turned into an 'OP_ERROR' instruction at the
+ * point they occur, any commands before it will still be executed, just as
+ * they would be if the text was evaluated directly. Line numbers are not
+ * tracked by compiled programs.
+ *
+ * Procedure bodies are compiled with 'picolCompileProc', which gives each
+ * variable the body refers to with '$' (its arguments first) a slot number,
+ * shared by any command substitutions within it. A call frame made for the
+ * body keeps a pointer to each of those variables, so that reading one is an
+ * index instead of a hash table lookup. */
+
+typedef struct {
+	pickle_program_t *p; /**< program being compiled */
+	int capacity;        /**< instruction capacity */
+	size_t used, size;   /**< bytes used and allocated in string pool */
+} pickle_compiler_t;
+
+static pickle_program_t *picolCompileScript(pickle_t *i, const char *text, pickle_program_t *root, const char *args);
+
+static int picolFreeProgram(pickle_t *i, pickle_program_t *p) {
+	assert(i);
+	if (!p)
+		return PICKLE_OK;
+	assert(p->refs > 0);
+	if (--p->refs > 0)
+		return PICKLE_OK;
+	int r = PICKLE_OK;
+	for (int j = 0; j < p->length; j++)
+		if (p->code[j].op == OP_SUBSTITUTE)
+			if (picolFreeProgram(i, p->code[j].u.program) != PICKLE_OK)
+				r = PICKLE_ERROR;
+	if (picolFree(i, p->code) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFree(i, p->strings) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	for (int j = 0; j < p->nlocals; j++)
+		if (picolFree(i, p->locals[j].name) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	if (picolFree(i, p->locals) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFree(i, p) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	return r;
+}
+
+static int picolEmit(pickle_t *i, pickle_compiler_t *c, const pickle_instruction_t *ins) {
+	assert(i);
+	assert(c);
+	assert(ins);
+	pickle_program_t *p = c->p;
+	if (p->length >= c->capacity) {
+		const int capacity = c->capacity ? c->capacity * 2 : 8;
+		pickle_instruction_t *code = picolRealloc(i, p->code, capacity * sizeof (*code));
+		if (!code)
+			return PICKLE_ERROR;
+		p->code = code;
+		c->capacity = capacity;
 	}
-	case '?':  /* match any single characters: normally '.' */
-		if (!*str) return 0;
-		pat++, str++;
-		goto again;
-	case '%': /* escape character: normally backslash */
-		if (!*(++pat)) return -2; /* error: missing escaped character */
-		if (!*str)     return 0;
-		/* fall through */
-	default:
-		if (*pat != *str) return 0;
-		pat++, str++;
-		goto again;
+	p->code[p->length++] = *ins;
+	return PICKLE_OK;
+}
+
+static int picolPool(pickle_t *i, pickle_compiler_t *c, const char *s, const size_t length, size_t *offset) {
+	assert(i);
+	assert(c);
+	assert(s);
+	assert(offset);
+	const size_t needed = c->used + length + 1;
+	if (needed > c->size) {
+		const size_t size = MAX(needed, c->size * 2);
+		char *strings = picolRealloc(i, c->p->strings, size);
+		if (!strings)
+			return PICKLE_ERROR;
+		c->p->strings = strings;
+		c->size = size;
+	}
+	*offset = c->used;
+	move(c->p->strings + c->used, s, length);
+	c->p->strings[c->used + length] = '\0';
+	c->used = needed;
+	return PICKLE_OK;
+}
+
+/* Find the slot of variable 'name' (of 'length' bytes) in the 'root' program,
+ * adding it if it is not there, returns -1 on failure */
+static int picolLocal(pickle_t *i, pickle_program_t *root, const char *name, const size_t length) {
+	assert(i);
+	assert(root);
+	assert(root->slots);
+	assert(name);
+	char *n = picolMalloc(i, length + 1);
+	if (!n)
+		return -1;
+	move(n, name, length);
+	n[length] = '\0';
+	const unsigned long hash = picolHashString(n);
+	for (int j = 0; j < root->nlocals; j++)
+		if (root->locals[j].hash == hash && !compare(root->locals[j].name, n))
+			return picolFree(i, n) == PICKLE_OK ? j : -1;
+	pickle_local_t *locals = picolRealloc(i, root->locals, (root->nlocals + 1) * sizeof (*locals));
+	if (!locals) {
+		(void)picolFree(i, n);
+		return -1;
+	}
+	root->locals = locals;
+	locals[root->nlocals] = (pickle_local_t){ .name = n, .hash = hash };
+	return root->nlocals++;
+}
+
+static int picolCompileToken(pickle_t *i, pickle_compiler_t *c, pickle_parser_t *p, pickle_instruction_t *ins) {
+	assert(i);
+	assert(c);
+	assert(p);
+	assert(ins);
+	int tlen = p->end - p->start + 1;
+	if (tlen < 0)
+		tlen = 0;
+	if (p->type == PT_CMD) {
+		char *t = picolMalloc(i, tlen + 1);
+		if (!t)
+			return PICKLE_ERROR;
+		move(t, p->start, tlen);
+		t[tlen] = '\0';
+		ins->op = OP_SUBSTITUTE;
+		ins->u.program = picolCompileScript(i, t, c->p->root, NULL);
+		if (picolFree(i, t) != PICKLE_OK || !ins->u.program) {
+			(void)picolFreeProgram(i, ins->u.program);
+			return PICKLE_ERROR;
+		}
+		return PICKLE_OK;
+	}
+	if (picolPool(i, c, p->start, tlen, &ins->u.offset) != PICKLE_OK)
+		return PICKLE_ERROR;
+	ins->op     = p->type == PT_VAR ? OP_VARIABLE : OP_LITERAL;
+	ins->length = tlen;
+	if (p->type == PT_ESC) {
+		char *t = c->p->strings + ins->u.offset;
+		if (picolUnEscape(t, tlen + 1/*NUL terminator*/) < 0) { /* leave the token as it was, so the error can report it */
+			move(t, p->start, tlen);
+			ins->op     = OP_ERROR;
+			ins->length = ERROR_ESCAPE;
+			return PICKLE_OK;
+		}
+		ins->length = picolStrlen(t);
+	}
+	if (ins->op == OP_LITERAL)
+		ins->numeric = picolIsCanonicalNumber(c->p->strings + ins->u.offset, &ins->number);
+	if (ins->op == OP_VARIABLE) {
+		ins->length = -1;
+		if (c->p->root->slots && (ins->length = picolLocal(i, c->p->root, p->start, tlen)) < 0)
+			return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+/* Give the arguments of a procedure the first slots, in order. Arguments are
+ * separated by spaces, as in 'picolSetArgsByName'. */
+static int picolCompileArgs(pickle_t *i, pickle_program_t *p, const char *args) {
+	assert(i);
+	assert(p);
+	assert(args);
+	p->slots  = 1;
+	p->params = 1;
+	while (*args) {
+		if (*args == ' ') {
+			args++;
+			continue;
+		}
+		size_t length = 0;
+		while (args[length] && args[length] != ' ')
+			length++;
+		const int slot = picolLocal(i, p, args, length);
+		if (slot < 0)
+			return PICKLE_ERROR;
+		if (slot != p->arity++)
+			p->params = 0; /* repeated name, leave it to 'picolSetArgsByName' */
+		args += length;
+	}
+	return PICKLE_OK;
+}
+
+/* 'root' is the program a command substitution belongs to, or NULL if
+ * 'text' is a script in its own right; 'args' are the arguments of the
+ * procedure 'text' is the body of, or NULL if it is not one. */
+static pickle_program_t *picolCompileScript(pickle_t *i, const char *text, pickle_program_t *root, const char *args) {
+	assert(i);
+	assert(text);
+	implies(root, !args);
+	pickle_parser_t p = { .p = NULL };
+	pickle_compiler_t c = { .p = picolMalloc(i, sizeof (*c.p)) };
+	if (!c.p)
+		return NULL;
+	zero(c.p, sizeof (*c.p));
+	c.p->refs = 1;
+	c.p->root = root ? root : c.p;
+	if (args && picolCompileArgs(i, c.p, args) != PICKLE_OK)
+		goto fail;
+	picolParserInitialize(&p, NULL, text, NULL, NULL);
+	int prevtype = p.type, command = -1; /* 'command' is the index of the current OP_COMMAND */
+	for (;;) {
+		pickle_instruction_t ins = { .op = OP_ERROR, .length = ERROR_PARSE };
+		if (picolGetToken(&p) != PICKLE_OK) {
+			if (picolEmit(i, &c, &ins) != PICKLE_OK)
+				goto fail;
+			break;
+		}
+		if (p.type == PT_EOF)
+			break;
+		if (p.type == PT_SEP || p.type == PT_EOL) {
+			if (p.type == PT_EOL && command >= 0) {
+				c.p->code[command].u.count = c.p->length - command - 1;
+				command = -1;
+			}
+			prevtype = p.type;
+			continue;
+		}
+		if (command < 0) {
+			const pickle_instruction_t cmd = { .op = OP_COMMAND };
+			command = c.p->length;
+			if (picolEmit(i, &c, &cmd) != PICKLE_OK)
+				goto fail;
+		}
+		ins.append = !(prevtype == PT_SEP || prevtype == PT_EOL);
+		if (!ins.append)
+			c.p->code[command].length++;
+		if (picolCompileToken(i, &c, &p, &ins) != PICKLE_OK)
+			goto fail;
+		if (picolEmit(i, &c, &ins) != PICKLE_OK) {
+			if (ins.op == OP_SUBSTITUTE)
+				(void)picolFreeProgram(i, ins.u.program);
+			goto fail;
+		}
+		if (ins.op == OP_ERROR)
+			break;
+		prevtype = p.type;
+	}
+	if (command >= 0)
+		c.p->code[command].u.count = c.p->length - command - 1;
+	for (int j = 0; j < c.p->length; j++) { /* string pool is now fixed, turn offsets into pointers */
+		pickle_instruction_t *ins = &c.p->code[j];
+		if (ins->op == OP_COMMAND) /* a command name built up from several words can change between calls */
+			ins->literal = ins[1].op == OP_LITERAL && (ins->u.count == 1 || !ins[2].append);
+		if (ins->op == OP_LITERAL || ins->op == OP_VARIABLE || (ins->op == OP_ERROR && ins->length == ERROR_ESCAPE))
+			ins->u.string = c.p->strings + ins->u.offset;
+	}
+	return c.p;
+fail:
+	for (int j = 0; j < c.p->length; j++) /* offsets not yet converted, do not use 'picolFreeProgram' on them */
+		if (c.p->code[j].op != OP_SUBSTITUTE)
+			c.p->code[j].op = OP_LITERAL;
+	(void)picolFreeProgram(i, c.p);
+	return NULL;
+}
+
+static pickle_program_t *picolCompile(pickle_t *i, const char *text) {
+	return picolCompileScript(i, text, NULL, NULL);
+}
+
+static pickle_program_t *picolCompileProc(pickle_t *i, const pickle_proc_t *proc, const int variadic) {
+	assert(i);
+	assert(proc);
+	return picolCompileScript(i, proc->body, NULL, variadic ? "" : proc->args);
+}
+
+static int picolProgramError(pickle_t *i, const pickle_instruction_t *ins) {
+	assert(i);
+	assert(ins);
+	assert(ins->op == OP_ERROR);
+	if (ins->length == ERROR_ESCAPE)
+		return pickle_set_result_error(i, "Invalid escape sequence %s", ins->u.string);
+	return pickle_set_result_error(i, "Invalid parse");
+}
+
+static int picolEvalProgram(pickle_t *i, pickle_program_t *p) {
+	assert(i);
+	assert(i->initialized);
+	assert(p);
+	assert(p->refs > 0);
+	int retcode = PICKLE_OK;
+	p->refs++; /* the program may be deleted whilst we are running it */
+	if (pickle_set_result_empty(i) != PICKLE_OK) {
+		(void)picolFreeProgram(i, p);
+		return PICKLE_ERROR;
+	}
+	const pickle_scratch_mark_t mark = picolScratchMark(i);
+	for (int pc = 0; pc < p->length && retcode == PICKLE_OK;) {
+		pickle_instruction_t *ins = &p->code[pc++];
+		if (ins->op == OP_ERROR) {
+			retcode = picolProgramError(i, ins);
+			break;
+		}
+		assert(ins->op == OP_COMMAND);
+		const int argc = ins->length, end = pc + ins->u.count;
+		assert(argc > 0);
+		int args = 0;
+		pickle_arg_t local[8], *numbers = argc <= (int)(sizeof (local) / sizeof (local[0])) ? local : picolScratchAllocate(i, sizeof (*numbers) * argc);
+		const int big = numbers && numbers != local; /* from the scratch arena */
+		char **argv = picolScratchAllocate(i, sizeof (*argv) * argc);
+		const int scratch = !!argv;
+		if (!numbers)
+			numbers = picolMalloc(i, sizeof (*numbers) * argc);
+		if (!argv)
+			argv = picolMalloc(i, sizeof (*argv) * argc);
+		if (!argv || !numbers) {
+			if (numbers != local && !big)
+				(void)picolFree(i, numbers);
+			if (!scratch)
+				(void)picolFree(i, argv);
+			picolScratchRelease(i, mark);
+			retcode = PICKLE_ERROR;
+			break;
+		}
+		for (; pc < end; pc++) {
+			const pickle_instruction_t *w = &p->code[pc];
+			const char *s = NULL;
+			size_t sl = 0;
+			int shared = 0; /* 's' is a reference counted string */
+			pickle_arg_t n = { .numeric = 0 };
+			switch (w->op) {
+			case OP_LITERAL:
+				s = w->u.string;
+				sl = w->length;
+				n.number  = w->number;
+				n.numeric = w->numeric;
+				break;
+			case OP_VARIABLE: {
+				pickle_call_frame_t * const cf = i->callframe;
+				pickle_var_t * const v = w->length >= 0 && cf->program == p->root ?
+					picolVarLink(cf->slot[w->length]) : picolGetVar(i, w->u.string, 1);
+				if (!v) {
+					retcode = pickle_set_result_error(i, "Invalid variable %s", w->u.string);
+					goto done;
+				}
+				s = picolGetVarVal(v);
+				shared = v->type == PV_STRING;
+				n.number  = v->number;
+				n.numeric = v->numeric;
+				n.var     = v;
+				n.epoch   = i->epoch;
+				break;
+			}
+			case OP_SUBSTITUTE:
+				if ((retcode = picolEvalProgram(i, w->u.program)) != PICKLE_OK)
+					goto done;
+				s = i->result;
+				shared = i->result_shared;
+				n.number  = i->result_number;
+				n.numeric = i->result_numeric;
+				break;
+			default:
+				assert(w->op == OP_ERROR);
+				retcode = picolProgramError(i, w);
+				goto done;
+			}
+			if (w->op != OP_LITERAL)
+				sl = picolStrlen(s);
+			if (!w->append) {
+				assert(args < argc);
+				if (!(argv[args] = shared ? picolStringRef(s) : picolStringScratch(i, s, sl))) {
+					retcode = PICKLE_ERROR;
+					goto done;
+				}
+				numbers[args++] = n;
+			} else { /* Interpolation */
+				assert(args > 0);
+				numbers[args - 1].numeric = 0;
+				numbers[args - 1].var     = NULL;
+				if (picolStringAppend(i, &argv[args - 1], s, sl) != PICKLE_OK) {
+					retcode = PICKLE_ERROR;
+					goto done;
+				}
+			}
+		}
+		assert(args == argc);
+		pickle_arg_t *oargs = i->args;
+		char **oargv = i->argv;
+		i->args = numbers;
+		i->argv = argv;
+		if (!ins->literal || !ins->command || ins->epoch != i->command_epoch) {
+			ins->command = picolGetCommand(i, argv[0]);
+			ins->epoch   = i->command_epoch;
+		}
+		retcode = picolCallCommand(i, ins->command, argc, argv);
+		i->args = oargs;
+		i->argv = oargv;
+	done:
+		if (picolFreeArgs(i, args, argv, scratch) != PICKLE_OK)
+			retcode = PICKLE_ERROR;
+		if (numbers != local && !big && picolFree(i, numbers) != PICKLE_OK)
+			retcode = PICKLE_ERROR;
+		picolScratchRelease(i, mark);
+	}
+	if (picolFreeProgram(i, p) != PICKLE_OK)
+		retcode = PICKLE_ERROR;
+	return retcode;
+}
+
+/* Scripts passed to 'eval', 'if', 'while', 'for' and the like are looked up
+ * in a small cache, keyed on the hash of their contents (the script pointers
+ * themselves are of no use as a key, arguments are freed after each command
+ * and their memory reused). To avoid wasting memory on scripts that are only
+ * evaluated once, a script is only compiled when it is seen a second time.
+ * A script that could not be compiled, for lack of memory, is remembered so
+ * that it is not compiled again every time it is evaluated; trying to would
+ * flush the cache each time as well. Entries are evicted with the clock
+ * algorithm. A program is returned that is owned by the cache, or NULL if
+ * the script should be evaluated as text. */
+static pickle_program_t *picolCacheLookup(pickle_t *i, const char *text) {
+	assert(i);
+	assert(text);
+	pickle_cache_t *c = i->cache;
+	if (!c) {
+		if (!(c = picolMalloc(i, sizeof (*c))))
+			return NULL;
+		zero(c, sizeof (*c));
+		i->cache = c;
+	}
+	const size_t n = sizeof (c->entry) / sizeof (c->entry[0]);
+	const size_t length = picolStrlen(text);
+	const unsigned long hash = picolHash(text, length);
+	for (size_t j = 0; j < n; j++) {
+		pickle_cache_entry_t *e = &c->entry[j];
+		if (e->program && e->hash == hash && e->length == length && !memcmp(e->text, text, length)) {
+			e->used = 1;
+			c->hits++;
+			return e->program;
+		}
+	}
+	c->misses++;
+	const unsigned long mark = hash | 1; /* never zero, which marks an empty slot in 'seen' and 'failed' */
+	int seen = 0;
+	for (size_t j = 0; j < n; j++)
+		if (c->failed[j] == mark) /* a different script with the same hash is only slower, not wrong */
+			return NULL;
+	for (size_t j = 0; j < n && !seen; j++)
+		seen = c->seen[j] == mark;
+	if (!seen) {
+		c->seen[c->next] = mark;
+		c->next = (c->next + 1) % n;
+		return NULL;
+	}
+	pickle_program_t *program = picolCompile(i, text); /* NB. may flush the cache */
+	char *copy = program ? picolMalloc(i, length + 1) : NULL;
+	if (!program || !copy) {
+		(void)picolFreeProgram(i, program);
+		(void)picolFree(i, copy);
+		c->failed[c->nextfailed] = mark;
+		c->nextfailed = (c->nextfailed + 1) % n;
+		return NULL;
+	}
+	move(copy, text, length + 1);
+	pickle_cache_entry_t *e = NULL;
+	for (;;) {
+		e = &c->entry[c->hand];
+		c->hand = (c->hand + 1) % n;
+		if (!e->used)
+			break;
+		e->used = 0;
 	}
-	return -3; /* not reached */
+	(void)picolFree(i, e->text);
+	(void)picolFreeProgram(i, e->program);
+	e->hash    = hash;
+	e->length  = length;
+	e->text    = copy;
+	e->program = program;
+	e->used    = 1;
+	return program;
+}
+
+/* Empty the cache, returning non-zero if anything was freed. This is called
+ * when an allocation fails, so must not allocate. */
+static int picolFlushCache(pickle_t *i) {
+	assert(i);
+	pickle_cache_t *c = i->cache;
+	if (!c)
+		return 0;
+	int freed = 0;
+	for (size_t j = 0; j < sizeof (c->entry) / sizeof (c->entry[0]); j++) {
+		pickle_cache_entry_t *e = &c->entry[j];
+		if (!e->program)
+			continue;
+		(void)picolFree(i, e->text);
+		(void)picolFreeProgram(i, e->program);
+		zero(e, sizeof (*e));
+		freed = 1;
+	}
+	return freed;
 }
 
+static int picolFreeCache(pickle_t *i) {
+	assert(i);
+	pickle_cache_t *c = i->cache;
+	if (!c)
+		return PICKLE_OK;
+	(void)picolFlushCache(i);
+	const int r = picolFree(i, c);
+	i->cache = NULL;
+	return r;
+}
+
+static pickle_regex_t *picolRegexLookup(pickle_t *i, const char *pattern, const unsigned type, const unsigned nocase, const unsigned glob);
+static int picolRegexExecute(pickle_t *i, pickle_regex_t *x, const char *text, const char **start, const char **end);
+static int picolGlob(pickle_t *i, const char *pattern, const char *str);
+
 static inline int isFalse(const char *s) {
 	assert(s);
 	static const char *negatory[] = { "0", "false", "off", "no", };
@@ -1482,6 +3211,11 @@ static inline int isTrue(const char *s) {
 	return 0;
 }
 
+static inline int picolResultIsFalse(pickle_t *i) {
+	assert(i);
+	return i->result_numeric ? i->result_number == 0 : isFalse(i->result);
+}
+
 #define TRCC (256)
 
 typedef struct { short set[TRCC]; /* x < 0 == delete, x | 0x100 == squeeze, x < 0x100 == translate */ } tr_t;
@@ -1706,9 +3440,11 @@ static inline int picolCommandString(pickle_t *i, const int argc, char **argv, v
 			return r;
 		}
 		if (!compare(rq, "match"))  {
-			const int r = match(arg1, arg2, PICKLE_MAX_RECURSION - i->level);
+			const int r = picolGlob(i, arg1, arg2);
+			if (r < -1)
+				return PICKLE_ERROR;
 			if (r < 0)
-				return pickle_set_result_error(i, "Invalid regex %d", r);
+				return pickle_set_result_error(i, "Invalid regex %s", arg1);
 			return picolSetResultNumber(i, r);
 		}
 		if (!compare(rq, "equal"))
@@ -1901,18 +3637,17 @@ static int picolCommandIncr(pickle_t *i, const int argc, char **argv, void *pd)
 	if (argc != 2 && argc != 3)
 		return pickle_set_result_error_arity(i, 3, argc, argv);
 	if (argc == 3)
-		if (picolStringToNumber(i, argv[2], &incr) != PICKLE_OK)
+		if (picolArgToNumber(i, argv, 2, &incr) != PICKLE_OK)
 			return PICKLE_ERROR;
 	pickle_var_t *v = picolGetVar(i, argv[1], 1);
 	if (!v)
 		return pickle_set_result_error(i, "Invalid variable %s", argv[1]);
-	const char *ns = picolGetVarVal(v);
-	if (picolStringToNumber(i, ns, &n) != PICKLE_OK)
+	if (picolVarToNumber(i, v, &n) != PICKLE_OK)
 		return PICKLE_ERROR;
 	n += incr;
-	if (picolSetVarInteger(i, argv[1], n) != PICKLE_OK)
+	if (picolSetVarValNumber(i, v, n) != PICKLE_OK)
 		return PICKLE_ERROR;
-	return pickle_set_result_integer(i, n);
+	return picolSetResultNumber(i, n);
 }
 
 enum { UNOT, UINV, UABS, UBOOL, UNEGATE };
@@ -1927,7 +3662,7 @@ static inline int picolCommandMathUnary(pickle_t *i, const int argc, char **argv
 	if (argc != 2)
 		return pickle_set_result_error_arity(i, 2, argc, argv);
 	number_t a = 0;
-	if (picolStringToNumber(i, argv[1], &a) != PICKLE_OK)
+	if (picolArgToNumber(i, argv, 1, &a) != PICKLE_OK)
 		return PICKLE_ERROR;
 	switch ((intptr_t)(char*)pd) {
 	case UNOT:    a = !a; break;
@@ -1945,9 +3680,9 @@ static inline int picolCommandMath(pickle_t *i, const int argc, char **argv, voi
 	if (argc != 3)
 		return pickle_set_result_error_arity(i, 3, argc, argv);
 	number_t a = 0, b = 0;
-	if (picolStringToNumber(i, argv[1], &a) != PICKLE_OK)
+	if (picolArgToNumber(i, argv, 1, &a) != PICKLE_OK)
 		return PICKLE_ERROR;
-	if (picolStringToNumber(i, argv[2], &b) != PICKLE_OK)
+	if (picolArgToNumber(i, argv, 2, &b) != PICKLE_OK)
 		return PICKLE_ERROR;
 	number_t c = 0;
 	switch ((intptr_t)(char*)pd) {
@@ -1981,15 +3716,19 @@ static int picolCommandSet(pickle_t *i, const int argc, char **argv, void *pd) {
 	if (argc != 3 && argc != 2)
 		return pickle_set_result_error_arity(i, 3, argc, argv);
 	if (argc == 2) {
-		const char *r = NULL;
-		const int retcode = pickle_get_var_string(i, argv[1], &r);
-		if (retcode != PICKLE_OK || !r)
+		pickle_var_t *v = picolGetVar(i, argv[1], 1);
+		if (!v)
 			return pickle_set_result_error(i, "Invalid variable %s", argv[1]);
-		return pickle_set_result_string(i, r);
+		const char *val = picolGetVarVal(v);
+		if ((v->type == PV_STRING ? picolSetResultShared(i, val) : pickle_set_result_string(i, val)) != PICKLE_OK)
+			return PICKLE_ERROR;
+		i->result_number  = v->number;
+		i->result_numeric = v->numeric;
+		return PICKLE_OK;
 	}
-	if (pickle_set_var_string(i, argv[1], argv[2]) != PICKLE_OK)
+	if (picolSetVarArg(i, argv[1], argv, 2) != PICKLE_OK)
 		return PICKLE_ERROR;
-	return pickle_set_result_string(i, argv[2]);
+	return picolSetResultArg(i, argv, 2);
 }
 
 static int picolCommandCatch(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2009,7 +3748,7 @@ static int picolCommandIf(pickle_t *i, const int argc, char **argv, void *pd) {
 			return pickle_set_result_error(i, "Invalid else %s", argv[3]);
 	if ((retcode = picolEval(i, argv[1])) != PICKLE_OK)
 		return retcode;
-	if (!isFalse(i->result))
+	if (!picolResultIsFalse(i))
 		return picolEval(i, argv[2]);
 	else if (argc == 5)
 		return picolEval(i, argv[4]);
@@ -2025,7 +3764,7 @@ static int picolCommandWhile(pickle_t *i, const int argc, char **argv, void *pd)
 		const int r1 = picolEval(i, argv[1]);
 		if (r1 != PICKLE_OK)
 			return r1;
-		if (isFalse(i->result))
+		if (picolResultIsFalse(i))
 			return PICKLE_OK;
 		const int r2 = picolEval(i, argv[2]);
 		switch (r2) {
@@ -2052,7 +3791,8 @@ static int picolCommandApply(pickle_t *i, const int argc, char **argv, void *pd)
 		(void)picolFreeArgList(i, a.argc, a.argv);
 		return pickle_set_result_error(i, "Invalid apply %s", argv[1]);
 	}
-	const int r = picolCommandCallProc(i, argc - 1, argv + 1, a.argv);
+	pickle_proc_t proc = { .args = a.argv[0], .body = a.argv[1], .nocompile = 1 };
+	const int r = picolCommandCallProc(i, argc - 1, argv + 1, &proc);
 	if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK)
 		return PICKLE_ERROR;
 	return r;
@@ -2070,7 +3810,7 @@ static int picolCommandFor(pickle_t *i, const int argc, char **argv, void *pd) {
 		const int r2 = picolEval(i, argv[2]);
 		if (r2 != PICKLE_OK)
 			return r2;
-		if (isFalse(i->result))
+		if (picolResultIsFalse(i))
 			return PICKLE_OK;
 		const int r3 = picolEval(i, argv[4]);
 		switch (r3) {
@@ -2125,12 +3865,14 @@ static inline int picolCommandLLength(pickle_t *i, const int argc, char **argv,
 	assert(!pd);
 	if (argc != 2)
 		return pickle_set_result_error_arity(i, 2, argc, argv);
-	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, argv[1]);
-	if (!a.argv)
+	int owned = 0;
+	pickle_list_t *l = picolArgToList(i, argv, 1, &owned);
+	if (!l)
 		return PICKLE_ERROR;
-	if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK)
+	const int length = l->length;
+	if (picolListRelease(i, l, owned) != PICKLE_OK)
 		return PICKLE_ERROR;
-	return picolSetResultNumber(i, a.argc);
+	return picolSetResultNumber(i, length);
 }
 
 static inline int picolCommandLReverse(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2138,19 +3880,16 @@ static inline int picolCommandLReverse(pickle_t *i, const int argc, char **argv,
 	assert(!pd);
 	if (argc != 2)
 		return pickle_set_result_error_arity(i, 2, argc, argv);
-	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, argv[1]);
-	if (!a.argv)
+	int owned = 0;
+	pickle_list_t *l = picolArgToList(i, argv, 1, &owned);
+	if (!l)
 		return PICKLE_ERROR;
-	assert(a.argc >= 0);
-	for (int j = 0; j < (a.argc / 2); j++)
-		picolSwapString(&a.argv[j], &a.argv[(a.argc - j) - 1]);
-	char *s = concatenate(i, " ", a.argc, a.argv, 1, 0);
-	if (!s) {
-		(void)picolFreeArgList(i, a.argc, a.argv);
+	const pickle_list_edit_t e = { .s = argv[1], .l = l, .to = l->length, .reverse = 1 };
+	char *s = picolListJoin(i, &e, NULL);
+	if (picolListRelease(i, l, owned) != PICKLE_OK || !s) {
+		(void)picolFree(i, s);
 		return PICKLE_ERROR;
 	}
-	if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK)
-		return PICKLE_ERROR;
 	return picolForceResult(i, s, 0);
 }
 
@@ -2160,95 +3899,73 @@ static inline int picolCommandLIndex(pickle_t *i, const int argc, char **argv, v
 	if (argc != 3)
 		return pickle_set_result_error_arity(i, 3, argc, argv);
 	number_t index = 0;
-	if (picolStringToNumber(i, argv[2], &index) != PICKLE_OK)
+	if (picolArgToNumber(i, argv, 2, &index) != PICKLE_OK)
 		return PICKLE_ERROR;
-	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, argv[1]);
-	if (!a.argv)
+	int owned = 0;
+	pickle_list_t *l = picolArgToList(i, argv, 1, &owned);
+	if (!l)
 		return PICKLE_ERROR;
-	assert(a.argc >= 0);
-	if (!a.argc || index >= a.argc) {
-		if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK)
+	if (!l->length || index >= l->length) {
+		if (picolListRelease(i, l, owned) != PICKLE_OK)
 			return PICKLE_ERROR;
 		return pickle_set_result_empty(i);
 	}
-	index = MAX(0, MIN(index, a.argc - 1));
-	const int r1 = picolForceResult(i, a.argv[index], 0);
-	a.argv[index] = NULL;
-	const int r2 = picolFreeArgList(i, a.argc, a.argv);
-	return r1 == PICKLE_OK && r2 == PICKLE_OK ? PICKLE_OK : PICKLE_ERROR;
+	index = MAX(0, index);
+	const pickle_span_t e = *picolListSpan(argv[1], l, index);
+	if (picolListRelease(i, l, owned) != PICKLE_OK)
+		return PICKLE_ERROR;
+	char *r = picolMalloc(i, e.length + 1);
+	if (!r)
+		return PICKLE_ERROR;
+	move(r, argv[1] + e.offset, e.length);
+	r[e.length] = '\0';
+	return picolForceResult(i, r, 0);
 }
 
 enum { INSERT, DELETE, SET };
 
-static inline int picolListOperation(pickle_t *i, const char *parse, const char *position, char *insert, int op, int doEsc) {
+/* Perform 'op' on list 'l' made from 'parse', putting the new list in the
+ * result. If 'list' is not NULL it is set to the list of the result, if
+ * that is known. */
+static inline int picolListOperation(pickle_t *i, const char *parse, pickle_list_t *l, const char *position, char *insert, int op, int doEsc, pickle_list_t **list) {
 	assert(i);
 	assert(parse);
+	assert(l);
 	assert(position);
 	assert(insert);
-	const int escape = doEsc && picolStringNeedsEscaping(insert);
-	const size_t il  = picolStrlen(insert);
-	number_t index = 0, r = PICKLE_OK;
+	number_t index = 0;
+	if (list)
+		*list = NULL;
 	if (picolStringToNumber(i, position, &index) != PICKLE_OK)
 		return PICKLE_ERROR;
-	if (!(insert = escape ? picolEscape(i, insert, il) : insert))
-		return PICKLE_ERROR;
-	char *prev = NULL;
-	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, parse);
-	assert(a.argc >= 0);
-	if (!a.argv)
+	if (!l->length)
+		return pickle_set_result_empty(i);
+	index = MAX(0, MIN(index, l->length - (op != INSERT)));
+	pickle_list_edit_t e = { .s = parse, .l = l, .to = l->length, .at = index, .remove = op != INSERT };
+	if (op != DELETE)
+		e.insert = (pickle_piece_t){ .s = insert, .length = picolStrlen(insert), .escape = doEsc, .raw = !doEsc };
+	char *r = picolListJoin(i, &e, list);
+	if (!r)
 		return PICKLE_ERROR;
-	if (!a.argc) {
-		r = pickle_set_result_empty(i);
-		goto done;
-	}
-	index = MAX(0, MIN(index, a.argc));
-	if (op == INSERT) {
-		if (!(a.argv = picolArgsGrow(i, &a.argc, a.argv))) {
-			if (escape)
-				(void)picolFree(i, insert);
-			return PICKLE_ERROR;
-		}
-		if (index < (a.argc - 1))
-			move(&a.argv[index + 1], &a.argv[index], sizeof (*a.argv) * (a.argc - index - 1));
-		a.argv[index] = insert;
-	} else if (op == SET) {
-		prev = a.argv[index];
-		a.argv[index] = insert;
-	} else {
-		assert(op == DELETE);
-		prev = a.argv[index];
-		a.argv[index] = NULL;
-	}
-done:
-	if (r == PICKLE_OK) {
-		char *s = concatenate(i, " ", a.argc, a.argv, 0, 0);
-		if (!s)
-			r = PICKLE_ERROR;
-		else if (picolForceResult(i, s, 0) != PICKLE_OK)
-			r = PICKLE_ERROR;
-	}
-	a.argv[index] = prev;
-
-	if (escape) {
-		if (picolFree(i, insert) != PICKLE_OK)
-			r = PICKLE_ERROR;
-	}
-	if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK)
-		r = PICKLE_ERROR;
-	return r;
+	return picolForceResult(i, r, 0);
 }
 
-static inline int picolDoLInsert(pickle_t *i, char *list, char *position, const int argc, char **argv, int doEsc) {
+/* Insert 'args' into the list 'argv[1]' at position 'argv[2]' */
+static inline int picolDoLInsert(pickle_t *i, char **argv, const int argc, char **args, int doEsc) {
 	assert(i);
-	assert(list);
-	assert(position);
-	implies(argc >= 0, argv);
-	char *insert = concatenate(i, " ", argc, argv, 0, 0);
-	if (!insert)
+	assert(argv);
+	implies(argc >= 0, args);
+	int owned = 0;
+	pickle_list_t *l = picolArgToList(i, argv, 1, &owned);
+	char *insert = l ? concatenate(i, " ", argc, args, 0, 0) : NULL;
+	if (!insert) {
+		(void)picolListRelease(i, l, owned);
 		return PICKLE_ERROR;
-	const int r1 = picolListOperation(i, list, position, insert, INSERT, doEsc);
+	}
+	const int r1 = picolListOperation(i, argv[1], l, argv[2], insert, INSERT, doEsc, NULL);
 	const int r2 = picolFree(i, insert);
-	return r1 != PICKLE_OK || r2 != PICKLE_OK ? PICKLE_ERROR : PICKLE_OK;
+	const int r3 = picolListRelease(i, l, owned);
+	return r1 != PICKLE_OK || r2 != PICKLE_OK || r3 != PICKLE_OK ? PICKLE_ERROR : PICKLE_OK;
 }
 
 static inline int picolCommandLInsert(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2256,7 +3973,7 @@ static inline int picolCommandLInsert(pickle_t *i, const int argc, char **argv,
 	assert(!pd);
 	if (argc < 4)
 		return pickle_set_result_error_arity(i, 4, argc, argv);
-	return picolDoLInsert(i, argv[1], argv[2], argc - 3, argv + 3, 1);
+	return picolDoLInsert(i, argv, argc - 3, argv + 3, 1);
 }
 
 static inline int picolCommandLSet(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2269,57 +3986,103 @@ static inline int picolCommandLSet(pickle_t *i, const int argc, char **argv, voi
 	pickle_var_t *v = picolGetVar(i, argv[1], 1);
 	if (!v)
 		return pickle_set_result_error(i, "Invalid variable %s", argv[1]);
-	if (picolListOperation(i, picolGetVarVal(v), argv[2], argv[3], argv[3][0] ? SET : DELETE, 1) != PICKLE_OK)
+	pickle_list_t *l = picolVarToList(i, v), *n = NULL;
+	if (!l)
 		return PICKLE_ERROR;
-	return picolSetVarString(i, v,  i->result);
+	if (picolListOperation(i, picolGetVarVal(v), l, argv[2], argv[3], argv[3][0] ? SET : DELETE, 1, &n) != PICKLE_OK)
+		return PICKLE_ERROR;
+	if (picolFreeVarVal(i, v) != PICKLE_OK || picolSetVarString(i, v, i->result) != PICKLE_OK) {
+		(void)picolFree(i, n);
+		return PICKLE_ERROR;
+	}
+	v->list = n; /* the new list does not need parsing again */
+	return PICKLE_OK;
 }
 
 enum { INTEGER, STRING };
 
-static inline int order(pickle_t *i, int op, int rev, const char *a, const char *b) { 
-	assert(i);
+typedef PREPACK struct {
+	union {
+		number_t number;  /**< INTEGER: key */
+		const char *key; /**< STRING: key, not NUL terminated */
+	} u;
+	int length;         /**< STRING: length of 'key' */
+	int index;          /**< index of element in the list being sorted */
+} POSTPACK pickle_sort_t; /**< An element to be sorted, with its key extracted once up front */
+
+static inline int picolSortOrder(const int op, const pickle_sort_t *a, const pickle_sort_t *b) {
 	assert(a);
 	assert(b);
-	int r = 0;
-	switch (op) {
-	case INTEGER: {
-		number_t an = 0, bn = 0;
-		const int ra = picolStringToNumber(i, a, &an);
-		const int rb = picolStringToNumber(i, b, &bn);
-		if (ra != PICKLE_OK || rb != PICKLE_OK)
-			return -1;
-		r = an < bn;
-		break;
-	}
-	case STRING: {
-		r = compare(b, a) > 0;
-		break;
-	}
+	if (op == INTEGER)
+		return (a->u.number > b->u.number) - (a->u.number < b->u.number);
+	const int r = memcmp(a->u.key, b->u.key, MIN(a->length, b->length));
+	return r ? r : (a->length > b->length) - (a->length < b->length);
+}
+
+/* A bottom up merge sort, which is stable, of 'n' elements using 't' as
+ * scratch space. Returns whichever of 'a' or 't' holds the sorted result. */
+static pickle_sort_t *picolSort(pickle_sort_t *a, pickle_sort_t *t, const int n, const int op, const int rev) {
+	assert(a);
+	assert(t);
+	for (int width = 1; width < n; width *= 2) {
+		for (int lo = 0; lo < n; lo += 2 * width) {
+			const int mid = MIN(lo + width, n), hi = MIN(lo + (2 * width), n);
+			int l = lo, r = mid, k = lo;
+			while (l < mid && r < hi) {
+				const int od = picolSortOrder(op, &a[r], &a[l]);
+				t[k++] = (rev ? od > 0 : od < 0) ? a[r++] : a[l++];
+			}
+			while (l < mid)
+				t[k++] = a[l++];
+			while (r < hi)
+				t[k++] = a[r++];
+		}
+		pickle_sort_t *swap = a;
+		a = t;
+		t = swap;
 	}
-	return rev ? !r : r;
+	return a;
 }
 
-static inline int sortArgs(pickle_t *i, int op, int rev, const int argc, char **argv) {
+/* Extract the key of element 'j' of 'l', made from 's', into 'e'. If 'field'
+ * is not negative the element is itself a list and its 'field' element is
+ * the key. 'h' is scratch space for parsing the element. */
+static int picolSortKey(pickle_t *i, const char *s, pickle_list_t *l, const int j, const int op, const int field, pickle_stack_or_heap_t *h, pickle_sort_t *e) {
 	assert(i);
-	assert(argv);
-	assert(argc >= 0);
-	for (int j = 1, k = 0; j < argc; j++) { /* insertion sort */
-		char *key = argv[j];
-		k = j - 1;
-		while (k >= 0) {
-			const int od = order(i, op, rev, key, argv[k]);
-			if (od < 0)
-				return PICKLE_ERROR;
-			if (!od)
-				break;
-			assert((k + 1) < argc && k < argc);
-			argv[k + 1] = argv[k];
-			k--;
+	assert(s);
+	assert(l);
+	assert(h);
+	assert(e);
+	const pickle_span_t span = *picolListSpan(s, l, j);
+	const char *key = s + span.offset;
+	e->index  = j;
+	e->length = span.length;
+	if (field >= 0) {
+		const char *element = picolListElement(i, s, l, j, h);
+		if (!element)
+			return PICKLE_ERROR;
+		pickle_list_t *fields = picolListParse(i, element);
+		if (!fields)
+			return PICKLE_ERROR;
+		if (field >= fields->length) {
+			(void)picolFree(i, fields);
+			return pickle_set_result_error(i, "Invalid index %d for element %s", field, element);
 		}
-		assert((k + 1) < argc);
-		argv[k + 1] = key;
+		const pickle_span_t *f = picolListSpan(element, fields, field);
+		key += f->offset; /* 'element' is a copy of the text of the span */
+		e->length = f->length;
+		if (picolFree(i, fields) != PICKLE_OK)
+			return PICKLE_ERROR;
 	}
-	return PICKLE_OK;
+	if (op != INTEGER) {
+		e->u.key = key;
+		return PICKLE_OK;
+	}
+	if (picolStackOrHeapAlloc(i, h, e->length + 1) != PICKLE_OK)
+		return PICKLE_ERROR;
+	move(h->p, key, e->length);
+	h->p[e->length] = '\0';
+	return picolStringToNumber(i, h->p, &e->u.number);
 }
 
 static inline int picolCommandLSort(pickle_t *i, int argc, char **argv, void *pd) {
@@ -2327,37 +4090,76 @@ static inline int picolCommandLSort(pickle_t *i, int argc, char **argv, void *pd
 	assert(!pd);
 	if (argc < 2)
 		return pickle_set_result_error_arity(i, 2, argc, argv);
-	int op = STRING, rev = 0, j = 1;
+	int op = STRING, rev = 0, unique = 0, field = -1, j = 1;
 	for (j = 1; j < (argc - 1); j++) {
-		if (!compare(argv[j], "-increasing"))
+		if (!compare(argv[j], "-increasing")) {
 			rev = 0;
-		else if (!compare(argv[j], "-decreasing"))
+		} else if (!compare(argv[j], "-decreasing")) {
 			rev = 1;
-		else if (!compare(argv[j], "-ascii"))
+		} else if (!compare(argv[j], "-ascii")) {
 			op = STRING;
-		else if (!compare(argv[j], "-integer"))
+		} else if (!compare(argv[j], "-integer")) {
 			op = INTEGER;
-		else
+		} else if (!compare(argv[j], "-unique")) {
+			unique = 1;
+		} else if (!compare(argv[j], "-index") && (j + 1) < (argc - 1)) {
+			number_t n = 0;
+			if (picolStringToNumber(i, argv[++j], &n) != PICKLE_OK)
+				return PICKLE_ERROR;
+			if (n < 0 || n > INT_MAX)
+				return pickle_set_result_error(i, "Invalid index %s", argv[j]);
+			field = n;
+		} else {
 			return pickle_set_result_error(i, "Invalid option %s", argv[j]);
+		}
 	}
-	char *r = NULL;
-       	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, argv[j]);
-	if (!a.argv)
-		return PICKLE_ERROR;
-	if (sortArgs(i, op, rev, a.argc, a.argv) != PICKLE_OK)
-		goto fail;
-	r = concatenate(i, " ", a.argc, a.argv, 0, 0);
-	if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK) {
-		(void)picolFree(i, r);
+	int owned = 0, r = PICKLE_ERROR;
+	pickle_list_t *l = picolArgToList(i, argv, j, &owned), *sorted = NULL;
+	if (!l)
 		return PICKLE_ERROR;
+	const int n = l->length;
+	pickle_stack_or_heap_t h = { .p = NULL };
+	pickle_sort_t small[2 * PICKLE_SORT_SMALL], *e = small, *t = small + PICKLE_SORT_SMALL, *o = NULL;
+	union { pickle_list_t l; char b[sizeof (pickle_list_t) + (PICKLE_SORT_SMALL * sizeof (pickle_span_t))]; } small_sorted;
+	sorted = &small_sorted.l;
+	if (n > PICKLE_SORT_SMALL) { /* separately, so each allocation is no larger than needed for one copy */
+		e = picolMalloc(i, n * sizeof (*e));
+		t = picolMalloc(i, n * sizeof (*t));
+		sorted = picolMalloc(i, sizeof (*sorted) + (n * sizeof (sorted->span[0])));
+		if (!e || !t || !sorted)
+			goto done;
 	}
-	if (!r)
-		return PICKLE_ERROR;
-	return picolForceResult(i, r, 0);
-fail:
-	(void)picolFree(i, r);
-	(void)picolFreeArgList(i, a.argc, a.argv);
-	return PICKLE_ERROR;
+	for (int k = 0; k < n; k++)
+		if (picolSortKey(i, argv[j], l, k, op, field, &h, &e[k]) != PICKLE_OK)
+			goto done;
+	o = picolSort(e, t, n, op, rev);
+	sorted->length = 0;
+	for (int k = 0; k < n; k++) {
+		if (unique && (k + 1) < n && !picolSortOrder(op, &o[k], &o[k + 1]))
+			continue; /* keep the last of a run of equal elements */
+		sorted->span[sorted->length++] = *picolListSpan(argv[j], l, o[k].index);
+	}
+	sorted->capacity = n;
+	sorted->first    = 0;
+	sorted->window   = 0;
+	const pickle_list_edit_t edit = { .s = argv[j], .l = sorted, .from = 0, .to = sorted->length };
+	char *joined = picolListJoin(i, &edit, NULL);
+	if (joined)
+		r = picolForceResult(i, joined, 0);
+done:
+	if (picolStackOrHeapFree(i, &h) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (e != small) {
+		if (picolFree(i, sorted) != PICKLE_OK)
+			r = PICKLE_ERROR;
+		if (picolFree(i, e) != PICKLE_OK)
+			r = PICKLE_ERROR;
+		if (picolFree(i, t) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	}
+	if (picolListRelease(i, l, owned) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	return r;
 }
 
 static inline int picolCommandLReplace(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2370,44 +4172,32 @@ static inline int picolCommandLReplace(pickle_t *i, const int argc, char **argv,
 		return PICKLE_ERROR;
 	if (picolStringToNumber(i, argv[3], &last) != PICKLE_OK)
 		return PICKLE_ERROR;
+	char *repl = concatenate(i, " ", argc - 4, argv + 4, 1, 0);
+	if (!repl)
+		return PICKLE_ERROR;
 	if (last < first || first < 0) {
-		char *args = concatenate(i, " ", argc - 4, argv + 4, 1, 0); 
-		if (!args)
-			return PICKLE_ERROR;
-		const int r1 = picolDoLInsert(i, argv[1], argv[2], 1, (char *[1]) { args }, 0);
-		const int r2 = picolFree(i, args);
+		const int r1 = picolDoLInsert(i, argv, 1, (char *[1]) { repl }, 0);
+		const int r2 = picolFree(i, repl);
 		return r1 == PICKLE_OK && r2 == PICKLE_OK ? PICKLE_OK : PICKLE_ERROR;
 	}
-	int r = 0, empty = 0;
-	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, argv[1]);
-	char *repl = concatenate(i, " ", argc - 4, argv + 4, 1, 0), *n = NULL;
-	if (!a.argv || !repl)
-		goto err;
-	empty = repl[0] == '\0';
-	if (!empty && a.argc && first < 0)
-		return pickle_set_result(i, "Invalid index %ld", first);
-	for (size_t j = first; j <= (size_t)last && j < (size_t)a.argc; j++) {
-		char *f = a.argv[j];
-		a.argv[j] = NULL;
-		if (picolFree(i, f) != PICKLE_OK)
-			goto err;
-		if (j == (size_t)first && !empty)
-			a.argv[j] = repl;
-	}
-	if (!(n = concatenate(i, " ", a.argc, a.argv, 0, 0)))
-		goto err;
-	r = picolForceResult(i, n, 0);
-	if (empty)
-		if (picolFree(i, repl) != PICKLE_OK)
-			r = PICKLE_ERROR;
-	if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK)
+	int owned = 0;
+	pickle_list_t *l = picolArgToList(i, argv, 1, &owned);
+	if (!l) {
+		(void)picolFree(i, repl);
 		return PICKLE_ERROR;
-	return r;
-err:
-	(void)picolFreeArgList(i, a.argc, a.argv);
-	(void)picolFree(i, repl);
-	(void)picolFree(i, n);
-	return PICKLE_ERROR;
+	}
+	pickle_list_edit_t e = { .s = argv[1], .l = l, .to = l->length, .at = MIN(first, l->length) };
+	e.remove = MAX(0, MIN(last, l->length - 1) - first + 1);
+	if (repl[0] && first < l->length)
+		e.insert = (pickle_piece_t){ .s = repl, .length = picolStrlen(repl), .raw = 1 };
+	char *n = picolListJoin(i, &e, NULL);
+	const int r1 = picolFree(i, repl);
+	const int r2 = picolListRelease(i, l, owned);
+	if (!n || r1 != PICKLE_OK || r2 != PICKLE_OK) {
+		(void)picolFree(i, n);
+		return PICKLE_ERROR;
+	}
+	return picolForceResult(i, n, 0);
 }
 
 /* implementing the '-all' option would be useful */
@@ -2418,8 +4208,8 @@ static inline int picolCommandLSearch(pickle_t *i, const int argc, char **argv,
 		return pickle_set_result_error_arity(i, 3, argc, argv);
 	enum { oGLOB, oEXACT, oINTEGER };
 	number_t start = 0, value = 0;
-	int op = oGLOB, last = argc - 2, index = -1, not = 0, inl = 0;
-	char *list = argv[argc - 2], *pattern = argv[argc - 1];
+	int op = oGLOB, last = argc - 2, index = -1, not = 0, inl = 0, owned = 0, r = PICKLE_OK;
+	char *pattern = argv[argc - 1];
 	for (int j = 1; j < last; j++) {
 		     if (!compare(argv[j], "-integer")) { op = oINTEGER; } 
 		else if (!compare(argv[j], "-exact"))   { op = oEXACT; } 
@@ -2439,16 +4229,25 @@ static inline int picolCommandLSearch(pickle_t *i, const int argc, char **argv,
 	if (op == oINTEGER)
 		if (picolStringToNumber(i, pattern, &value) != PICKLE_OK)
 			return PICKLE_ERROR;
-	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, list);
-	if (!a.argv)
+	pickle_regex_t *glob = NULL; /* compiled once, owned by the cache */
+	if (op == oGLOB)
+		if (!(glob = picolRegexLookup(i, pattern, 0, 0, 1)))
+			return PICKLE_ERROR;
+	pickle_list_t *l = picolArgToList(i, argv, argc - 2, &owned);
+	if (!l)
 		return PICKLE_ERROR;
-	for (size_t j = start; j < (size_t)a.argc; j++) {
+	pickle_stack_or_heap_t h = { .p = NULL };
+	for (int j = MAX(0, start); j < l->length; j++) {
+		char *e = picolListElement(i, argv[argc - 2], l, j, &h);
+		if (!e)
+			goto fail;
 		switch (op) {
 		case oGLOB: {
-			const int m = match(pattern, a.argv[j], PICKLE_MAX_RECURSION - i->level);
+			const char *from = NULL, *to = NULL;
+			const int m = picolRegexExecute(i, glob, e, &from, &to);
 			if (m < 0) {
-				(void)picolFreeArgList(i, a.argc, a.argv);
-				return pickle_set_result_error(i, "Invalid regex %d", m);
+				r = pickle_set_result_error(i, "Invalid regex %s", pattern);
+				goto fail;
 			}
 			if (not ^ (m > 0)) {
 				index = j;
@@ -2457,17 +4256,15 @@ static inline int picolCommandLSearch(pickle_t *i, const int argc, char **argv,
 			break;
 		}
 		case oEXACT:
-			if (not ^ !compare(pattern, a.argv[j])) {
+			if (not ^ !compare(pattern, e)) {
 				index = j;
 				goto done;
 			}
 			break;
 		case oINTEGER: {
 			number_t n = 0;
-			if (picolStringToNumber(i, a.argv[j], &n) != PICKLE_OK) {
-				(void)picolFreeArgList(i, a.argc, a.argv);
-				return PICKLE_ERROR;
-			}
+			if (picolStringToNumber(i, e, &n) != PICKLE_OK)
+				goto fail;
 			if (not ^ (n == value)) {
 				index = j;
 				goto done;
@@ -2479,15 +4276,19 @@ static inline int picolCommandLSearch(pickle_t *i, const int argc, char **argv,
 		}
 	}
 done:
-	if (inl && index > 0) {
-		assert(index < a.argc);
-		const int r = picolForceResult(i, a.argv[index], 0);
-		a.argv[index] = NULL;
-		(void)picolFreeArgList(i, a.argc, a.argv);
-		return r;
+	if (inl && index >= 0) {
+		assert(index < l->length);
+		r = pickle_set_result_string(i, h.p);
+	} else {
+		r = pickle_set_result_integer(i, index);
 	}
-	(void)picolFreeArgList(i, a.argc, a.argv);
-	return pickle_set_result_integer(i, index);
+	if (picolStackOrHeapFree(i, &h) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	return picolListRelease(i, l, owned) == PICKLE_OK ? r : PICKLE_ERROR;
+fail:
+	(void)picolStackOrHeapFree(i, &h);
+	(void)picolListRelease(i, l, owned);
+	return PICKLE_ERROR;
 }
 
 static inline int picolCommandLRange(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2504,24 +4305,24 @@ static inline int picolCommandLRange(pickle_t *i, const int argc, char **argv, v
 		first = 0;
 	if (last < 0)
 		last = 0;
-	int rs = 0;
-	args_t a = picolArgs(i, &(pickle_parser_opts_t){ 1, 1, 1, 1 }, argv[1]);
-	if (!a.argv)
+	int owned = 0;
+	pickle_list_t *l = picolArgToList(i, argv, 1, &owned);
+	if (!l)
 		return PICKLE_ERROR;
-	if (a.argc == 0) {
-		if (picolFreeArgList(i, a.argc, a.argv) != PICKLE_OK)
+	if (last >= l->length)
+		last = l->length - 1;
+	if (first > last) {
+		if (picolListRelease(i, l, owned) != PICKLE_OK)
 			return PICKLE_ERROR;
 		return pickle_set_result_empty(i);
 	}
-	if (last >= a.argc)
-		last = a.argc - 1;
-	char *range = concatenate(i, " ", 1 + last - first, a.argv + first, 1, 0);
-	if (!range) {
-		(void)picolFreeArgList(i, a.argc, a.argv);
+	const pickle_list_edit_t e = { .s = argv[1], .l = l, .from = first, .to = last + 1 };
+	char *range = picolListJoin(i, &e, NULL);
+	if (picolListRelease(i, l, owned) != PICKLE_OK || !range) {
+		(void)picolFree(i, range);
 		return PICKLE_ERROR;
 	}
-	rs = picolForceResult(i, range, 0);
-	return picolFreeArgList(i, a.argc, a.argv) == PICKLE_OK ? rs : PICKLE_ERROR;
+	return picolForceResult(i, range, 0);
 }
 
 static inline int picolCommandLAppend(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2529,21 +4330,35 @@ static inline int picolCommandLAppend(pickle_t *i, const int argc, char **argv,
 	assert(!pd);
 	if (argc < 2)
 		return pickle_set_result_error_arity(i, 2, argc, argv);
-	pickle_var_t *v = picolGetVar(i, argv[1], 1);
-	const char *ovar = v ? picolGetVarVal(v) : NULL;
-	char *nvar = NULL, *args = concatenate(i, " ", argc - 2, argv + 2, 1, 0);
-	if (!args)
-		return PICKLE_ERROR;
-	char *list[2] = { (char*)ovar, args };
-	nvar = concatenate(i, " ", 2 - (ovar == NULL), list + (ovar == NULL), 0, 0);
-	const int r1 = picolFree(i, args);
-	if (!nvar)
+	pickle_var_t *v = picolGetOrMakeVar(i, argv[1]);
+	if (!v)
 		return PICKLE_ERROR;
-	const int r2 = pickle_set_var_string(i, argv[1], nvar);
-	const int r3 = picolForceResult(i, nvar, 0);
-	if (r1 != PICKLE_OK && r2 != PICKLE_OK && r3 != PICKLE_OK)
+	if (argc > 2) {
+		char *args = concatenate(i, " ", argc - 2, argv + 2, 1, 0);
+		if (!args)
+			return PICKLE_ERROR;
+		const size_t before = picolStrlen(picolGetVarVal(v));
+		const int r1 = !before ? PICKLE_OK : picolVarAppend(i, v, " ", 1);
+		const int r2 = r1 == PICKLE_OK ? picolVarAppend(i, v, args, picolStrlen(args)) : PICKLE_ERROR;
+		if (r1 == PICKLE_OK && r2 != PICKLE_OK && before)
+			picolVarTruncate(i, v, before); /* a failed command leaves the variable as it was */
+		if (picolFree(i, args) != PICKLE_OK || r2 != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
+	return picolSetResultVar(i, v);
+}
+
+static int picolCommandAppend(pickle_t *i, const int argc, char **argv, void *pd) {
+	UNUSED(pd);
+	if (argc < 2)
+		return pickle_set_result_error_arity(i, 2, argc, argv);
+	pickle_var_t *v = picolGetOrMakeVar(i, argv[1]);
+	if (!v)
 		return PICKLE_ERROR;
-	return PICKLE_OK;
+	for (int j = 2; j < argc; j++)
+		if (picolVarAppend(i, v, argv[j], picolStrlen(argv[j])) != PICKLE_OK)
+			return PICKLE_ERROR;
+	return picolSetResultVar(i, v);
 }
 
 static inline int picolCommandSplit(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2621,14 +4436,16 @@ static int picolDropCallFrame(pickle_t *i) {
 	int r = PICKLE_OK;
 	if (!cf)
 		return PICKLE_OK;
-	pickle_var_t *v = cf->vars, *t = NULL;
-	while (v) {
-		assert(v != v->next); /* Cycle? */
-		t = v->next;
-		if (picolVarFree(i, v) != PICKLE_OK)
-			r = PICKLE_ERROR;
-		v = t;
-	}
+	for (int j = 0; j < cf->capacity; j++)
+		for (pickle_var_t *v = cf->vars[j], *next = NULL; v; v = next) {
+			next = v->next;
+			if (picolVarFree(i, v) != PICKLE_OK)
+				r = PICKLE_ERROR;
+		}
+	if (cf->vars != cf->local && picolFree(i, cf->vars) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFreeProgram(i, cf->program) != PICKLE_OK)
+		r = PICKLE_ERROR;
 	i->callframe = cf->parent;
 	if (picolFree(i, cf) != PICKLE_OK)
 		r = PICKLE_ERROR;
@@ -2644,25 +4461,43 @@ static int picolDropAllCallFrames(pickle_t *i) {
 	return r;
 }
 
+/* Procedures are compiled the first time they are called, if compilation
+ * fails (which can only be due to a lack of memory) we fall back to evaluating
+ * the body as text. */
+static pickle_program_t *picolProcProgram(pickle_t *i, pickle_proc_t *proc, const int variadic) {
+	assert(i);
+	assert(proc);
+	if (!proc->program && !proc->nocompile)
+		proc->nocompile = !(proc->program = picolCompileProc(i, proc, variadic));
+	return proc->program;
+}
+
+static int picolEvalProc(pickle_t *i, pickle_proc_t *proc) {
+	assert(i);
+	assert(proc);
+	if (proc->program)
+		return picolEvalProgram(i, proc->program);
+	return picolEval(i, proc->body);
+}
+
 static int picolCommandCallVariadic(pickle_t *i, const int argc, char **argv, void *pd) {
 	assert(pd);
 	int errcode = PICKLE_OK;
-	char **x = pd;
+	pickle_proc_t *proc = pd;
 	if (i->level > (int)PICKLE_MAX_RECURSION)
 		return pickle_set_result_error(i, "Invalid recursion %d", PICKLE_MAX_RECURSION);
-	pickle_call_frame_t *cf = picolMalloc(i, sizeof(*cf));
+	pickle_call_frame_t *cf = picolNewCallFrame(i, i->callframe, picolProcProgram(i, proc, 1));
 	if (!cf)
 		return PICKLE_ERROR;
-	cf->vars     = NULL;
-	cf->parent   = i->callframe;
+	cf->name = argv[0];
 	i->callframe = cf;
 	i->level++;
 	char *val = concatenate(i, " ", argc - 1, argv + 1, 1, 0);
 	if (!val)
 		goto error;
-	if (pickle_set_var_string(i, x[0], val) != PICKLE_OK)
+	if (pickle_set_var_string(i, proc->args, val) != PICKLE_OK)
 		goto error;
-	errcode = picolEval(i, x[1]);
+	errcode = picolEvalProc(i, proc);
 	if (picolDropCallFrame(i) != PICKLE_OK)
 		errcode = PICKLE_ERROR;
 	if (picolFree(i, val) != PICKLE_OK)
@@ -2674,23 +4509,49 @@ error:
 	return PICKLE_ERROR;
 }
 
-static int picolCommandCallProc(pickle_t *i, const int argc, char **argv, void *pd) {
-	assert(pd);
-	if (i->level > (int)PICKLE_MAX_RECURSION)
-		return pickle_set_result_error(i, "Invalid recursion %d", PICKLE_MAX_RECURSION);
-	char **x = pd, *alist = x[0], *body = x[1], *tofree = NULL;
-	char *p = picolStrdup(i, alist);
-	int arity = 0, errcode = PICKLE_OK;
-	pickle_call_frame_t *cf = picolMalloc(i, sizeof(*cf));
-	if (!cf || !p) {
-		(void)picolFree(i, p);
-		(void)picolFree(i, cf);
+/* Bind argument 'j' of 'argv' to its slot in the new frame 'cf', the name is
+ * borrowed from the program, which the frame holds on to */
+static int picolSetArgSlot(pickle_t *i, pickle_call_frame_t *cf, char **argv, const int j) {
+	assert(i);
+	assert(cf);
+	assert(cf->program);
+	assert(j > 0 && j <= cf->slots);
+	const pickle_local_t *l = &cf->program->locals[j - 1];
+	pickle_var_t *v = picolMalloc(i, sizeof(*v));
+	if (!v)
 		return PICKLE_ERROR;
+	zero(v, sizeof *v);
+	v->hash = l->hash;
+	if (picolIsSmallString(l->name)) {
+		v->smallname = 1;
+		copy(v->name.small, l->name);
+	} else {
+		v->localname = 1;
+		v->name.ptr  = l->name;
 	}
-	cf->vars     = NULL;
-	cf->parent   = i->callframe;
-	i->callframe = cf;
-	i->level++;
+	const int shared = i->argv == argv;
+	if ((shared ? picolSetVarShared(i, v, argv[j]) : picolSetVarString(i, v, argv[j])) != PICKLE_OK
+			|| picolAddVar(i, cf, v, j - 1) != PICKLE_OK) {
+		(void)picolFreeVarVal(i, v);
+		(void)picolFree(i, v);
+		return PICKLE_ERROR;
+	}
+	if (shared && i->args && i->args[j].numeric) {
+		v->number  = i->args[j].number;
+		v->numeric = 1;
+	}
+	return PICKLE_OK;
+}
+
+/* Set the arguments of a procedure by name, used if its body has not been
+ * compiled or it repeats an argument name (the last one wins) */
+static int picolSetArgsByName(pickle_t *i, const pickle_proc_t *proc, const int argc, char **argv) {
+	assert(i);
+	assert(proc);
+	char *tofree = NULL, *p = picolStrdup(i, proc->args);
+	int arity = 0;
+	if (!p)
+		return PICKLE_ERROR;
 	tofree = p;
 	for (int done = 0;!done;) {
 		const char *start = p;
@@ -2708,30 +4569,52 @@ static int picolCommandCallProc(pickle_t *i, const int argc, char **argv, void *
 			*p = '\0';
 		if (++arity > (argc - 1))
 			goto arityerr;
-		if (pickle_set_var_string(i, start, argv[arity]) != PICKLE_OK) {
+		if (picolSetVarArg(i, start, argv, arity) != PICKLE_OK) {
 			(void)picolFree(i, tofree);
-			(void)picolDropCallFrame(i);
 			return PICKLE_ERROR;
 		}
 		p++;
 	}
 	if (picolFree(i, tofree) != PICKLE_OK)
-		goto error;
-	tofree = NULL;
+		return PICKLE_ERROR;
 	if (arity != (argc - 1))
-		goto arityerr;
-	errcode = picolEval(i, body);
-	if (errcode == PICKLE_RETURN)
-		errcode = PICKLE_OK;
+		return pickle_set_result_error(i, "Invalid argument count for %s", argv[0]);
+	return PICKLE_OK;
+arityerr:
+	(void)picolFree(i, tofree);
+	return pickle_set_result_error(i, "Invalid argument count for %s", argv[0]);
+}
+
+static int picolCommandCallProc(pickle_t *i, const int argc, char **argv, void *pd) {
+	assert(pd);
+	if (i->level > (int)PICKLE_MAX_RECURSION)
+		return pickle_set_result_error(i, "Invalid recursion %d", PICKLE_MAX_RECURSION);
+	pickle_proc_t *proc = pd;
+	pickle_program_t *program = picolProcProgram(i, proc, 0);
+	const int params = program && program->params;
+	if (params && program->arity != (argc - 1))
+		return pickle_set_result_error(i, "Invalid argument count for %s", argv[0]);
+	pickle_call_frame_t *cf = picolNewCallFrame(i, i->callframe, program);
+	if (!cf)
+		return PICKLE_ERROR;
+	cf->name = argv[0];
+	i->callframe = cf;
+	i->level++;
+	int errcode = PICKLE_OK;
+	if (params) {
+		for (int j = 1; j < argc && errcode == PICKLE_OK; j++)
+			errcode = picolSetArgSlot(i, cf, argv, j);
+	} else {
+		errcode = picolSetArgsByName(i, proc, argc, argv);
+	}
+	if (errcode == PICKLE_OK) {
+		errcode = picolEvalProc(i, proc);
+		if (errcode == PICKLE_RETURN)
+			errcode = PICKLE_OK;
+	}
 	if (picolDropCallFrame(i) != PICKLE_OK)
 		return PICKLE_ERROR;
 	return errcode;
-arityerr:
-	(void)pickle_set_result_error(i, "Invalid argument count for %s", argv[0]);
-error:
-	picolFree(i, tofree);
-	picolDropCallFrame(i);
-	return PICKLE_ERROR;
 }
 
 static int picolCommandAddProc(pickle_t *i, const char *name, const char *args, const char *body, int variadic) {
@@ -2739,18 +4622,17 @@ static int picolCommandAddProc(pickle_t *i, const char *name, const char *args,
 	assert(name);
 	assert(args);
 	assert(body);
-	char **procdata = picolMalloc(i, sizeof(char*)*2);
-	if (!procdata)
+	pickle_proc_t *proc = picolMalloc(i, sizeof(*proc));
+	if (!proc)
 		return PICKLE_ERROR;
-	procdata[0] = picolStrdup(i, args); /* arguments list */
-	procdata[1] = picolStrdup(i, body); /* procedure body */
-	if (!(procdata[0]) || !(procdata[1])) {
-		(void)picolFree(i, procdata[0]);
-		(void)picolFree(i, procdata[1]);
-		(void)picolFree(i, procdata);
+	zero(proc, sizeof(*proc));
+	proc->args = picolStrdup(i, args); /* arguments list */
+	proc->body = picolStrdup(i, body); /* procedure body */
+	if (!(proc->args) || !(proc->body)) {
+		(void)picolFreeProc(i, proc);
 		return PICKLE_ERROR;
 	}
-	return pickle_register_command(i, name, variadic ? picolCommandCallVariadic : picolCommandCallProc, procdata);
+	return picolRegisterCommand(i, name, variadic ? picolCommandCallVariadic : picolCommandCallProc, proc);
 }
 
 static int picolCommandProc(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -2787,7 +4669,7 @@ static int picolCommandReturn(pickle_t *i, const int argc, char **argv, void *pd
 			return PICKLE_ERROR;
 	if (argc == 1)
 		return pickle_set_result_empty(i) != PICKLE_OK ? PICKLE_ERROR : PICKLE_RETURN;
-	if (pickle_set_result_string(i, argv[1]) != PICKLE_OK)
+	if (picolSetResultArg(i, argv, 1) != PICKLE_OK)
 		return PICKLE_ERROR;
 	return retcode;
 }
@@ -2897,14 +4779,16 @@ static int picolCommandUpVar(pickle_t *i, const int argc, char **argv, void *pd)
 		goto end;
 	}
 	assert(cf);
-	m = cf->vars;
+	m = picolGetVar(i, argv[3], 0);
+	assert(m);
 
 	if ((retcode = picolSetLevel(i, argv[1])) != PICKLE_OK)
 		goto end;
 	if (!(o = picolGetVar(i, argv[2], 1))) {
 		if (pickle_set_var_string(i, argv[2], "") != PICKLE_OK)
 			return PICKLE_ERROR;
-		o = i->callframe->vars;
+		o = picolGetVar(i, argv[2], 1);
+		assert(o);
 	}
 
 	if (m == o) { /* more advance cycle detection should be done here */
@@ -2912,6 +4796,8 @@ static int picolCommandUpVar(pickle_t *i, const int argc, char **argv, void *pd)
 		goto end;
 	}
 
+	if (picolFreeVarVal(i, m) != PICKLE_OK)
+		retcode = PICKLE_ERROR;
 	m->type = PV_LINK;
 	m->data.link = o;
 end:
@@ -2949,22 +4835,12 @@ static inline int picolUnsetVar(pickle_t *i, const char *name) {
 	if (i->insideuplevel)
 		return pickle_set_result_error(i, "Invalid unset");
 	pickle_call_frame_t *cf = i->callframe;
-	pickle_var_t *p = NULL, *deleteMe = picolGetVar(i, name, 0/*NB!*/);
+	pickle_var_t **link = picolVarSlot(cf, name, picolHashString(name));
+	pickle_var_t *deleteMe = *link; /* NB. Links are not followed */
 	if (!deleteMe)
 		return pickle_set_result_error(i, "Invalid variable %s", name);
-
-	if (cf->vars == deleteMe) {
-		cf->vars = deleteMe->next;
-		picolVarFree(i, deleteMe);
-		return PICKLE_OK;
-	}
-
-	for (p = cf->vars; p->next != deleteMe && p; p = p->next)
-		;
-	assert(p->next == deleteMe);
-	p->next = deleteMe->next;
-	picolVarFree(i, deleteMe);
-	return PICKLE_OK;
+	picolRemoveVar(cf, link);
+	return picolVarFree(i, deleteMe);
 }
 
 static int picolCommandUnSet(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -3036,19 +4912,119 @@ located:
 	}else if (!compare(rq, "args")) {
 		if (!defined)
 			return pickle_set_result(i, "%p", c->privdata);
-		char **procdata = c->privdata;
-		return pickle_set_result_string(i, procdata[0]);
+		pickle_proc_t *proc = c->privdata;
+		return pickle_set_result_string(i, proc->args);
 	} else if (!compare(rq, "body")) {
 		if (!defined)
 			return pickle_set_result(i, "%p", c->func);
-		char **procdata = c->privdata;
-		return pickle_set_result_string(i, procdata[1]);
+		pickle_proc_t *proc = c->privdata;
+		return pickle_set_result_string(i, proc->body);
 	} else if (!compare(rq, "name")) {
 		return pickle_set_result_string(i, c->name);
 	}
 	return pickle_set_result_error(i, "Invalid subcommand %s", rq);
 }
 
+static void picolProfileClear(pickle_t *i) {
+	assert(i);
+	for (pickle_profile_t *p = i->profiles; p; p = p->next) {
+		p->calls = 0;
+		p->allocs = 0;
+		p->inclusive = 0;
+		p->exclusive = 0;
+	}
+}
+
+static int picolFreeSamples(pickle_t *i) {
+	assert(i);
+	if (!i->samples)
+		return PICKLE_OK;
+	int r = PICKLE_OK;
+	for (size_t j = 0; j < PICKLE_SAMPLE_BUCKETS; j++)
+		for (pickle_sample_t *s = i->samples[j], *n = NULL; s; s = n) {
+			n = s->next;
+			if (picolFree(i, s->stack) != PICKLE_OK)
+				r = PICKLE_ERROR;
+			if (picolFree(i, s) != PICKLE_OK)
+				r = PICKLE_ERROR;
+		}
+	if (picolFree(i, i->samples) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	i->samples = NULL;
+	return r;
+}
+
+static int picolFreeProfiles(pickle_t *i) {
+	assert(i);
+	int r = picolFreeSamples(i);
+	for (pickle_profile_t *p = i->profiles, *n = NULL; p; p = n) {
+		n = p->next;
+		if (picolFree(i, p) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	}
+	i->profiles = NULL;
+	return r;
+}
+
+static int picolProfileForEach(pickle_t *i, pickle_profile_func_t f, void *param) {
+	assert(i);
+	assert(f);
+	for (long j = 0; j < i->length; j++)
+		for (pickle_command_t *c = i->table[j]; c; c = c->next) {
+			const pickle_profile_t *p = c->profile;
+			if (p && p->calls)
+				if (f(param, c->name, p->calls, p->inclusive, p->exclusive, p->allocs) != PICKLE_OK)
+					return PICKLE_ERROR;
+		}
+	return PICKLE_OK;
+}
+
+typedef struct { pickle_t *i; char **rows; long count; } pickle_profile_report_t;
+
+static int picolProfileRow(void *param, const char *name, unsigned long calls, unsigned long long inclusive, unsigned long long exclusive, unsigned long allocs) {
+	pickle_profile_report_t *p = param;
+	char n[PRINT_NUMBER_BUF_SZ], in[PRINT_NUMBER_BUF_SZ], ex[PRINT_NUMBER_BUF_SZ], a[PRINT_NUMBER_BUF_SZ];
+	snprintf(n,  sizeof n,  "%lu",  calls);
+	snprintf(in, sizeof in, "%llu", inclusive);
+	snprintf(ex, sizeof ex, "%llu", exclusive);
+	snprintf(a,  sizeof a,  "%lu",  allocs);
+	char *fields[] = { (char*)name, n, in, ex, a, };
+	char *row = concatenate(p->i, " ", sizeof (fields) / sizeof (fields[0]), fields, 1, 0);
+	if (!row)
+		return PICKLE_ERROR;
+	p->rows[p->count++] = row;
+	return PICKLE_OK;
+}
+
+/* Result is a list of '{name calls inclusive exclusive allocations}' for
+ * each command called whilst profiling, with times in nanoseconds */
+static int picolProfileReport(pickle_t *i) {
+	assert(i);
+	long n = 0;
+	for (long j = 0; j < i->length; j++)
+		for (pickle_command_t *c = i->table[j]; c; c = c->next)
+			n += c->profile && c->profile->calls;
+	if (!n)
+		return pickle_set_result_empty(i);
+	pickle_profile_report_t p = { .i = i, .rows = picolMalloc(i, n * sizeof (char*)), .count = 0, };
+	if (!p.rows)
+		return PICKLE_ERROR;
+	int r = PICKLE_ERROR;
+	if (picolProfileForEach(i, picolProfileRow, &p) == PICKLE_OK) {
+		assert(p.count == n);
+		char *report = concatenate(i, " ", p.count, p.rows, 1, 0);
+		if (report) {
+			r = pickle_set_result_string(i, report);
+			if (picolFree(i, report) != PICKLE_OK)
+				r = PICKLE_ERROR;
+		}
+	}
+	for (long j = 0; j < p.count; j++)
+		if (picolFree(i, p.rows[j]) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	return picolFree(i, p.rows) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
 static int picolCommandInfo(pickle_t *i, const int argc, char **argv, void *pd) {
 	if (argc < 2)
 		return pickle_set_result_error_arity(i, 2, argc, argv);
@@ -3059,6 +5035,8 @@ static int picolCommandInfo(pickle_t *i, const int argc, char **argv, void *pd)
 		return picolSetResultNumber(i, i->line);
 	if (!compare(rq, "level"))
 		return picolSetResultNumber(i, i->level);
+	if (!compare(rq, "profile") && argc == 2)
+		return picolProfileReport(i);
 	if (argc < 3)
 		return pickle_set_result_error_arity(i, 3, argc, argv);
 	if (!compare(rq, "sizeof")) {
@@ -3079,6 +5057,31 @@ static int picolCommandInfo(pickle_t *i, const int argc, char **argv, void *pd)
 		if (!compare(rq, "maximum"))
 			return picolSetResultNumber(i, NUMBER_MAX);
 	}
+	if (!compare(rq, "profile")) {
+		rq = argv[2];
+		if (!compare(rq, "on")) {
+			if (!DEFINE_PROFILER)
+				return pickle_set_result_error(i, "Profiling is not available");
+			i->profiling = 1;
+			return PICKLE_OK;
+		}
+		if (!compare(rq, "off")) {
+			i->profiling = 0;
+			return PICKLE_OK;
+		}
+		if (!compare(rq, "clear")) {
+			picolProfileClear(i);
+			return PICKLE_OK;
+		}
+	}
+	if (!compare(rq, "regex")) {
+		rq = argv[2];
+		const pickle_regex_cache_t *c = i->regexes;
+		if (!compare(rq, "hits"))
+			return picolSetResultNumber(i, c ? c->hits : 0);
+		if (!compare(rq, "misses"))
+			return picolSetResultNumber(i, c ? c->misses : 0);
+	}
 	if (!compare(rq, "features")) {
 		rq = argv[2];
 		if (!compare(rq, "allocator"))
@@ -3091,6 +5094,8 @@ static int picolCommandInfo(pickle_t *i, const int argc, char **argv, void *pd)
 			return picolSetResultNumber(i, DEBUGGING);
 		if (!compare(rq, "strict"))
 			return picolSetResultNumber(i, STRICT_NUMERIC_CONVERSION);
+		if (!compare(rq, "profiler"))
+			return picolSetResultNumber(i, DEFINE_PROFILER);
 		if (!compare(rq, "string-length"))
 			return picolSetResultNumber(i, USE_MAX_STRING ? PICKLE_MAX_STRING : -1);
 	}
@@ -3098,9 +5103,20 @@ static int picolCommandInfo(pickle_t *i, const int argc, char **argv, void *pd)
 }
 
 /* Regular Expression Engine
- * Modified from:
+ * The syntax is that of the engine modified from:
  * https://www.cs.princeton.edu/courses/archive/spr09/cos333/beautiful.html 
  *
+ * But instead of backtracking over the pattern, which takes exponential time
+ * for some patterns, the pattern is compiled to a list of instructions (a
+ * non-deterministic finite automaton) that is run over the text with a Pike
+ * VM. All threads advance through the text together, one character at a
+ * time, and there is at most one thread per instruction, so matching takes
+ * time proportional to the length of the text multiplied by the length of
+ * the pattern. Threads are kept in priority order, the order a backtracking
+ * matcher would try them in, which is how lazy and greedy matching give the
+ * same results as they did. Possessive operators never give back what they
+ * have matched, so they compile to instructions that take no alternatives.
+ *
  * Supports: "^$.*+?", escaping, and classes "\w\W\s\S\d\D"
  * Nice to have: hex escape sequences, ability to work on binary data. */
 
@@ -3114,6 +5130,16 @@ enum { /* watch out for those negatives */
 
 enum { LAZY, GREEDY, POSSESSIVE };
 
+enum {
+	RX_CHAR,    /* match 'c' then continue at 'x' */
+	RX_SPLIT,   /* continue at both 'x' and 'y', 'x' has the higher priority */
+	RX_EOL,     /* continue at 'x' if at the end of the text */
+	RX_POSSESS, /* match as many 'c' as possible, then continue at 'x' */
+	RX_ONCE,    /* match 'c' if possible, then continue at 'x' */
+	RX_MATCH,   /* pattern matched */
+	RX_ERROR,   /* invalid pattern, only an error if a match gets this far */
+};
+
 /* escape a character, or return an operator */
 static int regexEscape(const unsigned ch, const int esc) {
 	switch (ch) {
@@ -3146,135 +5172,393 @@ static int regexChar(const pickle_regex_t *x, const int pattern, const int ch) {
 	case DIGIT:  return  isdigit(ch); case NDIGIT: return !isdigit(ch);
 	case SPACE:  return  isspace(ch); case NSPACE: return !isspace(ch);
 	}
-	if (x->nocase)
-		return tolower(pattern) == tolower(ch);
-	return pattern == ch;
+	if (x->nocase)
+		return tolower(pattern) == tolower(ch);
+	return pattern == ch;
+}
+
+static int regexEmit(pickle_regex_t *x, const unsigned op, const int c, const int next, const int alternative) {
+	assert(x);
+	if (x->code) {
+		pickle_regex_op_t *o = &x->code[x->length];
+		o->op = op;
+		o->c  = c;
+		o->x  = next;
+		o->y  = alternative;
+	}
+	return x->length++;
+}
+
+/* Compile 'glob', where '*' matches any string, '?' any character and '%'
+ * escapes the next character, it must match the whole of the text. */
+static void regexCompileGlob(pickle_regex_t *x, const char *glob) {
+	assert(x);
+	assert(glob);
+	x->length = 0;
+	x->anchored = 1;
+	for (;; glob++) {
+		const int pc = x->length;
+		switch (*glob) {
+		case EOI:
+			(void)regexEmit(x, RX_EOL, 0, pc + 1, 0);
+			(void)regexEmit(x, RX_MATCH, 0, 0, 0);
+			return;
+		case '*':
+			(void)regexEmit(x, RX_SPLIT, 0, pc + 2, pc + 1);
+			(void)regexEmit(x, RX_CHAR, ANY, pc, 0);
+			break;
+		case '?':
+			(void)regexEmit(x, RX_CHAR, ANY, pc + 1, 0);
+			break;
+		case '%':
+			if (*++glob == EOI) {
+				(void)regexEmit(x, RX_ERROR, 0, 0, 0);
+				return;
+			}
+			/* fall through */
+		default:
+			(void)regexEmit(x, RX_CHAR, (unsigned char)*glob, pc + 1, 0);
+		}
+	}
+}
+
+/* Compile 'regexp', if 'x->code' is NULL the instructions are only counted.
+ * An invalid pattern is not rejected here, an RX_ERROR instruction is placed
+ * where the pattern goes wrong, so 'reg "a^" ""' does not match instead of
+ * failing as the matcher never gets past the 'a'. */
+static void regexCompile(pickle_regex_t *x, const char *regexp) {
+	assert(x);
+	assert(regexp);
+	if (x->glob) {
+		regexCompileGlob(x, regexp);
+		return;
+	}
+	x->length = 0;
+	if ((x->anchored = regexp[0] == START))
+		regexp++;
+	for (;;) {
+		const int pc = x->length;
+		int r1 = regexEscape((unsigned char)regexp[0], 0), r2 = EOI;
+		if (r1 == EOI) {
+			(void)regexEmit(x, RX_MATCH, 0, 0, 0);
+			return;
+		}
+		if (r1 == START)
+			goto error;
+		if (r1 == ESC) {
+			r1 = regexEscape((unsigned char)regexp[1], 1);
+			if (r1 == EOI)
+				goto error;
+			regexp++;
+		}
+		r2 = regexEscape((unsigned char)regexp[1], 0);
+		if (r2 == MAYBE) {
+			if (x->type == POSSESSIVE) {
+				(void)regexEmit(x, RX_ONCE, r1, pc + 1, 0);
+			} else {
+				const int greedy = x->type == GREEDY;
+				(void)regexEmit(x, RX_SPLIT, 0, greedy ? pc + 1 : pc + 2, greedy ? pc + 2 : pc + 1);
+				(void)regexEmit(x, RX_CHAR, r1, pc + 2, 0);
+			}
+			regexp += 2;
+			continue;
+		}
+		if (r2 == ATLEAST) {
+			(void)regexEmit(x, RX_CHAR, r1, pc + 1, 0);
+			if (x->type == POSSESSIVE) {
+				(void)regexEmit(x, RX_POSSESS, r1, pc + 2, 0);
+			} else {
+				const int greedy = x->type == GREEDY;
+				(void)regexEmit(x, RX_SPLIT, 0, greedy ? pc : pc + 2, greedy ? pc + 2 : pc);
+			}
+			regexp += 2;
+			continue;
+		}
+		if (r2 == MANY) {
+			if (x->type == POSSESSIVE) {
+				(void)regexEmit(x, RX_POSSESS, r1, pc + 1, 0);
+			} else {
+				const int greedy = x->type == GREEDY;
+				(void)regexEmit(x, RX_SPLIT, 0, greedy ? pc + 1 : pc + 2, greedy ? pc + 2 : pc + 1);
+				(void)regexEmit(x, RX_CHAR, r1, pc, 0);
+			}
+			regexp += 2;
+			continue;
+		}
+		if (r1 == END) {
+			if (r2 != EOI)
+				goto error;
+			(void)regexEmit(x, RX_EOL, 0, pc + 1, 0);
+			(void)regexEmit(x, RX_MATCH, 0, 0, 0);
+			return;
+		}
+		(void)regexEmit(x, RX_CHAR, r1, pc + 1, 0);
+		regexp++;
+	}
+error:
+	(void)regexEmit(x, RX_ERROR, 0, 0, 0);
+}
+
+static int picolRegexFree(pickle_t *i, pickle_regex_t *x) {
+	assert(i);
+	return picolFree(i, x);
+}
+
+/* Only the instructions are kept with a compiled pattern, the work space
+ * the matcher needs is shared, see 'picolRegexReserve', so that the block a
+ * pattern needs stays small. */
+static pickle_regex_t *picolRegexCompile(pickle_t *i, const char *regexp, const unsigned type, const unsigned nocase, const unsigned glob) {
+	assert(i);
+	assert(regexp);
+	pickle_regex_t c = { .type = type, .nocase = nocase, .glob = glob };
+	regexCompile(&c, regexp);
+	const size_t n = c.length;
+	assert(n > 0);
+	pickle_regex_t *x = picolMalloc(i, sizeof (c) + (n * sizeof (pickle_regex_op_t)));
+	if (!x)
+		return NULL;
+	*x = c;
+	x->code = (pickle_regex_op_t*)(x + 1);
+	regexCompile(x, regexp);
+	assert((size_t)x->length == n);
+	return x;
+}
+
+/* The matcher work space is grown to fit the longest pattern compiled, its
+ * arrays are allocated separately so that none of them needs a large block.
+ * On failure the old work space, and its capacity, is kept. */
+static int picolRegexReserve(pickle_t *i, pickle_regex_cache_t *c, const int n) {
+	assert(i);
+	assert(c);
+	assert(n > 0);
+	if (n <= c->capacity)
+		return PICKLE_OK;
+	for (size_t j = 0; j < 2; j++) {
+		pickle_regex_thread_t *run = picolRealloc(i, c->run[j], n * sizeof (*run));
+		if (!run)
+			return PICKLE_ERROR;
+		c->run[j] = run;
+	}
+	size_t *mark = picolRealloc(i, c->mark, n * sizeof (*mark));
+	if (!mark)
+		return PICKLE_ERROR;
+	c->mark = mark;
+	int *stack = picolRealloc(i, c->stack, (2 * n + 1) * sizeof (*stack));
+	if (!stack)
+		return PICKLE_ERROR;
+	c->stack = stack;
+	c->capacity = n;
+	return PICKLE_OK;
 }
 
-static int regexStar(pickle_regex_t *x, int depth, int c, const char *regexp, const char *text);
-
-/* search for regexp at beginning of text */
-static int regexHere(pickle_regex_t *x, const int depth, const char *regexp, const char *text) {
-	assert(x);
-	assert(regexp);
-	assert(text);
-	if (x->max && depth > x->max)
-		return -1;
-	int r1 = EOI, r2 = EOI;
-again:
-	r1 = regexEscape(regexp[0], 0);
-	if (r1 == EOI) {
-		x->end = text;
-		return 1;
-	}
-	if (r1 == START)
-		return -1;
-	if (r1 == ESC) {
-		r1 = regexEscape(regexp[1], 1);
-		if (r1 == EOI)
-			return -1;
-		regexp++;
+/* Patterns are looked up in a small cache, keyed on their hash and the
+ * options they are compiled with, so that a 'reg' or 'lsearch' in a loop
+ * compiles its pattern once. Compiling is cheap, unlike scripts every pattern
+ * is cached the first time it is seen. Entries are evicted with the clock
+ * algorithm. The pattern returned is owned by the cache and is valid until
+ * the next lookup. */
+static pickle_regex_t *picolRegexLookup(pickle_t *i, const char *pattern, const unsigned type, const unsigned nocase, const unsigned glob) {
+	assert(i);
+	assert(pattern);
+	pickle_regex_cache_t *c = i->regexes;
+	if (!c) {
+		if (!(c = picolMalloc(i, sizeof (*c))))
+			return NULL;
+		zero(c, sizeof (*c));
+		i->regexes = c;
 	}
-	r2 = regexEscape(regexp[1], 0);
-	if (r2 == MAYBE) {
-		const int is = regexChar(x, r1, *text);
-		if (x->type == GREEDY) {
-			if (is) {
-				const int m = regexHere(x, depth + 1, regexp + 2, text + 1);
-				if (m)
-					return m;
-			}
-			regexp += 2;
-			goto again;
-		} else if (x->type == LAZY) {
-			const int m = regexHere(x, depth + 1, regexp + 2, text);
-			if (m)
-				return m;
-			if (!is)
-				return 0;
-			regexp += 2, text++;
-			goto again;
-		} else {
-			assert(x->type == POSSESSIVE);
-			regexp += 2, text += is;
-			goto again;
+	const size_t n = sizeof (c->entry) / sizeof (c->entry[0]);
+	const size_t length = picolStrlen(pattern);
+	const unsigned long hash = picolHash(pattern, length);
+	for (size_t j = 0; j < n; j++) {
+		pickle_regex_entry_t *e = &c->entry[j];
+		pickle_regex_t *x = e->regex;
+		if (x && e->hash == hash && e->length == length && x->type == type && x->nocase == nocase && x->glob == glob && !memcmp(e->text, pattern, length)) {
+			e->used = 1;
+			c->hits++;
+			return x;
 		}
 	}
-	if (r2 == ATLEAST) {
-		if (!regexChar(x, r1, *text))
-			return 0;
-		return regexStar(x, depth + 1, r1, regexp + 2, text + 1);
+	c->misses++;
+	pickle_regex_t *x = picolRegexCompile(i, pattern, type, nocase, glob);
+	char *copy = x && picolRegexReserve(i, c, x->length) == PICKLE_OK ? picolMalloc(i, length + 1) : NULL;
+	if (!x || !copy) {
+		if (x)
+			(void)picolRegexFree(i, x);
+		(void)picolFree(i, copy);
+		return NULL;
 	}
-	if (r2 == MANY)
-		return regexStar(x, depth + 1, r1, regexp + 2, text);
-	if (r1 == END) {
-		if (r2 != EOI)
-			return -1;
-		return *text == EOI;
+	move(copy, pattern, length + 1);
+	pickle_regex_entry_t *e = NULL;
+	for (;;) {
+		e = &c->entry[c->hand];
+		c->hand = (c->hand + 1) % n;
+		if (!e->used)
+			break;
+		e->used = 0;
 	}
-	if (*text != EOI && regexChar(x, r1, *text)) {
-		regexp++, text++;
-		goto again;
+	(void)picolFree(i, e->text);
+	if (e->regex)
+		(void)picolRegexFree(i, e->regex);
+	e->hash   = hash;
+	e->length = length;
+	e->text   = copy;
+	e->regex  = x;
+	e->used   = 1;
+	return x;
+}
+
+static int picolFreeRegexCache(pickle_t *i) {
+	assert(i);
+	pickle_regex_cache_t *c = i->regexes;
+	if (!c)
+		return PICKLE_OK;
+	int r = PICKLE_OK;
+	for (size_t j = 0; j < sizeof (c->entry) / sizeof (c->entry[0]); j++) {
+		pickle_regex_entry_t *e = &c->entry[j];
+		if (picolFree(i, e->text) != PICKLE_OK)
+			r = PICKLE_ERROR;
+		if (e->regex && picolRegexFree(i, e->regex) != PICKLE_OK)
+			r = PICKLE_ERROR;
 	}
-	return 0;
+	if (picolFree(i, c->run[0]) != PICKLE_OK || picolFree(i, c->run[1]) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFree(i, c->mark) != PICKLE_OK || picolFree(i, c->stack) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFree(i, c) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	i->regexes = NULL;
+	return r;
 }
 
-/* search for c*regexp at beginning of text */
-static int regexStar(pickle_regex_t *x, const int depth, const int c, const char *regexp, const char *text) {
+/* Add a thread for instruction 'pc' to 'list', waiting on the character at
+ * 'pos', following any instructions that do not consume a character. Those
+ * reached first have the higher priority, and an instruction already on the
+ * list is not added again, which is what bounds the work done per character. */
+static void regexAdd(pickle_regex_cache_t *w, pickle_regex_t *x, pickle_regex_thread_t *list, int *count, int pc, const char *text, const size_t pos, const size_t start) {
+	assert(w);
 	assert(x);
-	assert(regexp);
+	assert(list);
+	assert(count);
 	assert(text);
-	if (x->max && depth > x->max)
-		return -1;
-	if (x->type == GREEDY || x->type == POSSESSIVE) {
-		const char *t = NULL;
-		for (t = text; *t != EOI && regexChar(x, c, *t); t++)
-			;
-		if (x->type == POSSESSIVE)
-			return regexHere(x, depth + 1, regexp, t);
-		do {
-			const int m = regexHere(x, depth + 1, regexp, t);
-			if (m)
-				return m;
-		} while (t-- > text);
-		return 0;
+	int *stack = w->stack, top = 0;
+	stack[top++] = pc;
+	while (top) {
+		pc = stack[--top];
+		assert(pc >= 0 && pc < x->length);
+		if (w->mark[pc] == pos + 1)
+			continue;
+		w->mark[pc] = pos + 1;
+		const pickle_regex_op_t *o = &x->code[pc];
+		switch (o->op) {
+		case RX_SPLIT:
+			stack[top++] = o->y;
+			stack[top++] = o->x;
+			break;
+		case RX_EOL:
+			if (text[pos] == EOI)
+				stack[top++] = o->x;
+			break;
+		case RX_POSSESS:
+		case RX_ONCE:
+			if (text[pos] == EOI || !regexChar(x, o->c, (unsigned char)text[pos])) {
+				stack[top++] = o->x;
+				break;
+			}
+			/* fall through */
+		default:
+			list[*count].pc    = pc;
+			list[*count].start = start;
+			(*count)++;
+		}
+		assert(top <= 2 * x->length + 1);
 	}
-	assert(x->type == LAZY);
-	do {    /* a '*' matches zero or more instances */
-		const int m = regexHere(x, depth + 1, regexp, text);
-		if (m)
-			return m;
-	} while (*text != EOI && regexChar(x, c, *text++));
-	return 0;
 }
 
-/* search for regexp anywhere in text */
-static int picolRegexExtract(pickle_regex_t *x, const char *regexp, const char *text) {
+/* search for a match anywhere in text, or only at the start if anchored */
+static int picolRegexExecute(pickle_t *i, pickle_regex_t *x, const char *text, const char **start, const char **end) {
+	assert(i);
 	assert(x);
-	assert(regexp);
 	assert(text);
-	x->start = NULL;
-	x->end   = NULL;
-	if (regexp[0] == START)
-		return regexHere(x, 0, regexp + 1, text);
-	do {    /* must look even if string is empty */
-		const int m = regexHere(x, 0, regexp, text);
-		if (m) {
-			if (m > 0)
-				x->start = text;
-			return m;
-		}
-	} while (*text++ != EOI);
-	x->start = NULL;
-	x->end   = NULL;
-	return 0;
+	assert(start);
+	assert(end);
+	pickle_regex_cache_t *w = i->regexes; /* 'x' came from this cache, so its work space fits */
+	assert(w);
+	assert(w->capacity >= x->length);
+	*start = NULL;
+	*end   = NULL;
+	zero(w->mark, x->length * sizeof (w->mark[0]));
+	pickle_regex_thread_t *run = w->run[0], *next = w->run[1];
+	int r = 0, count = 0;
+	for (size_t pos = 0;; pos++) {
+		if (!r && (!x->anchored || pos == 0)) /* try a match starting here, last as it has the lowest priority */
+			regexAdd(w, x, run, &count, 0, text, pos, pos);
+		if (!count && (r || x->anchored))
+			break;
+		int added = 0;
+		const int ch = (unsigned char)text[pos];
+		for (int j = 0; j < count; j++) {
+			const pickle_regex_thread_t *t = &run[j];
+			const pickle_regex_op_t *o = &x->code[t->pc];
+			switch (o->op) {
+			case RX_CHAR:
+				if (ch != EOI && regexChar(x, o->c, ch))
+					regexAdd(w, x, next, &added, o->x, text, pos + 1, t->start);
+				break;
+			case RX_POSSESS: /* only on the list if it matched the character */
+				regexAdd(w, x, next, &added, t->pc, text, pos + 1, t->start);
+				break;
+			case RX_ONCE:
+				regexAdd(w, x, next, &added, o->x, text, pos + 1, t->start);
+				break;
+			case RX_MATCH:
+			case RX_ERROR:
+				r = o->op == RX_MATCH ? 1 : -1;
+				*start = text + t->start;
+				*end   = text + pos;
+				j = count; /* the threads that follow have a lower priority */
+				break;
+			default:
+				assert(0);
+			}
+		}
+		if (ch == EOI)
+			break;
+		pickle_regex_thread_t *swap = run;
+		run = next;
+		next = swap;
+		count = added;
+	}
+	if (r <= 0) {
+		*start = NULL;
+		*end   = NULL;
+	}
+	return r;
 }
 
-static int picolRegex(const char *regexp, const char *text) {
+/* 'picolRegex' and 'picolGlob' return 1 on a match, 0 on no match, -1 for
+ * an invalid pattern and -2 if the pattern could not be compiled for lack of
+ * memory, in which case the result has already been set. */
+static int picolRegex(pickle_t *i, const char *regexp, const char *text) {
+	assert(i);
 	assert(regexp);
 	assert(text);
-	pickle_regex_t x = { NULL, NULL, PICKLE_MAX_RECURSION, LAZY, 0 };
-	return picolRegexExtract(&x, regexp, text);
+	pickle_regex_t *x = picolRegexLookup(i, regexp, LAZY, 0, 0);
+	if (!x)
+		return -2;
+	const char *start = NULL, *end = NULL;
+	return picolRegexExecute(i, x, text, &start, &end);
+}
+
+static int picolGlob(pickle_t *i, const char *pattern, const char *str) {
+	assert(i);
+	assert(pattern);
+	assert(str);
+	pickle_regex_t *x = picolRegexLookup(i, pattern, LAZY, 0, 1);
+	if (!x)
+		return -2;
+	const char *start = NULL, *end = NULL;
+	return picolRegexExecute(i, x, str, &start, &end);
 }
 
 static inline int picolCommandRegex(pickle_t *i, const int argc, char **argv, void *pd) {
@@ -3313,18 +5597,21 @@ static inline int picolCommandRegex(pickle_t *i, const int argc, char **argv, vo
 			index = l;
 		string += index;
 	}
-	pickle_regex_t x = { NULL, NULL, PICKLE_MAX_RECURSION, type, nocase };
-	mutual(x.start, x.end);
-	const int r = picolRegexExtract(&x, pattern, string);
+	pickle_regex_t *x = picolRegexLookup(i, pattern, type, nocase, 0);
+	if (!x)
+		return PICKLE_ERROR;
+	const char *from = NULL, *to = NULL;
+	const int r = picolRegexExecute(i, x, string, &from, &to);
+	mutual(from, to);
 	if (r < 0)
 		return pickle_set_result_error(i, "Invalid regex %s", pattern);
 	if (r == 0)
 		return pickle_set_result_string(i, "-1 -1");
-	assert(x.start);
-	assert(x.end);
-	implies(x.start, x.start >= orig);
-	implies(x.end,   x.end   >= x.start);
-	number_t start = x.start - orig, end = x.end - orig;
+	assert(from);
+	assert(to);
+	implies(from, from >= orig);
+	implies(to,   to   >= from);
+	number_t start = from - orig, end = to - orig;
 	end -= (end != start);
 	return pickle_set_result(i, "%ld %ld", (long)start, (long)end);
 }
@@ -3364,6 +5651,7 @@ static int picolRegisterCoreCommands(pickle_t *i) {
 		{ "upvar",     picolCommandUpVar,     NULL },
 		{ "while",     picolCommandWhile,     NULL },
 		{ "apply",     picolCommandApply,     NULL },
+		{ "append",    picolCommandAppend,    NULL },
 	};
 	if (DEFINE_REGEX) {
 		if (picolRegisterCommand(i, "reg", picolCommandRegex, NULL) != PICKLE_OK)
@@ -3412,22 +5700,30 @@ static int picolRegisterCoreCommands(pickle_t *i) {
 	return picolSetVarInteger(i, "version", VERSION);
 }
 
+static int picolFreeProc(pickle_t *i, pickle_proc_t *proc) {
+	assert(i);
+	if (!proc)
+		return PICKLE_OK;
+	int r = PICKLE_OK;
+	if (picolFree(i, proc->args) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFree(i, proc->body) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFreeProgram(i, proc->program) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFree(i, proc) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	return r;
+}
+
 static int picolFreeCmd(pickle_t *i, pickle_command_t *p) {
 	assert(i);
 	if (!p)
 		return PICKLE_OK;
 	int r = PICKLE_OK;
-	if (picolIsDefinedProc(p->func)) {
-		char **procdata = (char**) p->privdata;
-		if (procdata) {
-			if (picolFree(i, procdata[0]) != PICKLE_OK)
-				r = PICKLE_ERROR;
-			if (picolFree(i, procdata[1]) != PICKLE_OK)
-				r = PICKLE_ERROR;
-		}
-		if (picolFree(i, procdata) != PICKLE_OK)
+	if (picolIsDefinedProc(p->func))
+		if (picolFreeProc(i, p->privdata) != PICKLE_OK)
 			r = PICKLE_ERROR;
-	}
 	if (picolFree(i, p->name) != PICKLE_OK)
 		r = PICKLE_ERROR;
 	if (picolFree(i, p) != PICKLE_OK)
@@ -3442,6 +5738,12 @@ static int picolDeinitialize(pickle_t *i) {
 	int r = PICKLE_OK;
 	if (picolFreeResult(i) != PICKLE_OK)
 		r = PICKLE_ERROR;
+	if (picolFreeCache(i) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFreeScratch(i) != PICKLE_OK)
+		r = PICKLE_ERROR;
+	if (picolFreeRegexCache(i) != PICKLE_OK)
+		r = PICKLE_ERROR;
 	for (long j = 0; j < i->length; j++) {
 		pickle_command_t *c = i->table[j], *p = NULL;
 		for (; c; p = c, c = c->next) {
@@ -3454,6 +5756,8 @@ static int picolDeinitialize(pickle_t *i) {
 	}
 	if (picolFree(i, i->table) != PICKLE_OK)
 		r = PICKLE_ERROR;
+	if (picolFreeProfiles(i) != PICKLE_OK)
+		r = PICKLE_ERROR;
 	zero(i, sizeof *i);
 	return r;
 }
@@ -3465,10 +5769,11 @@ static int picolInitialize(pickle_t *i, const pickle_allocator_t *a) {
 	/*'i' may contain junk, otherwise: assert(!(i->initialized));*/
 	const size_t hbytes = PICKLE_MAX_STRING;
 	const size_t helem  = hbytes / sizeof (*i->table);
+	BUILD_BUG_ON((PICKLE_MAX_STRING / sizeof (*i->table)) & ((PICKLE_MAX_STRING / sizeof (*i->table)) - 1));
 	zero(i, sizeof *i);
 	i->initialized   = 1;
 	i->allocator     = *a;
-	i->callframe     = i->allocator.malloc(i->allocator.arena, sizeof(*i->callframe));
+	i->callframe     = picolNewCallFrame(i, NULL, NULL);
 	i->result        = string_empty;
 	i->static_result = 1;
 	i->table         = picolMalloc(i, hbytes); /* NB. We could make this configurable, for little gain. */
@@ -3476,7 +5781,6 @@ static int picolInitialize(pickle_t *i, const pickle_allocator_t *a) {
 	if (!(i->callframe) || !(i->result) || !(i->table))
 		goto fail;
 	zero(i->table,     hbytes);
-	zero(i->callframe, sizeof(*i->callframe));
 	i->length = helem;
 	if (picolRegisterCoreCommands(i) != PICKLE_OK)
 		goto fail;
@@ -3583,6 +5887,36 @@ static inline int concatenateTest(pickle_t *i, char *result, char *join, int arg
 	return r;
 }
 
+static inline int picolTestCanonicalNumber(void) {
+	static const struct test_t {
+		int canonical;
+		number_t number;
+		const char *string;
+	} ts[] = {
+		{ 1,   0,   "0"    },
+		{ 1,   12,  "12"   },
+		{ 1,  -12,  "-12"  },
+		{ 0,   0,   "00"   },
+		{ 0,   0,   "-0"   },
+		{ 0,   0,   "+1"   },
+		{ 0,   0,   "012"  },
+		{ 0,   0,   ""     },
+		{ 0,   0,   "-"    },
+		{ 0,   0,   "1a"   },
+		{ 0,   0,   " 1"   },
+		{ 0,   0,   "99999999999999999999999" },
+	};
+
+	int r = 0;
+	for (size_t i = 0; i < sizeof(ts)/sizeof(ts[0]); i++) {
+		number_t n = 0;
+		const int c = picolIsCanonicalNumber(ts[i].string, &n);
+		if (c != ts[i].canonical || (c && n != ts[i].number))
+			r = -(int)(i+1);
+	}
+	return r;
+}
+
 static inline int picolTestConcat(void) {
 	int r = 0;
 	pickle_t *p = NULL;
@@ -3617,6 +5951,278 @@ static inline int picolTestEval(void) {
 	return r;
 }
 
+static inline int picolTestCompile(void) { /* compiled programs must behave as evaluated text does */
+	static const char *ts[] = {
+		"+  2 2",
+		"set a 3; set b \"x$a$a y\"",
+		"set a [+ 1 [* 2 3]]z; concat $a",
+		"set a 1\n# comment\n set b {$a [x]}",
+		"set \\x41 \\x41\\x42; set A",
+		"set a 1; set a [",
+		"set a 2; set b \\x; set c 3",
+		"set a 3; set b $undefined; set c 4",
+		"return fail -1",
+		"",
+	};
+
+	int r = 0;
+	for (size_t i = 0; i < sizeof(ts)/sizeof(ts[0]); i++) {
+		pickle_t *p = NULL, *q = NULL;
+		pickle_program_t *program = NULL;
+		if (pickle_new(&p, NULL) != PICKLE_OK || pickle_new(&q, NULL) != PICKLE_OK) {
+			r = r ? r : -1001;
+			goto end;
+		}
+		if (!(program = picolCompile(q, ts[i]))) {
+			r = r ? r : -2001;
+			goto end;
+		}
+		pickle_parser_opts_t o = { 0, 0, 0, 0 }; /* no options, so it is not cached */
+		const int e1 = picolEvalAndSubst(p, &o, ts[i]), e2 = picolEvalProgram(q, program);
+		if (e1 != e2 || compare(p->result, q->result))
+			r = r ? r : -(int)(i+1);
+	end:
+		if (program && picolFreeProgram(q, program) != PICKLE_OK)
+			r = r ? r : -3001;
+		if (p && pickle_delete(p) != PICKLE_OK)
+			r = r ? r : -4001;
+		if (q && pickle_delete(q) != PICKLE_OK)
+			r = r ? r : -4001;
+	}
+	return r;
+}
+
+static inline int picolTestCache(void) {
+	if (!PICKLE_MAX_CACHE)
+		return 0;
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
+	int r = 0;
+	char script[] = "incr a 1";
+	if (pickle_set_var_string(p, "a", "0") != PICKLE_OK)
+		r = r ? r : -2;
+	for (int j = 1; j <= 4; j++) {
+		if (picolEval(p, script) != PICKLE_OK || compare(p->result, j == 1 ? "1" : j == 2 ? "2" : j == 3 ? "3" : "4"))
+			r = r ? r : -3;
+	}
+	if (!p->cache || p->cache->hits != 2 || p->cache->misses != 2)
+		r = r ? r : -4;
+	script[7] = '5'; /* same pointer, different contents, must not hit */
+	if (picolEval(p, script) != PICKLE_OK || compare(p->result, "9"))
+		r = r ? r : -5;
+	if (p->cache && p->cache->hits != 2)
+		r = r ? r : -6;
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -7;
+	return r;
+}
+
+static int picolTestProfileCount(void *param, const char *name, unsigned long calls, unsigned long long inclusive, unsigned long long exclusive, unsigned long allocs) {
+	UNUSED(allocs);
+	if (!compare(name, "f"))
+		*(unsigned long*)param = calls;
+	return exclusive <= inclusive ? PICKLE_OK : PICKLE_ERROR;
+}
+
+static inline int picolTestProfile(void) {
+	if (!DEFINE_PROFILER)
+		return 0;
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
+	int r = 0;
+	unsigned long calls = 0;
+	if (pickle_profile(p, 1) != PICKLE_OK)
+		r = r ? r : -2;
+	if (picolEval(p, "proc f {x} { if {> $x 0} { f [- $x 1] } }; f 3; rename f g") != PICKLE_OK)
+		r = r ? r : -3;
+	if (picolEval(p, "proc f {} {}; f") != PICKLE_OK) /* statistics of deleted commands are not reported */
+		r = r ? r : -4;
+	if (pickle_profile_dump(p, picolTestProfileCount, &calls) != PICKLE_OK || calls != 1)
+		r = r ? r : -5;
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -6;
+	return r;
+}
+
+static inline int picolTestScratch(void) { /* arguments are built in the scratch arena, values escape it */
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
+	int r = 0;
+	static const char *loop = "set j 0; while {< $j 10} { incr j }";
+	if (picolEval(p, loop) != PICKLE_OK || picolEval(p, loop) != PICKLE_OK)
+		r = r ? r : -2;
+	const unsigned long allocs = p->allocs;
+	if (picolEval(p, loop) != PICKLE_OK || p->allocs != allocs)
+		r = r ? r : -3;
+	if (picolEval(p, "set a {a literal long enough to be shared}; set b \"$a, $a\"; set c [set a]") != PICKLE_OK)
+		r = r ? r : -4;
+	if (picolEval(p, "set x {overwrites the arena}; set y \"$x $x $x\"") != PICKLE_OK)
+		r = r ? r : -5;
+	const char *a = NULL, *b = NULL, *c = NULL;
+	if (pickle_get_var_string(p, "a", &a) != PICKLE_OK || compare(a, "a literal long enough to be shared"))
+		r = r ? r : -6;
+	if (pickle_get_var_string(p, "b", &b) != PICKLE_OK || compare(b, "a literal long enough to be shared, a literal long enough to be shared"))
+		r = r ? r : -7;
+	if (pickle_get_var_string(p, "c", &c) != PICKLE_OK || compare(c, a))
+		r = r ? r : -8;
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -9;
+	return r;
+}
+
+static int picolTestSampleFind(void *param, const char *stack, unsigned long count) {
+	if (!compare(stack, "f") && count == 1) /* the next command run is sampled */
+		*(int*)param = 1;
+	return PICKLE_OK;
+}
+
+static inline int picolTestSample(void) {
+	if (!DEFINE_PROFILER)
+		return 0;
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
+	int r = 0, found = 0;
+	if (pickle_sampling(p, 1) != PICKLE_OK)
+		r = r ? r : -2;
+	if (picolEval(p, "proc g {} { set x 1 }; proc f {} { g }") != PICKLE_OK)
+		r = r ? r : -3;
+	pickle_sample(p); /* as a timer signal would */
+	if (picolEval(p, "f") != PICKLE_OK)
+		r = r ? r : -4;
+	if (pickle_sample_dump(p, picolTestSampleFind, &found) != PICKLE_OK || !found)
+		r = r ? r : -5;
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -6;
+	return r;
+}
+
+static inline int picolTestList(void) { /* a list made by joining must match one parsed from the result */
+	static const char *ts[] = {
+		"a b c",
+		"a {b c} d",
+		"  x\ty\n z ",
+		"a \"b c\" [d e] $f",
+		"{} a",
+		"",
+	};
+	static const char *inserts[] = { "q", "y z", "", "[x]", "a$b" };
+
+	int r = 0;
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1001;
+	for (size_t i = 0; i < sizeof(ts)/sizeof(ts[0]); i++) {
+		for (size_t j = 0; j < sizeof(inserts)/sizeof(inserts[0]); j++) {
+			pickle_list_t *l = picolListParse(p, ts[i]), *m = NULL, *n = NULL;
+			char *s = NULL;
+			if (!l) {
+				r = r ? r : -2001;
+				continue;
+			}
+			const pickle_list_edit_t e = {
+				.s = ts[i], .l = l, .to = l->length, .at = l->length / 2, .reverse = j & 1,
+				.insert = { .s = inserts[j], .length = picolStrlen(inserts[j]), .escape = 1 },
+			};
+			if (!(s = picolListJoin(p, &e, &m)) || !(n = picolListParse(p, s))) {
+				r = r ? r : -3001;
+			} else if (n->length != picolListEditLength(&e)) {
+				r = r ? r : -(int)(i+1);
+			} else if (m) {
+				for (int k = 0; k < n->length; k++)
+					if (m->span[k].offset != n->span[k].offset || m->span[k].length != n->span[k].length)
+						r = r ? r : -(int)(i+1);
+			}
+			(void)picolFree(p, s);
+			(void)picolFree(p, l);
+			(void)picolFree(p, m);
+			(void)picolFree(p, n);
+		}
+	}
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -4001;
+	return r;
+}
+
+static inline int picolTestSharedString(void) { /* values passed around are shared, not copied */
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
+	int r = 0;
+	const char *a = NULL, *b = NULL, *c = NULL;
+	if (pickle_eval(p, "set a [string repeat abc 100]; proc f {x} { set y $x; return $y }; set b [f $a]; set c $b; set c $c.") != PICKLE_OK)
+		r = r ? r : -2;
+	if (pickle_get_var_string(p, "a", &a) != PICKLE_OK || pickle_get_var_string(p, "b", &b) != PICKLE_OK || pickle_get_var_string(p, "c", &c) != PICKLE_OK)
+		r = r ? r : -3;
+	if (!r && a != b)
+		r = -4;
+	if (!r && (a == c || picolStrlen(a) != 300 || picolStrlen(c) != 301))
+		r = -5;
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -6;
+	return r;
+}
+
+static int picolTestUpper(pickle_t *i, int argc, char **argv, void *pd) { /* writes to its argument, as an embedder's command may */
+	UNUSED(pd);
+	if (argc != 2)
+		return pickle_set_result_error_arity(i, 2, argc, argv);
+	for (char *s = argv[1]; *s; s++)
+		if (*s >= 'a' && *s <= 'z')
+			*s -= 'a' - 'A';
+	return pickle_set_result_string(i, argv[1]);
+}
+
+static inline int picolTestForeignArgs(void) { /* a registered command gets its own copy of a shared argument */
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
+	int r = 0;
+	const char *a = NULL, *b = NULL, *c = NULL;
+	if (pickle_register_command(p, "upper", picolTestUpper, NULL) != PICKLE_OK)
+		r = r ? r : -2;
+	if (pickle_eval(p, "set a [string repeat abc 100]; set b [upper $a]; rename upper up; set c [up [set a]]") != PICKLE_OK)
+		r = r ? r : -3;
+	if (pickle_get_var_string(p, "a", &a) != PICKLE_OK || pickle_get_var_string(p, "b", &b) != PICKLE_OK || pickle_get_var_string(p, "c", &c) != PICKLE_OK)
+		r = r ? r : -4;
+	if (!r && (picolStrlen(a) != 300 || compare(a + 297, "abc") || picolStrlen(b) != 300 || compare(b + 297, "ABC") || compare(b, c)))
+		r = -5;
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -6;
+	return r;
+}
+
+static inline int picolTestVarTable(void) { /* variables must survive the table growing, and others being removed */
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
+	int r = 0;
+	char name[32] = { 0 }, script[64] = { 0 };
+	for (int j = 0; j < 100; j++) {
+		snprintf(name, sizeof name, "v%d", j);
+		if (pickle_set_var_string(p, name, name) != PICKLE_OK)
+			r = r ? r : -2;
+	}
+	for (int j = 0; j < 100; j += 3) {
+		snprintf(script, sizeof script, "unset v%d", j);
+		if (pickle_eval(p, script) != PICKLE_OK)
+			r = r ? r : -3;
+	}
+	for (int j = 0; j < 100; j++) {
+		const char *val = NULL;
+		snprintf(name, sizeof name, "v%d", j);
+		const int e = pickle_get_var_string(p, name, &val);
+		if ((j % 3) == 0 ? e == PICKLE_OK : (e != PICKLE_OK || compare(val, name)))
+			r = r ? r : -(j + 10);
+	}
+	if (pickle_delete(p) != PICKLE_OK)
+		r = r ? r : -4;
+	return r;
+}
+
 static inline int picolTestLineNumber(void) {
 	static const struct test_t {
 		int line;
@@ -3738,33 +6344,52 @@ static inline int picolTestParser(void) {
 }
 
 static int picolTestRegex(void) {
+	pickle_t *p = NULL;
+	if (pickle_new(&p, NULL) != PICKLE_OK || !p)
+		return -1;
 	int r = 0;
-	r += !(1 == picolRegex("a", "bba"));
-	r += !(1 == picolRegex(".", "x"));
-	r += !(1 == picolRegex("\\.", "."));
-	r += !(0 == picolRegex("\\.", "x"));
-	r += !(0 == picolRegex(".", ""));
-	r += !(0 == picolRegex("a", "b"));
-	r += !(1 == picolRegex("^a*b$", "b"));
-	r += !(0 == picolRegex("^a*b$", "bx"));
-	r += !(1 == picolRegex("a*b", "b"));
-	r += !(1 == picolRegex("a*b", "ab"));
-	r += !(1 == picolRegex("a*b", "aaaab"));
-	r += !(1 == picolRegex("a*b", "xaaaab"));
-	r += !(0 == picolRegex("^a*b", "xaaaab"));
-	r += !(1 == picolRegex("a*b", "xaaaabx"));
-	r += !(1 == picolRegex("a*b", "xaaaaxb"));
-	r += !(0 == picolRegex("a*b", "xaaaax"));
-	r += !(0 == picolRegex("a$", "ab"));
-	r += !(1 == picolRegex("a*", ""));
-	r += !(1 == picolRegex("a*", "a"));
-	r += !(1 == picolRegex("a*", "aa"));
-	r += !(1 == picolRegex("a+", "a"));
-	r += !(0 == picolRegex("a+", ""));
-	r += !(1 == picolRegex("ca?b", "cab"));
-	r += !(1 == picolRegex("ca?b", "cb"));
-	r += !(1 == picolRegex("\\sz", " \t\r\nz"));
-	r += !(0 == picolRegex("\\s", "x"));
+	r += !(1 == picolRegex(p, "a", "bba"));
+	r += !(1 == picolRegex(p, ".", "x"));
+	r += !(1 == picolRegex(p, "\\.", "."));
+	r += !(0 == picolRegex(p, "\\.", "x"));
+	r += !(0 == picolRegex(p, ".", ""));
+	r += !(0 == picolRegex(p, "a", "b"));
+	r += !(1 == picolRegex(p, "^a*b$", "b"));
+	r += !(0 == picolRegex(p, "^a*b$", "bx"));
+	r += !(1 == picolRegex(p, "a*b", "b"));
+	r += !(1 == picolRegex(p, "a*b", "ab"));
+	r += !(1 == picolRegex(p, "a*b", "aaaab"));
+	r += !(1 == picolRegex(p, "a*b", "xaaaab"));
+	r += !(0 == picolRegex(p, "^a*b", "xaaaab"));
+	r += !(1 == picolRegex(p, "a*b", "xaaaabx"));
+	r += !(1 == picolRegex(p, "a*b", "xaaaaxb"));
+	r += !(0 == picolRegex(p, "a*b", "xaaaax"));
+	r += !(0 == picolRegex(p, "a$", "ab"));
+	r += !(1 == picolRegex(p, "a*", ""));
+	r += !(1 == picolRegex(p, "a*", "a"));
+	r += !(1 == picolRegex(p, "a*", "aa"));
+	r += !(1 == picolRegex(p, "a+", "a"));
+	r += !(0 == picolRegex(p, "a+", ""));
+	r += !(1 == picolRegex(p, "ca?b", "cab"));
+	r += !(1 == picolRegex(p, "ca?b", "cb"));
+	r += !(1 == picolRegex(p, "\\sz", " \t\r\nz"));
+	r += !(0 == picolRegex(p, "\\s", "x"));
+	r += !(1 == picolRegex(p, "^ab", "abc"));
+	r += !(0 == picolRegex(p, "^b", "abc"));
+	r += !(1 == picolRegex(p, "$", "abc"));
+	r += !(1 == picolRegex(p, "c$", "abc"));
+	r += !(-1 == picolRegex(p, "\\", "abc"));
+	r += !(-1 == picolRegex(p, "a^", "a"));
+	r += !(0 == picolRegex(p, "a^", "b"));
+	r += !(0 == picolRegex(p, "a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*a*b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"));
+	const unsigned long hits = p->regexes ? p->regexes->hits : 0;
+	r += !(1 == picolRegex(p, "a", "bba"));
+	r += !(1 == picolGlob(p, "a", "a"));
+	r += !(!p->regexes || p->regexes->hits != hits + 1);
+	r += !(0 == picolGlob(p, "\xd2", "x")); /* not confused with an operator */
+	r += !(-1 == picolGlob(p, "%", ""));
+	if (pickle_delete(p) != PICKLE_OK)
+		r++;
 	return -r;
 }
 
@@ -3812,7 +6437,9 @@ int pickle_set_result_string(pickle_t *i, const char *s) {
 	}
 	move(r, s, sl);
 	const int fr = picolFreeResult(i);
-	i->static_result = is_static;
+	i->static_result  = is_static;
+	i->result_numeric = 0;
+	i->result_shared  = 0;
 	i->result = r;
 	return post(i, fr);
 }
@@ -3842,34 +6469,60 @@ int pickle_register_command(pickle_t *i, const char *name, pickle_command_func_t
 	pre(i);
 	assert(name);
 	assert(func);
-	return post(i, picolRegisterCommand(i, name, func, privdata));
+	const int r = picolRegisterCommand(i, name, func, privdata);
+	if (r == PICKLE_OK)
+		picolGetCommand(i, name)->foreign = 1;
+	return post(i, r);
 }
 
-int pickle_set_var_string(pickle_t *i, const char *name, const char *val) {
-	pre(i);
+/* 'number', if not NULL, is the numeric value of 'val' if it has one, and
+ * if 'shared' is set 'val' is a reference counted string */
+static int picolSetVar(pickle_t *i, const char *name, const char *val, const int shared, const pickle_arg_t *number) {
+	assert(i);
 	assert(name);
 	assert(val);
 	pickle_var_t *v = picolGetVar(i, name, 1);
 	if (v) {
+		if (shared && v->type == PV_STRING && v->data.val.ptr == val)
+			goto number; /* 'set a $a' */
 		picolFreeVarVal(i, v);
-		if (picolSetVarString(i, v, val) != PICKLE_OK)
-			return post(i, PICKLE_ERROR);
+		if ((shared ? picolSetVarShared(i, v, val) : picolSetVarString(i, v, val)) != PICKLE_OK)
+			return PICKLE_ERROR;
 	} else {
 		if (!(v = picolMalloc(i, sizeof(*v))))
-			return post(i, PICKLE_ERROR);
+			return PICKLE_ERROR;
 		zero(v, sizeof *v);
+		v->hash = picolHashString(name);
 		const int r1 = picolSetVarName(i, v, name);
-		const int r2 = picolSetVarString(i, v, val);
-		if (r1 != PICKLE_OK || r2 != PICKLE_OK) {
+		const int r2 = shared ? picolSetVarShared(i, v, val) : picolSetVarString(i, v, val);
+		if (r1 != PICKLE_OK || r2 != PICKLE_OK || picolAddVar(i, i->callframe, v, -1) != PICKLE_OK) {
 			(void)picolFreeVarName(i, v);
 			(void)picolFreeVarVal(i, v);
 			(void)picolFree(i, v);
-			return post(i, PICKLE_ERROR);
+			return PICKLE_ERROR;
 		}
-		v->next = i->callframe->vars;
-		i->callframe->vars = v;
 	}
-	return post(i, PICKLE_OK);
+number:
+	if (number && number->numeric) {
+		v->number  = number->number;
+		v->numeric = 1;
+	}
+	return PICKLE_OK;
+}
+
+/* Set variable 'name' to 'argv[j]', along with its number if known */
+static int picolSetVarArg(pickle_t *i, const char *name, char **argv, const int j) {
+	assert(i);
+	assert(argv);
+	const int shared = i->argv == argv;
+	return picolSetVar(i, name, argv[j], shared, shared && i->args ? &i->args[j] : NULL);
+}
+
+int pickle_set_var_string(pickle_t *i, const char *name, const char *val) {
+	pre(i);
+	assert(name);
+	assert(val);
+	return post(i, picolSetVar(i, name, val, 0, NULL));
 }
 
 int pickle_get_var_string(pickle_t *i, const char *name, const char **val) {
@@ -3889,13 +6542,12 @@ int pickle_get_var_integer(pickle_t *i, const char *name, long *val) {
 	assert(name);
 	assert(val);
 	*val = 0;
-	const char *s = NULL;
-	const int retcode = pickle_get_var_string(i, name, &s);
-	if (!s || retcode != PICKLE_OK)
+	pickle_var_t *v = picolGetVar(i, name, 1);
+	if (!v)
 		return post(i, PICKLE_ERROR);
-	number_t v = 0;
-	const int r = picolStringToNumber(i, s, &v);
-	*val = v;
+	number_t n = 0;
+	const int r = picolVarToNumber(i, v, &n);
+	*val = n;
 	return post(i, r);
 }
 
@@ -3951,7 +6603,8 @@ int pickle_eval(pickle_t *i, const char *t) {
 	assert(t);
 	i->line = 1;
 	i->ch   = t;
-	return picolEval(i, t); /* may return any int */
+	pickle_parser_opts_t o = { 0, 0, 0, 0 }; /* top level scripts are not cached, so line numbers are tracked */
+	return picolEvalAndSubst(i, &o, t); /* may return any int */
 }
 
 /* Arity error messages could be improved by allowing a string to describe the allowed arguments */
@@ -3980,10 +6633,10 @@ int pickle_rename_command(pickle_t *i, const char *src, const char *dst) {
 		return post(i, pickle_set_result_error(i, "Invalid proc %s", src));
 	int r = PICKLE_ERROR;
 	if (picolIsDefinedProc(np->func)) {
-		char **procdata = (char**)np->privdata;
-		r = picolCommandAddProc(i, dst, procdata[0], procdata[1], np->func == picolCommandCallVariadic);
-	} else {
-		r = pickle_register_command(i, dst, np->func, np->privdata);
+		pickle_proc_t *proc = np->privdata;
+		r = picolCommandAddProc(i, dst, proc->args, proc->body, np->func == picolCommandCallVariadic);
+	} else if ((r = picolRegisterCommand(i, dst, np->func, np->privdata)) == PICKLE_OK) {
+		picolGetCommand(i, dst)->foreign = np->foreign;
 	}
 	if (r != PICKLE_OK)
 		return post(i, r);
@@ -4003,6 +6656,48 @@ int pickle_set_argv(pickle_t *i, int argc, char **argv) {
 	return post(i, r);
 }
 
+int pickle_profile(pickle_t *i, const int on) {
+	pre(i);
+	if (on && !DEFINE_PROFILER)
+		return post(i, PICKLE_ERROR);
+	if (on && !i->profiling)
+		picolProfileClear(i);
+	i->profiling = !!on;
+	return post(i, PICKLE_OK);
+}
+
+int pickle_profile_dump(pickle_t *i, pickle_profile_func_t f, void *param) {
+	pre(i);
+	assert(f);
+	return post(i, picolProfileForEach(i, f, param));
+}
+
+int pickle_sampling(pickle_t *i, const int on) {
+	pre(i);
+	if (on && !i->sampling)
+		if (picolFreeSamples(i) != PICKLE_OK)
+			return post(i, PICKLE_ERROR);
+	i->sample   = 0;
+	i->sampling = !!on;
+	return post(i, PICKLE_OK);
+}
+
+void pickle_sample(pickle_t *i) { /* called from signal handlers, so no assertions */
+	if (i)
+		i->sample = 1;
+}
+
+int pickle_sample_dump(pickle_t *i, pickle_sample_func_t f, void *param) {
+	pre(i);
+	assert(f);
+	if (i->samples)
+		for (size_t j = 0; j < PICKLE_SAMPLE_BUCKETS; j++)
+			for (pickle_sample_t *s = i->samples[j]; s; s = s->next)
+				if (f(param, s->stack, s->count) != PICKLE_OK)
+					return post(i, PICKLE_ERROR);
+	return post(i, PICKLE_OK);
+}
+
 int pickle_concatenate(pickle_t *i, int argc, char **argv, char **cat) {
 	assert(argc >= 0);
 	implies(argc > 0, argv);
@@ -4073,8 +6768,18 @@ int pickle_tests(void) {
 		picolTestSmallString,
 		picolTestUnescape,
 		picolTestConvertNumber,
+		picolTestCanonicalNumber,
 		picolTestConcat,
 		picolTestEval,
+		picolTestCompile,
+		picolTestCache,
+		picolTestProfile,
+		picolTestSample,
+		picolTestScratch,
+		picolTestList,
+		picolTestSharedString,
+		picolTestForeignArgs,
+		picolTestVarTable,
 		picolTestGetSetVar,
 		picolTestLineNumber,
 		picolTestParser,
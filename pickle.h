@@ -29,6 +29,8 @@ typedef struct {
 struct pickle_interpreter;
 typedef struct pickle_interpreter pickle_t;
 typedef int (*pickle_command_func_t)(pickle_t *i, int argc, char **argv, void *privdata);
+typedef int (*pickle_profile_func_t)(void *param, const char *name, unsigned long calls, unsigned long long inclusive_ns, unsigned long long exclusive_ns, unsigned long allocs);
+typedef int (*pickle_sample_func_t)(void *param, const char *stack, unsigned long count);
 
 enum { PICKLE_ERROR = -1, PICKLE_OK, PICKLE_RETURN, PICKLE_BREAK, PICKLE_CONTINUE };
 
@@ -41,6 +43,12 @@ PICKLE_API int pickle_register_command(pickle_t *i, const char *name, pickle_com
 PICKLE_API int pickle_rename_command(pickle_t *i, const char *src, const char *dst); /* if 'dst' is "" then command is deleted */
 PICKLE_API int pickle_set_argv(pickle_t *i, int argc, char **argv);
 
+PICKLE_API int pickle_profile(pickle_t *i, int on); /* turn per command profiling on or off, turning it on clears previous results */
+PICKLE_API int pickle_profile_dump(pickle_t *i, pickle_profile_func_t f, void *param); /* 'f' is called for each command called whilst profiling */
+PICKLE_API int pickle_sampling(pickle_t *i, int on); /* turn the sampling profiler on or off, turning it on clears previous samples */
+PICKLE_API void pickle_sample(pickle_t *i); /* safe to call from a signal handler, the stack is recorded at the next command */
+PICKLE_API int pickle_sample_dump(pickle_t *i, pickle_sample_func_t f, void *param); /* 'f' is called for each stack, as "outer;inner;command" */
+
 PICKLE_API int pickle_concatenate(pickle_t *i, int argc, char **argv, char **cat); /* returned in 'cat', caller frees */
 PICKLE_API int pickle_allocate(pickle_t *i, void **v, size_t size); /* zeroes allocated memory */
 PICKLE_API int pickle_free(pickle_t *i, void **v);
@@ -305,7 +305,25 @@ test 0 {mod 12 12}
 test 1 {mod 13 12}
 test -3 {negate 3}
 test 3 {negate -3}
+test 1 {set n 00; incr n}
+test 1 {set n -0; + $n 1}
+test b {set n [+ 0 0]; if {set n} { return a 0 } else { return b 0 }}
+test a {set n 00; if {set n} { return a 0 } else { return b 0 }}
+test 7 {proc p4 {x} { + $x 1 }; set n [p4 [+ 3 3]]; rename p4 ""; set n}
+test abababab {set s [string repeat ab 4]; set s $s}
+test abababab-x {set s [string repeat ab 4]; set s $s-x}
+test {zz abababab} {proc p5 {v x} { upvar 1 $v r; set r zz; list $r $x }; set s [string repeat ab 4]; set n [p5 s $s]; rename p5 ""; set n}
+test {abababababababab q} {proc p6 {} { set s [string repeat ab 4]; set s $s; set t $s$s; set s q; list $t $s }; set n [p6]; rename p6 ""; set n}
+test 2 {proc p7 {a a} { set a }; set n [p7 1 2]; rename p7 ""; set n}
+test {3 7} {proc p8 {x} { unset x; set x 3; list $x [+ $x 4] }; set n [p8 1]; rename p8 ""; set n}
+test {5 5} {set s 1; proc p9 {x} { upvar 1 s x; set x 5; list $x [set x] }; set n [p9 1]; rename p9 ""; list $s [lindex $n 0]}
+test -1 {proc p10 {x y} { list $x $y }; catch {p10 1} e; rename p10 ""; set e}
+test {1 2} {proc g1 {} { return 1 }; proc c1 {} { g1 }; set a [c1]; rename g1 ""; proc g1 {} { return 2 }; set b [c1]; rename g1 ""; rename c1 ""; list $a $b}
+test {3 2 4} {proc c2 {x} { $x 1 2 }; proc c3 {x} { $x+ 2 2 }; set n [list [c2 +] [c2 *] [c3 ""]]; rename c2 ""; rename c3 ""; set n}
 test 120 {set cnt 5; set acc 1; while {> $cnt 1} { set acc [* $acc $cnt]; incr cnt -1 }; set acc; };
+test 10 {set cnt 0; set acc 0; while {< $cnt 5} { set acc [+ $acc $cnt]; incr cnt }; set acc; };
+test {2 4 6} {set s {lappend ca [* $j 2]}; for {set j 1} {<= $j 3} {incr j} { eval $s }; set ca}
+test {1 -1 -1 1} {set s {+ 0 1}; lappend cb [eval $s]; set s {- 0 1}; lappend cb [eval $s] [eval $s]; set s {+ 0 1}; lappend cb [eval $s]}
 test 1 {eq a a}
 fails {eq}
 fails {eq a}
@@ -324,8 +342,23 @@ state {rename square sq}
 state {proc fib {x} { if {<= $x 1} { return 1; } else { + [fib [- $x 1]] [fib [- $x 2]]; } }}
 test 89 {fib 10}
 test 0 {> 0 [info command fib]}
+state {for {set j 0} {< $j 40} {incr j} { proc gen$j {} "return $j" }}
+test 40 {set n 0; for {set j 0} {< $j 40} {incr j} { set n [+ $n [eq [gen$j] $j]] }; set n}
+test gen7 {info command name [info command gen7]}
+test -1 {for {set j 0} {< $j 40} {incr j} { rename gen$j "" }; info command gen7}
 state {rename fib ""}
 test -1 {info command fib}
+state {proc p1 {x} { set y "<$x>"; set y "$y[+ $x 1]"; }}
+test {<1>2} {p1 1}
+test {<2>3} {p1 2}
+state {proc p2 {} { set a 1; set b [; set c 3 }}
+fails {p2}
+fails {p2}
+state {proc p3 {} { rename p3 ""; return gone 0; }}
+test {gone} {p3}
+test -1 {info command p3}
+state {rename p1 ""}
+state {rename p2 ""}
 test 16 {sq 4}
 state {rename sq ""}
 fails {string}
@@ -546,6 +579,13 @@ test {a c} {set z "a b c";   lset z 1 ""}
 test {a} {set z "a b";   lset z 1 ""}
 test {} {set z "a";   lset z 0 ""}
 test {b} {set z "a b";   lset z 0 ""}
+test {x {b c} d} {set z {a {b c} d}; lset z 0 x}
+test {{b c} 3 {y z}} {set z {a {b c} d}; lset z 2 {y z}; list [lindex $z 1] [llength $z] [lindex $z 2]}
+test {a {y z} {b c} d} {linsert {a {b c} d} 1 {y z}}
+test {q {b c} d} {lreplace {a {b c} d} 0 0 q}
+test {{b c} d} {lrange {a {b c} d {e f}} 1 2}
+test {} {lrange {a b} 3 5}
+test a {lsearch -inline {a b} a}
 test {a b c} {split a.b.c .}
 test {a { } b { } c} {split "a b c" ""}
 test {a b} {split "a.b" "."}
@@ -608,6 +648,21 @@ test {1 2 3} {lsort -integer {1 2 3}}
 test {3 2 1} {lsort -integer -decreasing {1 2 3}}
 fails {lsort}
 fails {lsort -integer {1 2 a}}
+test {a {a c} b} {lsort {b {a c} a}}
+test {-1 9 9 10 100} {lsort -integer {10 9 -1 100 9}}
+test {-1 9 10 100} {lsort -unique -integer {10 9 -1 100 9}}
+test {a b c} {lsort -unique {b a b c a}}
+test {{y 1} {w 1} {z 2} {x 3}} {lsort -index 1 {{x 3} {y 1} {z 2} {w 1}}}
+test {{y 10} {w 10} {x 3} {z 2}} {lsort -index 1 -integer -decreasing {{x 3} {y 10} {z 2} {w 10}}}
+fails {lsort -index 2 {{a b}}}
+fails {lsort -index {a b}}
+# Lists longer than the spans of elements 'pickle -a' can record in one go
+test {40 0 39 35} {set b {}; for {set k 0} {< $k 40} {incr k} { lappend b $k }; list [llength $b] [lindex $b 0] [lindex $b 39] [lindex $b 35]}
+test {39 38 37 36} {set b {}; for {set k 0} {< $k 40} {incr k} { lappend b $k }; lrange [lsort -integer -decreasing $b] 0 3}
+test {35 34 33} {set b {}; for {set k 0} {< $k 40} {incr k} { lappend b $k }; lrange [lreverse $b] 4 6}
+test {33 x 35} {set b {}; for {set k 0} {< $k 40} {incr k} { lappend b $k }; lset b 34 x; lrange $b 33 35}
+# More variables in a call frame than buckets 'pickle -a' can give its hash table
+test {199 150} {for {set k 0} {< $k 200} {incr k} { set v$k $k }; unset v10; unset v11; list [set v199] [set v150]}
 
 # Test upvar links
 state {proc n2 {} { upvar 1 h u; set u [+ $u 1]; }}
@@ -645,8 +700,22 @@ test  {1 2 3 a b {c d}} {set l1 {1 2 3}; lappend l1 a b {c d}}
 test  {1 2 3 a b {c d}} {set l1 {1 2 3}; lappend l1 a b {c d}; set l1}
 test  {a b {c d}} {lappend l1 a b {c d}; set l1}
 test  {} {lappend l2}
+# A failed 'lappend' leaves its variable as it was; the pool used by 'pickle -a' cannot hold the result
+if {!= [heap] 0} {
+	if {== [heap buddy] 0} {
+		test 480 {set lf [string repeat x 480]; catch {lappend lf [string repeat y 40]} e; string length $lf}
+	}
+}
 test  {a b c} {lappend l3 a b c}
 fails {lappend}
+test {a b} {set l4 ""; lappend l4 a b}
+test {{{a b} c d} 3 {{a b} c}} {lappend l5 {a b} c; set l6 $l5; lappend l5 d; list $l5 [llength $l5] $l6}
+test abcdef {append s1 abc def}
+test {abcdefghijklmnop abcdefgh 1} {set s2 abcdefgh; set s3 $s2; append s2 ijkl mnop; list $s2 $s3 [eq $s3 abcdefgh]}
+test 13 {set s4 12; append s4 ""; append s4 ""; + $s4 1}
+test 52 {set s5 5; append s5 1; + $s5 1}
+test {} {append s6}
+fails {append}
 test "hello" {apply {{} { return hello 0; }}}
 test 4 {apply {{x} {* $x $x}} 2}
 test 8 {apply {{x y} {* $x $y}} 2 4}
@@ -685,6 +754,36 @@ test  {0 3} {reg -lazy {ba?c?d} {bacd}}
 test  {0 4} {reg -possessive {a*c} {aaaac}}
 test  {-1 -1} {reg -possessive {.*c} {aaaac}}
 test  {0 4} {reg -greedy {.*c} {aaaac}}
+# longer patterns must still compile when every block is small, as under 'pickle -a'
+test  {3 17} {reg {hello.*world} "xx hello big world"}
+test  {0 26} {reg {a.*b.*c.*d.*e.*f.*g.*h.*i} "a1b2c3d4e5f6g7h8i_abcdefghi"}
+test 1 {string match "*abc*c?d*e*f*g*h*" "xxabcyycXdeefgh"}
+
+# File handles, on a temporary file; tests are run in a procedure, so the
+# handle is used at the global level
+set fh [fopen unit.tmp wb]
+$fh -puts "a\nb c\nd"
+$fh -close
+set fh [fopen unit.tmp rb]
+fails {uplevel #0 {$fh -lines 0}}
+fails {uplevel #0 {$fh -lines -1}}
+fails {uplevel #0 {$fh -lines x}}
+test {a {b c}} {uplevel #0 {$fh -lines 2}}
+test d {uplevel #0 {$fh -lines 2305843009213693953}}
+test 1 {uplevel #0 {$fh -eof}}
+$fh -close
+set fh [fopen unit.tmp w+]
+$fh -puts "set x 1\nset y 2\n+ \$x \$y"
+test "set x 1\nset y 2\n+ \$x \$y" {uplevel #0 {$fh -rewind; $fh -readall}}
+test {} {uplevel #0 {$fh -readall}}
+test 0 {uplevel #0 {$fh -seek 4 start}}
+test "x 1\n" {uplevel #0 {$fh -gets}}
+test "set y 2\n+ \$x \$y" {uplevel #0 {$fh -readall}}
+$fh -close
+test 3 {source unit.tmp}
+frename unit.tmp ""
+unset fh
+
 # TODO Check more regex conditions
 # - errors: operators without preceding char "?", "*", "+"
 # - unescaped operators: eg "??" (should be "\??")
@@ -715,6 +814,7 @@ puts "MEMORY STATISTICS"
 set heaps [heap arenas]
 set m 0
 set i 0
+set blk 0; set sz 0; set used 0
 
 while {< $i $heaps} {
 	set blk   [heap arena-block  $i]
@@ -725,6 +825,8 @@ while {< $i $heaps} {
 	puts "ARENA $i:   $blk $sz $used $max"
 	incr i
 }
+set m [+ $m [heap buddy]]
+set m [+ $m [heap slab-memory]]
 
 puts "TOTAL:      [heap total]"
 puts "BLOCK:      [heap blocks]"
@@ -739,5 +841,9 @@ puts "WASTED:     [- 100 [/ [* [heap max] 100] $m]]%"
 
 unset heaps; unset i; unset m; unset blk; unset sz; unset used;
 
+# Report failures with the custom allocator as well, only exiting when there
+# are any so the interpreter is still cleaned up otherwise
+if {!= $failed 0} { exit $failed }
+
 # Prints wrong line number on Windows, related (depends on this line!)
 